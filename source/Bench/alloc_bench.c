@@ -0,0 +1,411 @@
+/*
+ * host-side benchmark / stress harness for modules/alloc.h (make bench-alloc)
+ *
+ * notas:
+ *  - alloc.h is compiled as-is in user space; the heap is an mmap'd arena that stands in
+ *    for _kernel_heap_start/_kernel_heap_end, kheap_extend just moves kheap_end
+ *  - every workload runs in a fork()ed child, so each one starts from a fresh allocator
+ *  - same seed every run: numbers are comparable between allocator changes
+ *  - usage: alloc_bench [-n] [arena-MiB] [workload...]   (-n: no magazines, boot path)
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define PAGE_SIZE 4096ULL
+#define LARGE_PAGE_SIZE 0x200000ULL
+
+#define kprintf printf
+
+// single thread, nothing to preempt
+static inline void preempt_disable(void) { }
+static inline void preempt_enable(void) { }
+static inline void cpu_relax(void) { }
+
+// the arena (what the linker script and init/map.h give the kernel)
+static uint8_t* _kernel_heap_start;
+static uint8_t* _kernel_heap_end;
+static uint8_t* arena_end;
+
+#include "../Kernel/modules/alloc.h"
+
+static uint8_t* kheap_max_end(void)
+{
+    return arena_end;
+}
+
+// the kernel maps 2 MiB at a time, keep the same granularity
+static bool kheap_extend(uint8_t* new_end)
+{
+    if (new_end > kheap_limit)
+        return false;
+
+    while (kheap_end < new_end)
+        kheap_end += LARGE_PAGE_SIZE;
+
+    return true;
+}
+
+// one magazine set, as if everything ran on a single kernel thread
+static kmem_magazine_t bench_mags[KMEM_MAX_CACHES];
+static kmem_magazine_t* bench_mags_cur = bench_mags;
+
+static kmem_magazine_t* kmem_local_magazines(void)
+{
+    return bench_mags_cur;
+}
+
+// ----------------------------------------------------------------------------
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static inline uint64_t xorshift(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// live requested bytes, for the fragmentation figure
+static size_t live_bytes = 0;
+static size_t live_peak = 0;
+
+static void* bench_alloc(size_t size)
+{
+    void* p = kmalloc(size);
+    if (!p)
+    {
+        printf("  out of memory at %zu bytes live\n", live_bytes);
+        exit(1);
+    }
+
+    // touch it like a real user would (and catch overlaps with the check below)
+    memset(p, (int)(size & 0xFF), size < 64 ? size : 64);
+
+    live_bytes += size;
+    if (live_bytes > live_peak)
+        live_peak = live_bytes;
+
+    return p;
+}
+
+static void bench_free(void* p, size_t size)
+{
+    if (*(uint8_t*)p != (uint8_t)(size & 0xFF))
+    {
+        printf("  corrupted object %p (size %zu)\n", p, size);
+        exit(1);
+    }
+
+    live_bytes -= size;
+    kfree(p);
+}
+
+/* report:
+ *  - ns/op: one kmalloc or one kfree
+ *  - peak: kbrk high-water mark (what the heap had to grow to)
+ *  - frag: 1 - peak live requested bytes / peak heap
+ */
+static void report(const char* name, uint64_t ops, uint64_t ns)
+{
+    kmem_stats_t st;
+    kmem_get_stats(&st);
+
+    int frag = st.heap_peak ? (int)(100 - (live_peak * 100) / st.heap_peak) : 0;
+
+    printf("%-10s %10llu ops %8.1f ns/op   peak %7zu KiB   live-peak %7zu KiB   frag %3d%%\n",
+        name, (unsigned long long)ops, ops ? (double)ns / (double)ops : 0.0,
+        st.heap_peak >> 10, live_peak >> 10, frag);
+}
+
+// ----------------------------------------------------------------------------
+
+/* sweep: batches of one size, every class and a few large sizes
+ *  - 1024 allocs then 1024 frees in reverse order, repeated
+ */
+#define SWEEP_BATCH 1024
+#define SWEEP_ROUNDS 64
+
+static void wl_sweep(void)
+{
+    static const size_t sizes[] = { 8, 16, 24, 32, 48, 64, 96, 128, 200, 256, 512, 1000, 1024, 2048, 4096, 16384 };
+    static void* p[SWEEP_BATCH];
+
+    uint64_t total_ops = 0, total_ns = 0;
+
+    printf("  size      ns/op\n");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+    {
+        uint64_t t0 = now_ns();
+
+        for (int r = 0; r < SWEEP_ROUNDS; ++r)
+        {
+            for (int i = 0; i < SWEEP_BATCH; ++i)
+                p[i] = bench_alloc(sizes[s]);
+
+            for (int i = SWEEP_BATCH - 1; i >= 0; --i)
+                bench_free(p[i], sizes[s]);
+        }
+
+        uint64_t ns = now_ns() - t0;
+        uint64_t ops = 2ULL * SWEEP_BATCH * SWEEP_ROUNDS;
+
+        printf("  %-8zu %6.1f\n", sizes[s], (double)ns / (double)ops);
+
+        total_ops += ops;
+        total_ns += ns;
+    }
+
+    report("sweep", total_ops, total_ns);
+}
+
+/* prodcons: a producer allocates into a FIFO, a consumer frees from the other end
+ *  - producer and consumer use different magazine sets (two threads), so objects
+ *    always come back through the other side's magazine
+ *  - mixed small sizes
+ */
+#define PC_QUEUE 4096
+#define PC_OPS   (1 << 21)
+
+static void wl_prodcons(void)
+{
+    static kmem_magazine_t consumer_mags[KMEM_MAX_CACHES];
+    static void* q[PC_QUEUE];
+    static size_t qs[PC_QUEUE];
+
+    kmem_magazine_t* producer_mags = bench_mags_cur;
+    size_t head = 0, tail = 0;
+
+    uint64_t t0 = now_ns();
+
+    for (uint64_t i = 0; i < PC_OPS; ++i)
+    {
+        // producer runs ahead in bursts, consumer catches up
+        if (head - tail < PC_QUEUE && (xorshift() & 3) != 0)
+        {
+            size_t sz = 16 + xorshift() % 496;
+            q[head % PC_QUEUE] = bench_alloc(sz);
+            qs[head % PC_QUEUE] = sz;
+            head++;
+        }
+        else if (tail < head)
+        {
+            if (producer_mags)
+                bench_mags_cur = consumer_mags;
+
+            bench_free(q[tail % PC_QUEUE], qs[tail % PC_QUEUE]);
+            tail++;
+
+            bench_mags_cur = producer_mags;
+        }
+    }
+
+    uint64_t ns = now_ns() - t0;
+
+    while (tail < head)
+    {
+        bench_free(q[tail % PC_QUEUE], qs[tail % PC_QUEUE]);
+        tail++;
+    }
+
+    report("prodcons", head + tail, ns);
+}
+
+/* churn: random replacement over a live set of mixed sizes (mostly small, some large)
+ *  - measures how far the heap grows past what is actually live
+ */
+#define CHURN_LIVE 8192
+#define CHURN_OPS  (1 << 21)
+
+static void wl_churn(void)
+{
+    static void* p[CHURN_LIVE];
+    static size_t ps[CHURN_LIVE];
+    uint64_t ops = 0;
+
+    uint64_t t0 = now_ns();
+
+    for (uint64_t i = 0; i < CHURN_OPS; ++i)
+    {
+        size_t slot = xorshift() % CHURN_LIVE;
+
+        if (p[slot])
+        {
+            bench_free(p[slot], ps[slot]);
+            p[slot] = NULL;
+        }
+        else
+        {
+            uint64_t r = xorshift();
+            ps[slot] = (r & 15) ? 1 + (r >> 8) % 2048 : 2049 + (r >> 8) % 30000;
+            p[slot] = bench_alloc(ps[slot]);
+        }
+
+        ops++;
+    }
+
+    uint64_t ns = now_ns() - t0;
+
+    for (size_t i = 0; i < CHURN_LIVE; ++i)
+        if (p[i])
+            bench_free(p[i], ps[i]);
+
+    report("churn", ops, ns);
+}
+
+/* pages: multi-page blocks through the large path (page_alloc / page_free, order 2)
+ *  - a window of live blocks with small allocations in between
+ *  - not thread stacks: those have their own allocator (init/stack.h kstack_alloc)
+ */
+#define PAGES_BLOCK (4 * PAGE_SIZE)
+#define PAGES_LIVE  64
+#define PAGES_OPS   (1 << 18)
+
+static void wl_pages(void)
+{
+    static void* blk[PAGES_LIVE];
+    static void* small[PAGES_LIVE];
+    uint64_t ops = 0;
+
+    uint64_t t0 = now_ns();
+
+    for (uint64_t i = 0; i < PAGES_OPS; ++i)
+    {
+        size_t slot = xorshift() % PAGES_LIVE;
+
+        if (blk[slot])
+        {
+            bench_free(blk[slot], PAGES_BLOCK);
+            bench_free(small[slot], 96);
+            blk[slot] = NULL;
+        }
+        else
+        {
+            blk[slot] = bench_alloc(PAGES_BLOCK);
+            small[slot] = bench_alloc(96);
+        }
+
+        ops += 2;
+    }
+
+    uint64_t ns = now_ns() - t0;
+
+    for (size_t i = 0; i < PAGES_LIVE; ++i)
+        if (blk[i])
+        {
+            bench_free(blk[i], PAGES_BLOCK);
+            bench_free(small[i], 96);
+        }
+
+    report("pages", ops, ns);
+}
+
+// ----------------------------------------------------------------------------
+
+typedef struct
+{
+    const char* name;
+    void (*fn)(void);
+} workload_t;
+
+static const workload_t workloads[] =
+{
+    { "sweep",    wl_sweep    },
+    { "prodcons", wl_prodcons },
+    { "churn",    wl_churn    },
+    { "pages",    wl_pages    },
+};
+#define NR_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static size_t arena_size = 256ULL << 20;
+
+// fresh arena + allocator in a child process
+static int run(const workload_t* w)
+{
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0)
+    {
+        uint8_t* a = mmap(NULL, arena_size + LARGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (a == MAP_FAILED)
+        {
+            perror("mmap");
+            _exit(1);
+        }
+
+        // 2 MiB aligned like the kernel heap, with the first 2 MiB "mapped"
+        _kernel_heap_start = (uint8_t*)(((uintptr_t)a + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1));
+        _kernel_heap_end = _kernel_heap_start + LARGE_PAGE_SIZE;
+        arena_end = _kernel_heap_start + arena_size;
+
+        printf("[%s]\n", w->name);
+        w->fn();
+
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+int main(int argc, char** argv)
+{
+    int first = 1;
+
+    if (first < argc && strcmp(argv[first], "-n") == 0)
+    {
+        bench_mags_cur = NULL;
+        first++;
+    }
+
+    if (first < argc && argv[first][0] >= '0' && argv[first][0] <= '9')
+        arena_size = strtoull(argv[first++], NULL, 0) << 20;
+
+    printf("alloc bench: arena %zu MiB, magazines %s\n", arena_size >> 20, bench_mags_cur ? "on" : "off");
+
+    int failed = 0;
+
+    for (size_t i = 0; i < NR_WORKLOADS; ++i)
+    {
+        bool selected = first >= argc;
+
+        for (int a = first; a < argc; ++a)
+            if (strcmp(argv[a], workloads[i].name) == 0)
+                selected = true;
+
+        if (selected)
+            failed |= run(&workloads[i]);
+    }
+
+    return failed;
+}
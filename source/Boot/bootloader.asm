@@ -37,6 +37,9 @@ _start:
     mov dl, [BOOT_DISK]
     int 0x13
 
+    ; BIOS memory map for the kernel PMM (only reachable from real mode)
+    call detect_memory
+
     mov ah, 0
     mov al, 3
     int 0x10
@@ -119,12 +122,41 @@ bprintnf:
 .done:
     ret
 
+; E820 -> boot_info at BOOT_INFO (see source/Struct/bootinfo.asm)
+detect_memory:
+    mov dword [BOOT_INFO], 0
+    mov dword [BOOT_INFO + 4], 0
+    mov di, BOOT_INFO_E820
+    xor ebx, ebx                ; continuation value, 0 = start
+.next_entry:
+    mov eax, 0xE820
+    mov ecx, E820_ENTRY_SIZE
+    mov edx, 0x534D4150         ; 'SMAP'
+    mov dword [di + 20], 1      ; ACPI 3.x "valid" bit for BIOSes that skip it
+    int 0x15
+    jc .done                    ; unsupported or past the last entry
+
+    cmp eax, 0x534D4150
+    jne .done
+
+    inc word [BOOT_INFO]
+    add di, E820_ENTRY_SIZE
+
+    cmp word [BOOT_INFO], BOOT_INFO_MAX_E820
+    je .done
+
+    test ebx, ebx               ; 0 -> that was the last entry
+    jnz .next_entry
+.done:
+    ret
+
 ATA_PRESENT: db 0
 
 boot_msg db "boot image reached", 0dh, 0ah, 0
 no_ata_found_msg db "[ PANIC ] boot: ATA PIO not present", 0dh, 0ah, 0
 
 %include "source/Struct/gdt32.asm"
+%include "source/Struct/bootinfo.asm"
 
 [BITS 32]
 ; 0x7c65
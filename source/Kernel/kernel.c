@@ -1,9 +1,9 @@
 /* subsystems:
- *    - threading (round-robin scheduler)
+ *    - threading (round-robin scheduler, per-CPU run queues, SMP, kmutex / rwsem)
  *    - tty (console)
  *    - ramfs (WIP)
- *    - interrupts, IRQ
- *    - timer
+ *    - interrupts, IRQ (softirq / tasklet / workqueue bottom halves)
+ *    - timer (tsc clocksource, lapic clock events, tickless idle)
  */
 
 // 0xffffffff80000000 - 0xffffffff80200000
@@ -39,19 +39,19 @@ extern uint8_t _kernel_vma[];
 extern uint8_t _kernel_lma[];
 extern uint8_t _kernel_vo[];
 
-// kernel entrypoint
+// kernel entrypoint -> RDI = boot_info (physical), kept intact until init(boot_info)
 void kstart(void)
 {
     asm volatile("nop; nop; nop; nop");
 
     asm volatile(
-        "mov %0, %%rax\n\t"
+        "movabs %[top], %%rax\n\t"
         "and $-16, %%rax\n\t"
         "sub $8, %%rax\n\t"
         "mov %%rax, %%rsp\n\t"
         "mov %%rsp, %%rbp\n\t"
         :
-        : "r"(_kernel_stack_end)
+        : [top] "i"(_kernel_stack_end)
         : "rax", "memory"
     );
 
@@ -83,7 +83,11 @@ __attribute__((noreturn)) void panic(void)
     halt();
 }
 
+#include "modules/clock.h"
 #include "modules/threads.h"
+#include "modules/mutex.h"
+#include "modules/timer.h"
+#include "modules/softirq.h"
 
 struct file;
 struct fops_t
@@ -106,10 +110,18 @@ struct file
 #include "modules/sys.h"
 #include "modules/klib.h"
 #include "modules/init.h"
+#include "modules/bench.h"
 
 void sleep(uint64_t ms)
 {
-    uint64_t target = cpu_ticks + ms / 10;
+    // threads block on a timer; before the scheduler there is only the tick to wait for
+    if (current)
+    {
+        kthread_sleep_ms(ms);
+        return;
+    }
+
+    uint64_t target = cpu_ticks + ms_to_ticks(ms);
     
     while (cpu_ticks < target)
     {
@@ -154,9 +166,9 @@ void main(void)
     asm volatile("int $0xF0"); // beep
     kprintf("\nv0 is alive!\n");
 
-    char* str = kmalloc(32 * sizeof(char));
+    char* str = kzalloc(32 * sizeof(char));
 
-    char** argv = kmalloc(MAX_TOKENS * sizeof(char));
+    char** argv = kmalloc(MAX_TOKENS * sizeof(char*));
     int* argc = kmalloc(sizeof(int));
 
     for (;;)
@@ -180,6 +192,42 @@ void main(void)
                     dump_runqueue();
                 else if (strcmp(argv[1], "testmem") == 0)
                     test_all_access();
+                else if (strcmp(argv[1], "magazine") == 0)
+                    kmem_dump_magazines();
+                else if (strcmp(argv[1], "slab") == 0)
+                    kmem_dump_slabs();
+                else if (strcmp(argv[1], "heap") == 0)
+                    kmem_dump_heap();
+                else if (strcmp(argv[1], "memmap") == 0)
+                    dump_memmap();
+                else if (strcmp(argv[1], "clock") == 0)
+                    dump_clock();
+                else if (strcmp(argv[1], "fpu") == 0)
+                    dump_fpu();
+                else if (strcmp(argv[1], "stacks") == 0)
+                    dump_kstack();
+                else if (strcmp(argv[1], "softirq") == 0)
+                    dump_softirq();
+                else if (strcmp(argv[1], "locks") == 0)
+                    dump_locks();
+                else if (strcmp(argv[1], "sched") == 0)
+                    dump_sched();
+                else if (strcmp(argv[1], "bench") == 0 && *argc > 2)
+                    bench_run(argv[2]);
+                else if (strcmp(argv[1], "preempt") == 0)
+                {
+                    if (*argc > 2)
+                        sched_preempt = strcmp(argv[2], "off") != 0;
+
+                    kprintf("preempt: %s\n", sched_preempt ? "on" : "off");
+                }
+                else if (strcmp(argv[1], "idle") == 0)
+                {
+                    if (*argc > 2)
+                        idle_mwait = idle_mwait_ok && strcmp(argv[2], "hlt") != 0;
+
+                    kprintf("idle: %s%s\n", idle_mwait ? "mwait" : "hlt", idle_mwait_ok ? "" : " (no mwait)");
+                }
             }
         }
     }
@@ -2,17 +2,24 @@
 #define ALLOC_H
 
 /*
- * slab allocator + kbrk bump allocator
+ * slab allocator + buddy page allocator + kbrk bump allocator
  *
  * notas:
- *  - slabs ocupam 1 página (PAGE_SIZE) cada; cada slab tem header no início da página
+ *  - kbrk só alimenta o buddy (page_alloc/page_free), em chunks alinhados
+ *  - o heap começa em .heap e cresce sob demanda (kheap_extend, init/map.h) até kheap_limit
+ *  - page_map[] guarda um page_t por página do heap (tipo, order, cache) -> kfree/ksize em O(1)
+ *  - slabs ocupam 2^slab_order páginas; o header fica no início (on-slab) ou num objeto do
+ *    cache interno "slab" (off-slab), o que desperdiçar menos
+ *  - objetos >= CACHE_LINE_SIZE são alinhados à cache line; a sobra do slab vira "cor":
+ *    cada slab novo desloca os objetos em mais uma cache line (slabs não colidem nos mesmos sets)
  *  - para objetos maiores que MAX_SMALL_OBJECT (2K), alocações grandes usam
- *    multiple-pages com um header simples para poder liberar
- *  - não há coalescing de grandes chunks
+ *    um bloco do buddy (2^order páginas) sem header, o order fica no page_t
+ *  - blocos livres coalescem com o buddy até PAGE_MAX_ORDER
  *
  */
 
 #define CHUNK_ALIGNMENT_BYTES 8
+#define CACHE_LINE_SIZE 64
 
 // classes de cache (potências de 2)
 static const size_t cache_sizes[] =
@@ -24,22 +31,88 @@ static const size_t cache_sizes[] =
 #define MAX_SMALL_OBJECT 2048
 
 static uint8_t* kbrk_ptr = NULL;
+static uint8_t* kbrk_peak = NULL; // high-water mark of kbrk_ptr
 
 static inline size_t align_up(size_t x)
 {
     return (x + (CHUNK_ALIGNMENT_BYTES - 1)) & ~(CHUNK_ALIGNMENT_BYTES - 1);
 }
 
+// heap base; buddy offsets and page_map indexes are relative to it
+static uint8_t* kheap_base = NULL;
+static uint8_t* kheap_end = NULL;   // end of mapped heap memory
+static uint8_t* kheap_limit = NULL; // the heap never grows past this (page_map covers up to here)
+
+// provided by init/map.h (pmm): how far the heap may grow and the mapping itself
+static uint8_t* kheap_max_end(void);
+static bool kheap_extend(uint8_t* new_end);
+
+/* page descriptors (like linux struct page, but 8 bytes)
+ *  - FREE       -> owned by the buddy (order valid only on the head of a free block)
+ *  - SLAB       -> slab page of caches[cache], header at kheap_base + slab
+ *  - LARGE_HEAD -> first page of a large kmalloc of 2^order pages
+ *  - LARGE_TAIL -> remaining pages of it (not a valid kfree target)
+ */
+typedef enum
+{
+    PAGE_KIND_FREE = 0,
+    PAGE_KIND_SLAB,
+    PAGE_KIND_LARGE_HEAD,
+    PAGE_KIND_LARGE_TAIL,
+} page_kind_t;
+
+#define PAGE_ORDER_NONE 0xFF
+
+typedef struct
+{
+    uint8_t kind;
+    uint8_t order;
+    uint16_t cache;
+    uint32_t slab;
+} page_t;
+
+static page_t* page_map = NULL;
+static size_t nr_heap_pages = 0;
+
+void *kbrk(ssize_t increment);
+
 void kbrk_init(void)
 {
     uintptr_t base = (uintptr_t)_kernel_heap_start;
     base = (base + (CHUNK_ALIGNMENT_BYTES - 1)) & ~(CHUNK_ALIGNMENT_BYTES - 1);
     kbrk_ptr = (uint8_t*)base;
+    kheap_end = _kernel_heap_end;
+    kheap_limit = kheap_max_end();
+
+    // page_map covers every page the heap can ever have and is carved from the heap start
+    size_t npages = (size_t)(kheap_limit - kbrk_ptr) / PAGE_SIZE;
+    page_map = kbrk(npages * sizeof(page_t));
+    memset(page_map, 0, npages * sizeof(page_t));
+
+    // buddy wants a page granular base
+    size_t misalign = (uintptr_t)kbrk_ptr & (PAGE_SIZE - 1);
+    if (misalign)
+        kbrk(PAGE_SIZE - misalign);
+
+    kheap_base = kbrk_ptr;
+    nr_heap_pages = (size_t)(kheap_limit - kheap_base) / PAGE_SIZE;
+}
+
+// descriptor of the page holding `addr`, NULL outside the heap
+static inline page_t* page_of(const void* addr)
+{
+    uintptr_t a = (uintptr_t)addr;
+
+    if (a < (uintptr_t)kheap_base || a >= (uintptr_t)kheap_limit)
+        return NULL;
+
+    return &page_map[(a - (uintptr_t)kheap_base) / PAGE_SIZE];
 }
 
 /* kbrk:
  *  - kbrk(0) => retorna current break
  *  - kbrk(n) => avança n (alinhado) e retorna old break
+ *  - mapeia mais memória (kheap_extend) quando passa de kheap_end
  *  - retorna NULL em sem espaço
  *
  * increment pode ser 0; retorna NULL se kbrk_ptr não inicializado
@@ -57,10 +130,13 @@ void *kbrk(ssize_t increment)
     inc = align_up(inc);
 
     uint8_t* new_ptr = kbrk_ptr + inc;
-    if (new_ptr > _kernel_heap_end) // overflow
+    if (new_ptr > kheap_end && !kheap_extend(new_ptr)) // overflow
         return NULL;
 
     kbrk_ptr = new_ptr;
+    if (kbrk_ptr > kbrk_peak)
+        kbrk_peak = kbrk_ptr;
+
     return old;
 }
 
@@ -74,64 +150,394 @@ static inline void spinlock_init(spinlock_t* lk)
     lk->lock = 0;
 }
 
+// held locks also hold off preemption (a preempted holder would leave the next thread spinning)
 static inline void spin_lock(spinlock_t* lk)
 {
+    preempt_disable();
+
     while (__atomic_test_and_set(&lk->lock, __ATOMIC_ACQUIRE));
         /* busy wait */
 }
 
 static inline void spin_unlock(spinlock_t* lk)
+{
+    __atomic_clear(&lk->lock, __ATOMIC_RELEASE);
+
+    preempt_enable();
+}
+
+// no preempt bookkeeping: for locks only ever taken with IF=0 (scheduler, timer wheel)
+static inline void raw_spin_lock(spinlock_t* lk)
+{
+    while (__atomic_test_and_set(&lk->lock, __ATOMIC_ACQUIRE))
+        cpu_relax();
+}
+
+static inline void raw_spin_unlock(spinlock_t* lk)
 {
     __atomic_clear(&lk->lock, __ATOMIC_RELEASE);
 }
 
-typedef struct
+/* buddy page allocator
+ *  - block of order k = 2^k pages, aligned to its size relative to kheap_base
+ *  - free blocks live on free_area[k] (doubly linked through the block itself)
+ *  - alloc: first order >= k with a free block, split down -> O(PAGE_MAX_ORDER)
+ *  - free: merge with the buddy while it is free and of the same order -> O(PAGE_MAX_ORDER)
+ *  - when nothing fits, page_grow() takes the next aligned chunk from kbrk
+ */
+#define PAGE_MAX_ORDER  8 // 2^8 pages = 1 MiB
+
+typedef struct page_block
 {
-    size_t pages;
-} large_alloc_hdr_t;
+    struct page_block* next;
+    struct page_block* prev;
+} page_block_t;
+
+static page_block_t* free_area[PAGE_MAX_ORDER + 1];
+static size_t nr_free_pages = 0;
+static spinlock_t page_lock;
+
+static inline void page_block_push(page_block_t* b, uint32_t order)
+{
+    page_t* pg = page_of(b);
+    pg->kind = PAGE_KIND_FREE;
+    pg->order = (uint8_t)order;
+
+    b->prev = NULL;
+    b->next = free_area[order];
+
+    if (free_area[order])
+        free_area[order]->prev = b;
+
+    free_area[order] = b;
+    nr_free_pages += 1UL << order;
+}
+
+static inline void page_block_unlink(page_block_t* b)
+{
+    page_t* pg = page_of(b);
+
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        free_area[pg->order] = b->next;
+
+    if (b->next)
+        b->next->prev = b->prev;
+
+    nr_free_pages -= 1UL << pg->order;
+    pg->order = PAGE_ORDER_NONE;
+}
+
+// smallest order whose block holds `pages` pages
+static inline uint32_t page_order_for(size_t pages)
+{
+    uint32_t order = 0;
+    while ((1UL << order) < pages)
+        order++;
+
+    return order;
+}
+
+/* takes the next chunk from kbrk: the largest order that is both aligned at the
+ * current break and still fits in the heap; returns false when the heap is exhausted
+ */
+static bool page_grow(void)
+{
+    size_t offset = (size_t)(kbrk_ptr - kheap_base) / PAGE_SIZE;
+    size_t left = (size_t)(kheap_limit - kbrk_ptr) / PAGE_SIZE;
+
+    if (left == 0)
+        return false;
+
+    uint32_t order = 0;
+    while (order < PAGE_MAX_ORDER
+        && (offset & (1UL << order)) == 0
+        && (2UL << order) <= left)
+        order++;
+
+    void* chunk = kbrk(PAGE_SIZE << order);
+    if (!chunk)
+        return false;
+
+    page_block_push((page_block_t*)chunk, order);
+    return true;
+}
+
+// allocates 2^order contiguous pages; NULL when the heap is exhausted
+void* page_alloc(uint32_t order)
+{
+    if (order > PAGE_MAX_ORDER)
+        return NULL;
+
+    if (!kbrk_ptr) kbrk_init();
+
+    spin_lock(&page_lock);
+
+    uint32_t k = order;
+    for (;;)
+    {
+        while (k <= PAGE_MAX_ORDER && !free_area[k])
+            k++;
+
+        if (k <= PAGE_MAX_ORDER)
+            break;
+
+        if (!page_grow())
+        {
+            spin_unlock(&page_lock);
+            return NULL;
+        }
+
+        k = order;
+    }
+
+    page_block_t* b = free_area[k];
+    page_block_unlink(b);
+
+    // split: upper halves go back to the lower orders
+    while (k > order)
+    {
+        k--;
+        page_block_push((page_block_t*)((uint8_t*)b + (PAGE_SIZE << k)), k);
+    }
+
+    spin_unlock(&page_lock);
+    return b;
+}
+
+// returns a block from page_alloc(order), merging it with free buddies
+void page_free(void* addr, uint32_t order)
+{
+    if (!addr || order > PAGE_MAX_ORDER)
+        return;
+
+    spin_lock(&page_lock);
+
+    uint8_t* block = (uint8_t*)addr;
+
+    while (order < PAGE_MAX_ORDER)
+    {
+        size_t offset = (size_t)(block - kheap_base);
+        page_block_t* buddy = (page_block_t*)(kheap_base + (offset ^ (PAGE_SIZE << order)));
+
+        // buddy must be inside the grown heap, free and whole
+        if ((uint8_t*)buddy + (PAGE_SIZE << order) > kbrk_ptr)
+            break;
+
+        page_t* bpg = page_of(buddy);
+        if (bpg->kind != PAGE_KIND_FREE || bpg->order != order)
+            break;
+
+        page_block_unlink(buddy);
+
+        if ((uint8_t*)buddy < block)
+            block = (uint8_t*)buddy;
+
+        order++;
+    }
+
+    page_block_push((page_block_t*)block, order);
+
+    spin_unlock(&page_lock);
+}
 
-// cada página usada como slab começa com slab_t header
+// header de um slab (no início do slab ou off-slab)
 typedef struct slab_t
 {
-    struct slab_t* next;
+    struct slab_t* next;    // intrusive doubly-linked list (partial/full/empty)
+    struct slab_t* prev;
     void* free_list;
+    void* base;             // first page of the slab
     uint16_t free_count;
     uint16_t total_objects;
-    uint16_t object_size;
-    uint16_t pad;
-    // objects follow right after header (header ocupa o início da página)
+    uint32_t pad;
 } slab_t;
 
+#define KMEM_SLAB_MAX_ORDER 3   // up to 8 pages per slab
+#define KMEM_OFFSLAB_MIN    512 // off-slab headers only for objects this big
+
+// empty slabs kept per cache before pages go back to the buddy
+#define KMEM_EMPTY_SLABS_MAX 2
+
 // cada cache mantém 3 listas: partial (tem objetos livres), full (0 livres), empty (todos livres)
-// para simplicidade usamos single list 'partial' e criamos/descartamos slabs conforme necessário
+// a lista de um slab é derivada do free_count, então toda transição é unlink + push em O(1)
 typedef struct
 {
-    size_t object_size;
+    char name[16];
+    size_t size;          // requested object size
+    size_t object_size;   // slot stride (size + free pointer if ctor, rounded to align)
+    size_t align;
+    size_t free_offset;   // where a free object keeps its free list link
+    void (*ctor)(void*);  // runs once per object when its slab is created
+    uint32_t slab_order;  // 2^slab_order pages per slab
+    bool off_slab;        // header lives in slab_cache instead of the slab
+    uint16_t objs_per_slab;
+    size_t obj_offset;    // first object offset inside the slab (before colouring)
+    size_t colour_off;    // colour step (a cache line, or align if bigger)
+    uint16_t colour;      // number of colours the slab leftover allows (>= 1)
+    uint16_t colour_next; // colour of the next slab created
     slab_t* partial;   // slabs with some free space
-    slab_t* full;      // filled slabs (optional)
+    slab_t* full;      // 0 free objects
+    slab_t* empty;     // all objects free
+    size_t nr_slabs;
+    size_t nr_empty;
+    size_t nr_active;     // objects out of the slabs (in use or in magazines)
     spinlock_t lock;
+
+    // what callers asked for (debug slab): sum of requested sizes and number of requests
+    uint64_t req_bytes;
+    uint64_t req_count;
+
+    // magazine layer counters (hit = served without touching the slab lists)
+    uint64_t mag_hits;
+    uint64_t mag_misses;
+
+    // api calls (debug heap / kmem_get_stats); the counters are bumped with atomic adds
+    uint64_t nr_allocs;
+    uint64_t nr_frees;
+    uint64_t nr_failed;
 } kmem_cache_t;
 
-static kmem_cache_t caches[CACHE_CLASSES];
-static bool slab_inited = false;
+/* magazines:
+ *  - each thread owns one small stack of ready objects per size class
+ *  - alloc pops / free pushes on the owner's magazine without taking cache->lock
+ *  - an empty magazine refills KMEM_MAG_BATCH objects from the cache in one locked trip,
+ *    a full one drains KMEM_MAG_BATCH objects back the same way
+ *  - only the owner thread touches its magazines, so the fast path needs no lock; it runs
+ *    with preemption off so a softirq at irq_exit (kmalloc on the same thread's magazines)
+ *    can't run in the middle of it
+ *  - the cache counters are shared by every CPU: relaxed atomic adds, no lock
+ */
+#define KMEM_MAG_SIZE  16
+#define KMEM_MAG_BATCH (KMEM_MAG_SIZE / 2)
 
-// calcula index do cache para um dado size (first fit potências da tabela)
-static int cache_index_for_size(size_t size)
+typedef struct
 {
-    for (int i = 0; i < (int)CACHE_CLASSES; ++i)
-        if (size <= cache_sizes[i])
-            return i;
+    uint32_t count;
+    void* objs[KMEM_MAG_SIZE];
+} kmem_magazine_t;
+
+// kmalloc size classes first, then caches from kmem_cache_create()
+#define KMEM_MAX_CACHES 16
+
+// returns the running thread's magazines (one per cache) or NULL before threads exist (threads.h)
+static kmem_magazine_t* kmem_local_magazines(void);
+
+static kmem_cache_t caches[KMEM_MAX_CACHES];
+static int nr_caches = 0;
+static bool slab_inited = false;
 
-    return -1; // size > MAX_SMALL_OBJECT
+// off-slab headers come from here (itself on-slab)
+static kmem_cache_t* slab_cache = NULL;
+
+/* index do cache para um dado size (1..MAX_SMALL_OBJECT): classes são potências de 2 a partir de 8,
+ * então é log2 arredondado pra cima - 3; folds to a constant when size is a constant
+ */
+static inline __attribute__((always_inline)) int kmalloc_index(size_t size)
+{
+    return size <= 8 ? 0 : 61 - __builtin_clzll(size - 1);
 }
 
-// get slab base (page-aligned) a partir de um objeto
+// slab header of an object (page_map knows it for every page of the slab)
 static inline slab_t* slab_from_obj(void* obj)
 {
-    uintptr_t a = (uintptr_t)obj;
-    uintptr_t base = a & ~(PAGE_SIZE - 1);
-    
-    return (slab_t*)base;
+    return (slab_t*)(kheap_base + page_of(obj)->slab);
+}
+
+/* picks slab order and header placement:
+ *  - lowest order whose waste (tail + on-slab header, or the off-slab header) is <= 1/8 of the slab
+ *  - off-slab only when it wastes less and objects are at least KMEM_OFFSLAB_MIN
+ *  - if no order gets under 1/8, the one with the smallest waste fraction
+ */
+static void kmem_cache_layout(kmem_cache_t* cache)
+{
+    size_t stride = cache->object_size;
+    size_t hdr = (sizeof(slab_t) + cache->align - 1) & ~(cache->align - 1);
+
+    size_t best_waste = 0, best_bytes = 0;
+
+    for (uint32_t order = 0; order <= KMEM_SLAB_MAX_ORDER; ++order)
+    {
+        size_t bytes = PAGE_SIZE << order;
+
+        for (int off = 0; off < 2; ++off)
+        {
+            if (off && stride < KMEM_OFFSLAB_MIN)
+                continue;
+
+            size_t head = off ? 0 : hdr;
+            if (bytes <= head)
+                continue;
+
+            size_t n = (bytes - head) / stride;
+            if (n == 0)
+                continue;
+
+            if (n > 0xFFFF)
+                n = 0xFFFF;
+
+            size_t waste = bytes - n * stride + (off ? sizeof(slab_t) : 0);
+
+            // waste/bytes < best_waste/best_bytes
+            if (best_bytes == 0 || waste * best_bytes < best_waste * bytes)
+            {
+                best_waste = waste;
+                best_bytes = bytes;
+
+                cache->slab_order = order;
+                cache->off_slab = off;
+                cache->objs_per_slab = (uint16_t)n;
+                cache->obj_offset = head;
+            }
+        }
+
+        if (best_bytes && best_waste * 8 <= best_bytes)
+            break;
+    }
+
+    // leftover space at the end of the slab -> colour offsets (never breaks align)
+    size_t bytes = PAGE_SIZE << cache->slab_order;
+    size_t left = bytes - cache->obj_offset - (size_t)cache->objs_per_slab * stride;
+
+    cache->colour_off = cache->align > CACHE_LINE_SIZE ? cache->align : CACHE_LINE_SIZE;
+    cache->colour = (uint16_t)(left / cache->colour_off + 1);
+    cache->colour_next = 0;
+}
+
+static void kmem_cache_setup(kmem_cache_t* cache, const char* name, size_t size, size_t align, void (*ctor)(void*))
+{
+    // default: objects of a cache line or more don't straddle lines
+    if (align == 0 && size >= CACHE_LINE_SIZE)
+        align = CACHE_LINE_SIZE;
+
+    if (align < CHUNK_ALIGNMENT_BYTES)
+        align = CHUNK_ALIGNMENT_BYTES;
+
+    // a free object needs room for the link
+    size_t stride = size < sizeof(void*) ? sizeof(void*) : size;
+    stride = (stride + align - 1) & ~(align - 1);
+
+    // constructed objects must survive being on the free list: link goes after the object
+    size_t free_offset = 0;
+    if (ctor)
+    {
+        free_offset = stride;
+        stride = (stride + sizeof(void*) + align - 1) & ~(align - 1);
+    }
+
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name, sizeof(cache->name) - 1);
+
+    cache->size = size;
+    cache->object_size = stride;
+    cache->align = align;
+    cache->free_offset = free_offset;
+    cache->ctor = ctor;
+
+    kmem_cache_layout(cache);
+
+    spinlock_init(&cache->lock);
 }
 
 // initialize caches (lazy)
@@ -141,67 +547,197 @@ static void slab_init(void)
         return;
     
     for (int i = 0; i < (int)CACHE_CLASSES; ++i)
-    {
-        caches[i].object_size = cache_sizes[i];
-        caches[i].partial = NULL;
-        caches[i].full = NULL;
-    
-        spinlock_init(&caches[i].lock);
-    }
-   
+        kmem_cache_setup(&caches[i], "kmalloc", cache_sizes[i], 0, NULL);
+
+    slab_cache = &caches[CACHE_CLASSES];
+    kmem_cache_setup(slab_cache, "slab", sizeof(slab_t), 0, NULL);
+
+    nr_caches = (int)CACHE_CLASSES + 1;
     slab_inited = true;
 }
 
-// create a new slab page for a given cache
+/* kmem_cache_create: dedicated cache for fixed-size objects
+ *  - exact size (rounded only to align), no power-of-two rounding
+ *  - align: object alignment, must be a power of 2
+ *    (0 -> CACHE_LINE_SIZE for objects >= CACHE_LINE_SIZE, CHUNK_ALIGNMENT_BYTES below)
+ *  - ctor: optional; objects are constructed when their slab is created and must be
+ *    freed back in constructed state
+ *  - NULL when the object does not fit a slab or there is no cache slot left
+ */
+kmem_cache_t* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*))
+{
+    if (!slab_inited) slab_init();
+
+    if (size == 0 || size > MAX_SMALL_OBJECT || nr_caches >= KMEM_MAX_CACHES)
+        return NULL;
+
+    if (align & (align - 1))
+        return NULL;
+
+    kmem_cache_t* cache = &caches[nr_caches];
+    kmem_cache_setup(cache, name, size, align, ctor);
+
+    if (cache->object_size > MAX_SMALL_OBJECT || cache->objs_per_slab == 0)
+        return NULL;
+
+    nr_caches++;
+    return cache;
+}
+
+// slab list helpers (O(1), no walking)
+static inline void slab_list_push(slab_t** head, slab_t* s)
+{
+    s->prev = NULL;
+    s->next = *head;
+
+    if (*head)
+        (*head)->prev = s;
+
+    *head = s;
+}
+
+static inline void slab_list_unlink(slab_t** head, slab_t* s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+
+    if (s->next)
+        s->next->prev = s->prev;
+
+    s->next = s->prev = NULL;
+}
+
+// which list a slab belongs to for a given free_count
+static inline slab_t** slab_list_for(kmem_cache_t* cache, slab_t* s, uint16_t free_count)
+{
+    if (free_count == 0)
+        return &cache->full;
+
+    if (free_count == s->total_objects)
+        return &cache->empty;
+
+    return &cache->partial;
+}
+
+// moves a slab between lists after its free_count changed from `before`
+static inline void slab_list_update(kmem_cache_t* cache, slab_t* s, uint16_t before)
+{
+    slab_t** from = slab_list_for(cache, s, before);
+    slab_t** to   = slab_list_for(cache, s, s->free_count);
+
+    if (from == to)
+        return;
+
+    slab_list_unlink(from, s);
+    slab_list_push(to, s);
+
+    if (from == &cache->empty)
+        cache->nr_empty--;
+    else if (to == &cache->empty)
+        cache->nr_empty++;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* obj);
+
+// create a new slab (2^slab_order pages) for a given cache
 static slab_t* create_slab_for_cache(kmem_cache_t* cache)
 {
-    // allocate one page via kbrk
-    void* page = kbrk(PAGE_SIZE);
-    if (!page)
+    // allocate the slab pages via the buddy
+    void* mem = page_alloc(cache->slab_order);
+    if (!mem)
         return NULL;
 
-    memset(page, 0, PAGE_SIZE);
+    slab_t* s = (slab_t*)mem;
+    if (cache->off_slab)
+    {
+        s = kmem_cache_alloc(slab_cache);
+        if (!s)
+        {
+            page_free(mem, cache->slab_order);
+            return NULL;
+        }
+    }
 
-    slab_t* s = (slab_t*)page;
+    // every page of the slab points back to the header
+    page_t* pg = page_of(mem);
+    for (size_t i = 0; i < (1UL << cache->slab_order); ++i)
+    {
+        pg[i].kind = PAGE_KIND_SLAB;
+        pg[i].order = (uint8_t)cache->slab_order;
+        pg[i].cache = (uint16_t)(cache - caches);
+        pg[i].slab = (uint32_t)((uint8_t*)s - kheap_base);
+    }
+
+    // no page clear: every header field is written below and the objects get the free list
     s->next = NULL;
+    s->prev = NULL;
     s->free_list = NULL;
-    s->object_size = (uint16_t)cache->object_size;
-    // s->hsize = 0; /* not used; placeholder */
+    s->base = mem;
+    s->pad = 0;
 
-    // compute how many objects fit in this page after header
-    size_t header_sz = sizeof(slab_t);
-    size_t avail = PAGE_SIZE - header_sz;
-    uint16_t nobj = (uint16_t)(avail / s->object_size);
-    
-    if (nobj == 0)
-        // object size too big for single-page slab
-        return NULL;
+    uint16_t nobj = cache->objs_per_slab;
 
     s->total_objects = nobj;
     s->free_count = nobj;
 
-    // build free list: each object is at offset header + i*object_size
-    uint8_t* objs_base = (uint8_t*)page + header_sz;
+    // rotate the colour so equal slots of different slabs land in different cache sets
+    size_t colour = cache->colour_next * cache->colour_off;
+    if (++cache->colour_next >= cache->colour)
+        cache->colour_next = 0;
+
+    // build free list: each object is at offset obj_offset + colour + i*object_size
+    uint8_t* objs_base = (uint8_t*)mem + cache->obj_offset + colour;
     void* prev = NULL;
     
     for (uint16_t i = 0; i < nobj; ++i)
     {
-        void *obj = objs_base + (i * s->object_size);
-        // store pointer to next in the first pointer-sized bytes of object
-        *((void**)obj) = prev;
+        void *obj = objs_base + (i * cache->object_size);
+
+        if (cache->ctor)
+            cache->ctor(obj);
+
+        // store pointer to next at free_offset (first bytes unless the cache has a ctor)
+        *((void**)((uint8_t*)obj + cache->free_offset)) = prev;
         prev = obj;
     }
     
     // `prev` points to last object; i want free_list to be head of list
     s->free_list = prev;
 
-    // insert slab into cache->partial
-    s->next = cache->partial;
-    cache->partial = s;
+    // a fresh slab is entirely free
+    slab_list_push(&cache->empty, s);
+    cache->nr_slabs++;
+    cache->nr_empty++;
 
     return s;
 }
 
+// gives an empty slab's pages (and off-slab header) back (assumes cache locked)
+static void destroy_slab(kmem_cache_t* cache, slab_t* s)
+{
+    void* mem = s->base;
+
+    slab_list_unlink(&cache->empty, s);
+    cache->nr_slabs--;
+    cache->nr_empty--;
+
+    // tails would otherwise still claim to be slab pages
+    page_t* pg = page_of(mem);
+    for (size_t i = 1; i < (1UL << cache->slab_order); ++i)
+    {
+        pg[i].kind = PAGE_KIND_FREE;
+        pg[i].order = PAGE_ORDER_NONE;
+    }
+
+    page_free(mem, cache->slab_order);
+
+    if (cache->off_slab)
+        kmem_cache_free(slab_cache, s);
+}
+
 /* allocate an object from a slab (assumes cache locked) */
 static void* alloc_from_slab(kmem_cache_t* cache, slab_t* s)
 {
@@ -210,29 +746,15 @@ static void* alloc_from_slab(kmem_cache_t* cache, slab_t* s)
 
     // pop head from free_list
     void* obj = s->free_list;
-    void* next = *((void**)obj);
+    void* next = *((void**)((uint8_t*)obj + cache->free_offset));
 
     s->free_list = next;
     s->free_count--;
+    cache->nr_active++;
 
-    // if slab became full, move to full list (optional)
-    if (s->free_count == 0)
-    {
-        // remove slab from partial list
-        slab_t** pp = &cache->partial;
-        while (*pp && *pp != s)
-            pp = &(*pp)->next;
-        
-        if (*pp)
-            *pp = s->next;
-        
-        // push to full list
-        s->next = cache->full;
-        cache->full = s;
-    }
+    // empty -> partial, partial -> full (or empty -> full for 1-object slabs)
+    slab_list_update(cache, s, s->free_count + 1);
 
-    // zero object for safety
-    memset(obj, 0, cache->object_size);
     return obj;
 }
 
@@ -240,153 +762,415 @@ static void* alloc_from_slab(kmem_cache_t* cache, slab_t* s)
 static void free_to_slab(kmem_cache_t* cache, slab_t* s, void* obj)
 {
     // push object into slab free_list
-    *((void**)obj) = s->free_list;
+    *((void**)((uint8_t*)obj + cache->free_offset)) = s->free_list;
     s->free_list = obj;
     s->free_count++;
+    cache->nr_active--;
+
+    // full -> partial, partial -> empty (or full -> empty for 1-object slabs)
+    slab_list_update(cache, s, s->free_count - 1);
 
-    // if slab was full, move from full to partial
-    if (s->free_count == 1)
+    // keep a few empty slabs cached, give the rest back to the buddy
+    if (s->free_count == s->total_objects && cache->nr_empty > KMEM_EMPTY_SLABS_MAX)
+        destroy_slab(cache, s);
+}
+
+// allocate one object from the cache slabs (assumes cache locked)
+static void* cache_alloc_locked(kmem_cache_t* cache)
+{
+    // partial slabs first (keeps empty ones whole), then empty, then a new one
+    slab_t* s = cache->partial;
+    if (!s)
+        s = cache->empty;
+
+    if (!s)
     {
-        // remove from full
-        slab_t** pp = &cache->full;
-        while (*pp && *pp != s)
-            pp = &(*pp)->next;
-        
-        if (*pp)
-        {
-            *pp = s->next;
-            // push to partial 
-            s->next = cache->partial;
-            cache->partial = s;
-        }
+        // create one slab
+        s = create_slab_for_cache(cache);
+        if (!s)
+            return NULL;
     }
 
-    // optional: if slab entirely free, we could free page back (not implemented here)
+    return alloc_from_slab(cache, s);
 }
 
-/* kmalloc: if size <= MAX_SMALL_OBJECT -> slab allocate
- *          else -> large allocation (multiple pages + header)
+// pulls up to KMEM_MAG_BATCH objects from the cache into an empty magazine
+static void kmem_mag_refill(kmem_cache_t* cache, kmem_magazine_t* mag)
+{
+    spin_lock(&cache->lock);
+
+    while (mag->count < KMEM_MAG_BATCH)
+    {
+        void* obj = cache_alloc_locked(cache);
+        if (!obj)
+            break;
+
+        mag->objs[mag->count++] = obj;
+    }
+
+    spin_unlock(&cache->lock);
+}
+
+// gives n objects from the top of the magazine back to their slabs
+static void kmem_mag_drain(kmem_cache_t* cache, kmem_magazine_t* mag, uint32_t n)
+{
+    if (n > mag->count)
+        n = mag->count;
+
+    spin_lock(&cache->lock);
+
+    while (n--)
+    {
+        void* obj = mag->objs[--mag->count];
+        free_to_slab(cache, slab_from_obj(obj), obj);
+    }
+
+    spin_unlock(&cache->lock);
+}
+
+// flushes every magazine of a thread back to caches[] (called when the thread dies)
+void kmem_magazines_flush(kmem_magazine_t* mags)
+{
+    for (int i = 0; i < nr_caches; ++i)
+        kmem_mag_drain(&caches[i], &mags[i], KMEM_MAG_SIZE);
+}
+
+/* kmem_cache_alloc_sized: one object from a cache (kmalloc classes included)
+ *  - req is what the caller asked for (only accounted, see kmem_dump_slabs)
+ *  - fast path pops the running thread's magazine, no lock
+ *  - objects are not zeroed (constructed if the cache has a ctor)
  */
-void* kmalloc(size_t size)
+static void* kmem_cache_alloc_sized(kmem_cache_t* cache, size_t req)
 {
     if (!slab_inited) slab_init();
     if (!kbrk_ptr) kbrk_init();
 
-    if (size == 0) return NULL;
+    preempt_disable();
 
-    size = align_up(size);
+    kmem_magazine_t* mags = kmem_local_magazines();
+    void* res = NULL;
 
-    if (size <= MAX_SMALL_OBJECT)
+    if (mags)
+    {
+        // fast path: no lock, just pop from the thread's magazine
+        kmem_magazine_t* mag = &mags[cache - caches];
+
+        if (mag->count > 0)
+            __atomic_fetch_add(&cache->mag_hits, 1, __ATOMIC_RELAXED);
+        else
+        {
+            __atomic_fetch_add(&cache->mag_misses, 1, __ATOMIC_RELAXED);
+            kmem_mag_refill(cache, mag);
+        }
+
+        if (mag->count > 0)
+            res = mag->objs[--mag->count];
+    }
+    else
     {
-        int idx = cache_index_for_size(size);
-        if (idx < 0) idx = (int)CACHE_CLASSES - 1;
-        
-        kmem_cache_t* cache = &caches[idx];
         spin_lock(&cache->lock);
+        res = cache_alloc_locked(cache);
+        spin_unlock(&cache->lock);
+    }
 
-        // try partial slabs first
-        slab_t* s = cache->partial;
-        void* res = NULL;
-        if (!s)
+    if (res)
+    {
+        __atomic_fetch_add(&cache->nr_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->req_bytes, req, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->req_count, 1, __ATOMIC_RELAXED);
+    }
+    else
+        __atomic_fetch_add(&cache->nr_failed, 1, __ATOMIC_RELAXED);
+
+    preempt_enable();
+    
+    return res;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    return kmem_cache_alloc_sized(cache, cache->size);
+}
+
+// gives an object back to its cache (magazine first)
+void kmem_cache_free(kmem_cache_t* cache, void* obj)
+{
+    if (!obj)
+        return;
+
+    preempt_disable();
+
+    __atomic_fetch_add(&cache->nr_frees, 1, __ATOMIC_RELAXED);
+
+    kmem_magazine_t* mags = kmem_local_magazines();
+
+    if (mags)
+    {
+        kmem_magazine_t* mag = &mags[cache - caches];
+
+        if (mag->count < KMEM_MAG_SIZE)
+            __atomic_fetch_add(&cache->mag_hits, 1, __ATOMIC_RELAXED);
+        else
         {
-            // create one slab
-            s = create_slab_for_cache(cache);
-            if (!s)
-            {
-                spin_unlock(&cache->lock);
-                return NULL;
-            }
+            __atomic_fetch_add(&cache->mag_misses, 1, __ATOMIC_RELAXED);
+            kmem_mag_drain(cache, mag, KMEM_MAG_BATCH);
         }
 
-        // allocate from chosen slab (partial)
-        res = alloc_from_slab(cache, s);
+        mag->objs[mag->count++] = obj;
+    }
+    else
+    {
+        spin_lock(&cache->lock);
+        free_to_slab(cache, slab_from_obj(obj), obj);
         spin_unlock(&cache->lock);
-        
-        return res;
     }
+
+    preempt_enable();
+}
+
+// large allocations (above MAX_SMALL_OBJECT): calls and pages currently out
+static uint64_t large_allocs = 0;
+static uint64_t large_frees = 0;
+static uint64_t large_failed = 0;
+static size_t large_active = 0;
+static size_t large_bytes = 0;
+
+/* __kmalloc: if size <= MAX_SMALL_OBJECT -> slab allocate
+ *            else -> large allocation (2^order pages, described by page_map)
+ *
+ * memory is NOT zeroed (use kzalloc for that)
+ */
+void* __kmalloc(size_t size)
+{
+    if (!slab_inited) slab_init();
+    if (!kbrk_ptr) kbrk_init();
+
+    if (size == 0) return NULL;
+
+    if (size <= MAX_SMALL_OBJECT)
+        return kmem_cache_alloc_sized(&caches[kmalloc_index(size)], size);
     else
     {
-        // large allocation: allocate whole pages and store header
-        size_t total = size + sizeof(large_alloc_hdr_t);
-        size_t pages = (total + PAGE_SIZE - 1) / PAGE_SIZE;
-        size_t bytes = pages * PAGE_SIZE;
-
-        void *p = kbrk(bytes);
-        if (!p) return NULL;
-
-        large_alloc_hdr_t* hdr = (large_alloc_hdr_t*)p;
-        hdr->pages = pages;
-
-        void* payload = (void*)((uint8_t*)p + sizeof(large_alloc_hdr_t));
-        // zero payload
-        memset(payload, 0, bytes - sizeof(large_alloc_hdr_t));
-        
-        return payload;
+        // large allocation: whole buddy block, order recorded in the head descriptor
+        uint32_t order = page_order_for((size + PAGE_SIZE - 1) / PAGE_SIZE);
+        void *p = page_alloc(order);
+        if (!p)
+        {
+            __atomic_fetch_add(&large_failed, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+
+        // page_lock is already dropped: other CPUs count too
+        __atomic_fetch_add(&large_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&large_active, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&large_bytes, PAGE_SIZE << order, __ATOMIC_RELAXED);
+
+        page_t* pg = page_of(p);
+        pg->kind = PAGE_KIND_LARGE_HEAD;
+        pg->order = (uint8_t)order;
+
+        for (size_t i = 1; i < (1UL << order); ++i)
+            pg[i].kind = PAGE_KIND_LARGE_TAIL;
+
+        return p;
     }
 }
 
+/* kmalloc: constant sizes pick their class at compile time, the rest go through __kmalloc */
+static inline __attribute__((always_inline)) void* kmalloc(size_t size)
+{
+    if (__builtin_constant_p(size) && size > 0 && size <= MAX_SMALL_OBJECT)
+        return kmem_cache_alloc_sized(&caches[kmalloc_index(size)], size);
+
+    return __kmalloc(size);
+}
+
+/* kzalloc: kmalloc + zero the requested bytes */
+void* kzalloc(size_t size)
+{
+    void* p = kmalloc(size);
+    if (p)
+        memset(p, 0, size);
+
+    return p;
+}
+
 /* kfree: free slab object or large allocation */
 void kfree(void* ptr)
 {
     if (!ptr) return;
     if (!slab_inited) slab_init();
 
-    /* determine whether pointer belongs to a slab page by testing page header patterns:
-       we try to read slab header at page base and see if object_size matches a cache size
-       alternatively i can check if the page contains a valid slab; i assume slabs are page-aligned
-    */
+    // one indexed load tells who owns the pointer
+    page_t* pg = page_of(ptr);
+    if (!pg)
+        return; // not a heap pointer
+
+    if (pg->kind == PAGE_KIND_SLAB)
+    {
+        kmem_cache_free(&caches[pg->cache], ptr);
+        return;
+    } 
+    else if (pg->kind == PAGE_KIND_LARGE_HEAD)
+    {
+        if ((uintptr_t)ptr & (PAGE_SIZE - 1))
+            return; // invalid free (interior pointer)
 
-    uintptr_t a = (uintptr_t)ptr;
-    uintptr_t page_base = a & ~(PAGE_SIZE - 1);
-    slab_t* s = (slab_t*)page_base;
+        __atomic_fetch_add(&large_frees, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&large_active, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&large_bytes, PAGE_SIZE << pg->order, __ATOMIC_RELAXED);
 
-    /* crude validation: object_size should be one of cache_sizes and not zero
-       if it doesntt match, assume it is a large alloc (i placed large header at page start)
-    */
+        page_free(ptr, pg->order);
 
-    bool looks_like_slab = false;
-    if (s->object_size != 0)
+        return;
+    }
+
+    // FREE (double free) or LARGE_TAIL (interior pointer): ignore
+}
+
+/* ksize: usable size of a kmalloc'd pointer, 0 if it is not one */
+size_t ksize(const void* ptr)
+{
+    page_t* pg = page_of(ptr);
+    if (!pg)
+        return 0;
+
+    if (pg->kind == PAGE_KIND_SLAB)
     {
-        for (int i = 0; i < (int)CACHE_CLASSES; ++i)
-        {
-            if (s->object_size == (uint16_t)cache_sizes[i])
-            {
-                looks_like_slab = true;
-                break;
-            }
-        }
+        kmem_cache_t* cache = &caches[pg->cache];
+        return cache->ctor ? cache->free_offset : cache->object_size;
     }
 
-    if (looks_like_slab)
+    if (pg->kind == PAGE_KIND_LARGE_HEAD)
+        return PAGE_SIZE << pg->order;
+
+    return 0;
+}
+
+/* allocator snapshot (debug heap, benchmarks)
+ *  - plain copy of the counters, no locks: cheap enough to take around a bench loop
+ *  - heap sizes are bytes from kheap_base
+ */
+typedef struct
+{
+    char name[16];
+    size_t object_size;
+    size_t active;        // objects out of the slabs (in use or in magazines)
+    size_t slabs;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failed;
+} kmem_cache_stats_t;
+
+typedef struct
+{
+    size_t heap_used;     // kbrk
+    size_t heap_peak;     // kbrk high-water mark
+    size_t heap_mapped;   // kheap_end
+    size_t heap_limit;
+    size_t free_pages;    // in the buddy
+
+    uint64_t large_allocs;
+    uint64_t large_frees;
+    uint64_t large_failed;
+    size_t large_active;
+    size_t large_bytes;
+
+    int nr_caches;
+    kmem_cache_stats_t caches[KMEM_MAX_CACHES];
+} kmem_stats_t;
+
+void kmem_get_stats(kmem_stats_t* st)
+{
+    st->heap_used = (size_t)(kbrk_ptr - kheap_base);
+    st->heap_peak = (size_t)(kbrk_peak - kheap_base);
+    st->heap_mapped = (size_t)(kheap_end - kheap_base);
+    st->heap_limit = (size_t)(kheap_limit - kheap_base);
+    st->free_pages = nr_free_pages;
+
+    st->large_allocs = large_allocs;
+    st->large_frees = large_frees;
+    st->large_failed = large_failed;
+    st->large_active = large_active;
+    st->large_bytes = large_bytes;
+
+    st->nr_caches = nr_caches;
+    for (int i = 0; i < nr_caches; ++i)
     {
-        int idx = cache_index_for_size(s->object_size);
-        if (idx < 0)
-            return; // corruption?
+        kmem_cache_t* c = &caches[i];
+        kmem_cache_stats_t* cs = &st->caches[i];
 
-        kmem_cache_t* cache = &caches[idx];
-        spin_lock(&cache->lock);
-        free_to_slab(cache, s, ptr);
-        spin_unlock(&cache->lock);
-        
-        return;
-    } 
-    else
+        memcpy(cs->name, c->name, sizeof(cs->name));
+        cs->object_size = c->object_size;
+        cs->active = c->nr_active;
+        cs->slabs = c->nr_slabs;
+        cs->allocs = c->nr_allocs;
+        cs->frees = c->nr_frees;
+        cs->failed = c->nr_failed;
+    }
+}
+
+// debug heap
+void kmem_dump_heap(void)
+{
+    static kmem_stats_t st; // too big for a thread stack
+
+    kmem_get_stats(&st);
+
+    kprintf("[heap] used %d KiB (peak %d KiB), mapped %d KiB of %d KiB, buddy free %d pages\n",
+        (int)(st.heap_used >> 10), (int)(st.heap_peak >> 10), (int)(st.heap_mapped >> 10),
+        (int)(st.heap_limit >> 10), (int)st.free_pages);
+    kprintf("[heap] large: %d allocs, %d frees, %d failed, %d live (%d KiB)\n",
+        (int)st.large_allocs, (int)st.large_frees, (int)st.large_failed,
+        (int)st.large_active, (int)(st.large_bytes >> 10));
+
+    kprintf("[heap] name size active slabs allocs frees failed\n");
+    for (int i = 0; i < st.nr_caches; ++i)
     {
-        // assume large allocation header at page_base
-        
-        large_alloc_hdr_t* hdr = (large_alloc_hdr_t*)page_base;
-        size_t pages = hdr->pages;
-        
-        if (pages == 0)
-            return; // invalid free
-        
-        // for simplicity, do not return pages to kbrk (no free of bump); i could manage a free list of large regions
-        // zero header to avoid double free detection lightly
-        
-        hdr->pages = 0;
-        (void)pages;
-        
-        return;
+        kmem_cache_stats_t* cs = &st.caches[i];
+        kprintf("  %s  %d  %d  %d  %d  %d  %d\n", cs->name, (int)cs->object_size, (int)cs->active,
+            (int)cs->slabs, (int)cs->allocs, (int)cs->frees, (int)cs->failed);
+    }
+}
+
+/* per cache memory use (debug slab)
+ *  - req:  active objects * average requested size
+ *  - used: active objects * slot stride
+ *  - slab: pages held by slabs (+ off-slab headers)
+ *  - frag: share of slab memory not holding requested bytes
+ */
+void kmem_dump_slabs(void)
+{
+    kprintf("[slab] name size order off objs/slab colours slabs active req used slab frag\n");
+
+    for (int i = 0; i < nr_caches; ++i)
+    {
+        kmem_cache_t* c = &caches[i];
+
+        uint64_t avg = c->req_count ? c->req_bytes / c->req_count : c->size;
+        uint64_t req  = c->nr_active * avg;
+        uint64_t used = c->nr_active * c->object_size;
+        uint64_t slab = (uint64_t)c->nr_slabs * ((PAGE_SIZE << c->slab_order) + (c->off_slab ? sizeof(slab_t) : 0));
+        int frag = slab ? (int)(100 - (req * 100) / slab) : 0;
+
+        kprintf("  %s  %d  %d  %d  %d  %d  %d  %d  %d  %d  %d  %d\n",
+            c->name, (int)c->object_size, (int)c->slab_order, (int)c->off_slab, (int)c->objs_per_slab, (int)c->colour,
+            (int)c->nr_slabs, (int)c->nr_active, (int)req, (int)used, (int)slab, frag);
+    }
+}
+
+// magazine hit rate per class (debug magazine)
+void kmem_dump_magazines(void)
+{
+    kprintf("[magazine] name size hits misses hit-rate\n");
+
+    for (int i = 0; i < nr_caches; ++i)
+    {
+        uint64_t hits = caches[i].mag_hits;
+        uint64_t total = hits + caches[i].mag_misses;
+        int rate = total ? (int)((hits * 100) / total) : 0;
+
+        kprintf("  %s  %d  %d  %d  %d\n", caches[i].name, (int)caches[i].object_size, (int)hits, (int)caches[i].mag_misses, rate);
     }
 }
 
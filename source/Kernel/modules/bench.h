@@ -0,0 +1,1167 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * in-kernel benchmarks / stress tests (shell: debug bench <name>)
+ *
+ * notas:
+ *  - timings are raw TSC cycles (rdtsc), averaged over BENCH_ROUNDS
+ *  - each bench cleans up what it allocated before returning
+ */
+
+#define BENCH_ROUNDS 256
+
+/* slab: kmalloc/kfree slab-list cost vs. slab count
+ *  - fills the 2048 class (fewest objects per slab) slab by slab, holding every object
+ *  - at each milestone frees the OLDEST object and allocates a new one, which is
+ *    the worst case for a list walk (oldest slab sits at the tail of cache->full)
+ *  - goes straight to the slab layer so the magazines don't absorb the ops
+ *  - stops when the heap runs out
+ */
+void bench_slab(void)
+{
+    int idx = kmalloc_index(MAX_SMALL_OBJECT);
+    kmem_cache_t* cache = &caches[idx];
+
+    // held objects form a FIFO threaded through the objects themselves
+    void* oldest = NULL;
+    void* newest = NULL;
+    size_t held = 0;
+    size_t milestone = 16;
+
+    kprintf("[bench slab] slabs  alloc(cyc)  free(cyc)\n");
+
+    for (;;)
+    {
+        spin_lock(&cache->lock);
+        void* obj = cache_alloc_locked(cache);
+        spin_unlock(&cache->lock);
+
+        if (!obj)
+            break;
+
+        *(void**)obj = NULL;
+        if (newest)
+            *(void**)newest = obj;
+        else
+            oldest = obj;
+
+        newest = obj;
+        held++;
+
+        if (held < milestone * cache->objs_per_slab)
+            continue;
+
+        uint64_t alloc_cyc = 0;
+        uint64_t free_cyc = 0;
+
+        for (int r = 0; r < BENCH_ROUNDS; ++r)
+        {
+            void* victim = oldest;
+            oldest = *(void**)victim;
+
+            spin_lock(&cache->lock);
+
+            uint64_t t0 = rdtsc();
+            free_to_slab(cache, slab_from_obj(victim), victim);
+            uint64_t t1 = rdtsc();
+            void* fresh = cache_alloc_locked(cache);
+            uint64_t t2 = rdtsc();
+
+            spin_unlock(&cache->lock);
+
+            free_cyc += t1 - t0;
+            alloc_cyc += t2 - t1;
+
+            *(void**)fresh = NULL;
+            *(void**)newest = fresh;
+            newest = fresh;
+        }
+
+        kprintf("  %d  %d  %d\n", (int)(held / cache->objs_per_slab), (int)(alloc_cyc / BENCH_ROUNDS), (int)(free_cyc / BENCH_ROUNDS));
+        milestone *= 2;
+    }
+
+    kprintf("  heap exhausted at %d slabs\n", (int)cache->nr_slabs);
+
+    while (held--)
+    {
+        void* next = *(void**)oldest;
+
+        spin_lock(&cache->lock);
+        free_to_slab(cache, slab_from_obj(oldest), oldest);
+        spin_unlock(&cache->lock);
+
+        oldest = next;
+    }
+}
+
+/* large: churn of allocations above MAX_SMALL_OBJECT (thread stacks and friends)
+ *  - keeps a window of live blocks of mixed sizes and replaces them round after round
+ *  - heap usage (kbrk) must stop growing once the buddy has enough blocks to reuse
+ */
+#define BENCH_LARGE_LIVE 4
+
+void bench_large(void)
+{
+    static const size_t sizes[] = { KTHREAD_STACK_SIZE, 3000, 12000, 5000 };
+    void* live[BENCH_LARGE_LIVE] = { 0 };
+    uint64_t cyc = 0;
+    size_t ops = 0;
+
+    kprintf("[bench large] round  heap-used  cyc/op\n");
+
+    for (int round = 0; round < 8; ++round)
+    {
+        for (int r = 0; r < BENCH_ROUNDS; ++r)
+        {
+            int slot = r % BENCH_LARGE_LIVE;
+
+            uint64_t t0 = rdtsc();
+            kfree(live[slot]);
+            live[slot] = kmalloc(sizes[(r + round) % 4]);
+            cyc += rdtsc() - t0;
+            ops++;
+        }
+
+        size_t used = (size_t)((uint8_t*)kbrk(0) - kheap_base) - nr_free_pages * PAGE_SIZE;
+        kprintf("  %d  %d  %d\n", round, (int)used, (int)(cyc / ops));
+    }
+
+    for (int i = 0; i < BENCH_LARGE_LIVE; ++i)
+        kfree(live[i]);
+}
+
+/* cacheline: object alignment and slab colouring on access-heavy loops
+ *  - "line": 320-byte cache with the default layout (cache-line aligned, coloured)
+ *  - "pack": same object size, 16-byte aligned and colouring off (the old layout)
+ *  - walk:  every word of every object in random order (misaligned objects touch one more line)
+ *  - alias: first word of the first object of each slab, over and over (uncoloured slabs
+ *    all hit the same cache sets)
+ */
+#define BENCH_CL_SIZE  320
+#define BENCH_CL_SLABS 256
+
+static void bench_cacheline_one(kmem_cache_t* cache)
+{
+    size_t n = (size_t)cache->objs_per_slab * BENCH_CL_SLABS;
+    void** objs = kmalloc(n * sizeof(void*));
+    void** first = kmalloc(BENCH_CL_SLABS * sizeof(void*));
+    size_t nfirst = 0;
+
+    if (!objs || !first)
+    {
+        kfree(objs);
+        kfree(first);
+        return;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        objs[i] = kmem_cache_alloc(cache);
+        if (!objs[i])
+        {
+            n = i;
+            break;
+        }
+
+        memset(objs[i], (int)i, BENCH_CL_SIZE);
+
+        // lowest slot of its slab (colour < one stride)
+        size_t off = (uint8_t*)objs[i] - (uint8_t*)slab_from_obj(objs[i])->base;
+        if (off < cache->obj_offset + cache->object_size && nfirst < BENCH_CL_SLABS)
+            first[nfirst++] = objs[i];
+    }
+
+    // random walk order (xorshift + fisher-yates)
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = n; i > 1; --i)
+    {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        size_t j = x % i;
+        void* t = objs[i - 1]; objs[i - 1] = objs[j]; objs[j] = t;
+    }
+
+    volatile uint64_t sink = 0;
+
+    // r == 0 is a warm-up pass, not timed
+    uint64_t t0 = 0;
+    for (int r = 0; r <= 8; ++r)
+    {
+        if (r == 1)
+            t0 = rdtsc();
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint64_t* w = objs[i];
+            for (size_t k = 0; k < BENCH_CL_SIZE / sizeof(uint64_t); ++k)
+                sink += w[k];
+        }
+    }
+    uint64_t walk = rdtsc() - t0;
+
+    t0 = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+        for (size_t i = 0; i < nfirst; ++i)
+            sink += *(volatile uint64_t*)first[i];
+    uint64_t alias = rdtsc() - t0;
+
+    kprintf("  %s  %d  %d  %d  %d\n", cache->name, (int)cache->align, (int)cache->colour,
+        n ? (int)(walk / (8 * n)) : 0, nfirst ? (int)(alias / (BENCH_ROUNDS * nfirst)) : 0);
+
+    for (size_t i = 0; i < n; ++i)
+        kmem_cache_free(cache, objs[i]);
+
+    kfree(objs);
+    kfree(first);
+}
+
+void bench_cacheline(void)
+{
+    // caches can't be destroyed: created on the first run, reused afterwards
+    static kmem_cache_t* line = NULL;
+    static kmem_cache_t* pack = NULL;
+
+    if (!line)
+        line = kmem_cache_create("bench-line", BENCH_CL_SIZE, 0, NULL);
+
+    if (!pack)
+    {
+        pack = kmem_cache_create("bench-pack", BENCH_CL_SIZE, 16, NULL);
+        if (pack)
+            pack->colour = 1;
+    }
+
+    if (!line || !pack)
+    {
+        kprintf("bench: no cache slot left\n");
+        return;
+    }
+
+    kprintf("[bench cacheline] cache  align  colours  walk(cyc/obj)  alias(cyc/access)\n");
+
+    bench_cacheline_one(pack);
+    bench_cacheline_one(line);
+}
+
+/* preempt: worst-case IRQ -> worker thread latency under a CPU-bound thread
+ *  - a spinner thread never yields; once per tick it raises WQ_KICK_VECTOR, whose handler
+ *    queues a work item on system_wq
+ *  - run once cooperative and once preemptive; the work item records the latencies (softirq.h)
+ */
+#define BENCH_SPIN_TICKS HZ // 1 s
+
+static sem_t bench_spin_done;
+
+static void bench_spinner(void* arg)
+{
+    (void)arg;
+
+    // clock_ticks: on an AP cpu_ticks only moves while the boot CPU is busy
+    uint64_t end = clock_ticks() + BENCH_SPIN_TICKS;
+    uint64_t last = clock_ticks();
+
+    while (clock_ticks() < end)
+    {
+        if (clock_ticks() != last)
+        {
+            last = clock_ticks();
+            asm volatile("int %0" : : "i"(WQ_KICK_VECTOR));
+        }
+    }
+
+    sem_post(&bench_spin_done);
+    kthread_exit(0);
+}
+
+void bench_preempt(void)
+{
+    bool saved = sched_preempt;
+
+    kprintf("[bench preempt] mode  wakeups  avg(cyc)  max(cyc)\n");
+
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        sched_preempt = mode;
+
+        cli();
+        wq_kick_tsc = 0;
+        wq_kick_max = 0;
+        wq_kick_sum = 0;
+        wq_kick_count = 0;
+        sti();
+
+        sem_init(&bench_spin_done, 0);
+
+        if (kthread_create(bench_spinner, NULL, "spinner") == -1)
+        {
+            kprintf("bench: no thread slot\n");
+            break;
+        }
+
+        sem_wait(&bench_spin_done);
+
+        // the last kick may still be pending in cooperative mode
+        kthread_yield();
+
+        kprintf("  %s  %d  %d  %d\n", mode ? "preempt" : "coop",
+            (int)wq_kick_count, wq_kick_count ? (int)(wq_kick_sum / wq_kick_count) : 0, (int)wq_kick_max);
+    }
+
+    sched_preempt = saved;
+}
+
+/* runqueue: sleep/wake and run queue cost vs. number of queued threads
+ *  - filler threads (lower priority than the shell) are woken into the run queue in steps;
+ *    they only run once the shell blocks, and then park again
+ *  - rq: remove + re-enqueue of the last filler of the level (worst case for a list walk)
+ *  - sleep/wake: ping-pong round trip with a higher priority partner (2 sleeps + 2 wakes)
+ *  - fillers and partner are created once and reused by later runs
+ */
+#define BENCH_RQ_FILLERS 48
+#define BENCH_RQ_FILLER_PRIO (KTHREAD_PRIO_IDLE - 1)
+
+static waitq_t bench_park;
+static sem_t bench_ping, bench_pong;
+static int bench_fillers = 0;
+static kthread_t* bench_last_filler = NULL;
+
+static void bench_filler(void* arg)
+{
+    (void)arg;
+
+    for (;;)
+        thread_sleep(&bench_park);
+}
+
+static void bench_partner(void* arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        sem_wait(&bench_ping);
+        sem_post(&bench_pong);
+    }
+}
+
+void bench_runqueue(void)
+{
+    static bool ready = false;
+
+    if (!ready)
+    {
+        waitq_init(&bench_park);
+        sem_init(&bench_ping, 0);
+        sem_init(&bench_pong, 0);
+
+        if (kthread_create_prio(bench_partner, NULL, "bench-partner", KTHREAD_PRIO_HIGH + 1) == -1)
+        {
+            kprintf("bench: no thread slot\n");
+            return;
+        }
+
+        ready = true;
+    }
+
+    kprintf("[bench runqueue] queued  create(cyc)  rq(cyc)  sleep/wake(cyc)\n");
+
+    for (int target = 0; target <= BENCH_RQ_FILLERS; target = target ? target * 2 : 6)
+    {
+        if (target > BENCH_RQ_FILLERS)
+            target = BENCH_RQ_FILLERS;
+
+        // new fillers start runnable (queued), old ones come back from the park
+        uint64_t create_cyc = 0;
+        int created = 0;
+
+        while (bench_fillers < target)
+        {
+            uint64_t t0 = rdtsc();
+            int tid = kthread_create_prio(bench_filler, NULL, "bench-filler", BENCH_RQ_FILLER_PRIO);
+            create_cyc += rdtsc() - t0;
+
+            if (tid == -1)
+                break;
+
+            bench_fillers++;
+            created++;
+        }
+
+        thread_wake_all(&bench_park);
+
+        // the filler queued last sits at the tail of its level (of this CPU's queue: with
+        // more CPUs online the fillers spread out and run elsewhere)
+        sched_lock_irq();
+        runqueue_t* rq = this_rq();
+        bench_last_filler = rq->level[BENCH_RQ_FILLER_PRIO].tail;
+        int queued = rq->nr_running;
+        sched_unlock_irq();
+
+        uint64_t rq_cyc = 0;
+        int rq_rounds = 0;
+        if (bench_last_filler)
+        {
+            for (int r = 0; r < BENCH_ROUNDS; ++r)
+            {
+                sched_lock_irq();
+
+                // stolen or run by another CPU meanwhile
+                if (bench_last_filler->state != THREAD_RUNNABLE)
+                {
+                    sched_unlock_irq();
+                    break;
+                }
+
+                uint64_t t0 = rdtsc();
+                remove_from_runqueue(bench_last_filler);
+                enqueue_runnable(bench_last_filler);
+                rq_cyc += rdtsc() - t0;
+                rq_rounds++;
+
+                sched_unlock_irq();
+            }
+        }
+
+        uint64_t t0 = rdtsc();
+        for (int r = 0; r < BENCH_ROUNDS; ++r)
+        {
+            sem_post(&bench_ping);
+            sem_wait(&bench_pong);
+        }
+        uint64_t pp_cyc = rdtsc() - t0;
+
+        kprintf("  %d  %d  %d  %d\n", queued, created ? (int)(create_cyc / created) : 0,
+            rq_rounds ? (int)(rq_cyc / rq_rounds) : 0, (int)(pp_cyc / BENCH_ROUNDS));
+
+        if (target == BENCH_RQ_FILLERS)
+            break;
+    }
+}
+
+/* sleep: how late kthread_sleep_us wakes up, measured with ktime
+ *  - whole ticks block on the wheel (LAPIC event), the sub-tick rest spins
+ */
+#define BENCH_SLEEP_ROUNDS 16
+
+void bench_sleep(void)
+{
+    static const uint64_t asked[] = { 20, 100, 500, 1000, 2500, 10000 };
+
+    kprintf("[bench sleep] asked(us)  avg(us)  max(us)\n");
+
+    for (size_t i = 0; i < sizeof(asked) / sizeof(asked[0]); ++i)
+    {
+        uint64_t sum = 0;
+        uint64_t max = 0;
+
+        for (int r = 0; r < BENCH_SLEEP_ROUNDS; ++r)
+        {
+            uint64_t t0 = ktime_get();
+            kthread_sleep_us(asked[i]);
+            uint64_t ns = ktime_get() - t0;
+
+            sum += ns;
+            if (ns > max)
+                max = ns;
+        }
+
+        kprintf("  %d  %d  %d\n", (int)asked[i],
+            (int)(sum / BENCH_SLEEP_ROUNDS / NSEC_PER_USEC), (int)(max / NSEC_PER_USEC));
+    }
+}
+
+/* smp: the same CPU-bound job split over 1 .. 2 * nr_cpus worker threads
+ *  - wall time of the whole job (ktime); speedup is x100 against a single worker
+ *  - workers start on whatever CPU select_cpu picks, idle CPUs steal the rest
+ */
+#define BENCH_SMP_WORK 200000000ULL // loop iterations for the whole job
+
+static sem_t bench_smp_done;
+static uint64_t bench_smp_share;
+
+static void bench_smp_worker(void* arg)
+{
+    (void)arg;
+
+    for (volatile uint64_t i = 0; i < bench_smp_share; ++i)
+        ;
+
+    sem_post(&bench_smp_done);
+    kthread_exit(0);
+}
+
+void bench_smp(void)
+{
+    kprintf("[bench smp] cpus %d\n", nr_cpus);
+    kprintf("  workers  ms  speedup(x100)\n");
+
+    uint64_t base = 0;
+
+    for (int n = 1; n <= 2 * nr_cpus; n = n < nr_cpus ? n + 1 : n * 2)
+    {
+        sem_init(&bench_smp_done, 0);
+        bench_smp_share = BENCH_SMP_WORK / n;
+
+        uint64_t t0 = ktime_get();
+
+        int started = 0;
+        for (; started < n; ++started)
+            if (kthread_create(bench_smp_worker, NULL, "bench-smp") == -1)
+                break;
+
+        for (int i = 0; i < started; ++i)
+            sem_wait(&bench_smp_done);
+
+        uint64_t ns = ktime_get() - t0;
+
+        if (started < n)
+        {
+            kprintf("bench: no thread slot\n");
+            break;
+        }
+
+        if (!base)
+            base = ns;
+
+        kprintf("  %d  %d  %d\n", n, (int)(ns / NSEC_PER_MSEC), (int)(base * 100 / ns));
+    }
+}
+
+/* join: thread lifetime throughput (kthread_create_ex + kthread_join)
+ *  - serial: create one worker, join it, BENCH_ROUNDS times (far more lifetimes than slots)
+ *  - fanout: BENCH_JOIN_FANOUT workers at once, then join them all (fork-join)
+ *  - workers exit with their arg: join must hand back the same code
+ *  - free slots must be back where they started afterwards
+ */
+#define BENCH_JOIN_FANOUT 16
+
+static void bench_join_worker(void* arg)
+{
+    kthread_exit((int)(uintptr_t)arg);
+}
+
+void bench_join(void)
+{
+    int slots = nr_free_slots;
+    int bad = 0;
+
+    uint64_t t0 = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        int code = -1;
+        int tid = kthread_create_ex(bench_join_worker, (void*)(uintptr_t)r, "bench-join",
+            KTHREAD_PRIO_DEFAULT, KSTACK_MIN_SIZE, KTHREAD_JOINABLE);
+
+        if (tid == -1 || kthread_join(tid, &code) == -1)
+        {
+            kprintf("bench: create/join failed at %d\n", r);
+            return;
+        }
+
+        if (code != r)
+            bad++;
+    }
+    uint64_t serial = (rdtsc() - t0) / BENCH_ROUNDS;
+
+    int tids[BENCH_JOIN_FANOUT];
+    int lifetimes = 0;
+
+    t0 = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS / BENCH_JOIN_FANOUT; ++r)
+    {
+        int n = 0;
+        for (; n < BENCH_JOIN_FANOUT; ++n)
+        {
+            tids[n] = kthread_create_ex(bench_join_worker, (void*)(uintptr_t)n, "bench-join",
+                KTHREAD_PRIO_DEFAULT, KSTACK_MIN_SIZE, KTHREAD_JOINABLE);
+            if (tids[n] == -1)
+                break;
+        }
+
+        for (int i = 0; i < n; ++i)
+        {
+            int code = -1;
+            if (kthread_join(tids[i], &code) == -1 || code != i)
+                bad++;
+        }
+
+        lifetimes += n;
+    }
+    uint64_t fanout = lifetimes ? (rdtsc() - t0) / lifetimes : 0;
+
+    kprintf("[bench join] serial %d cyc/thread  fanout(%d) %d cyc/thread\n",
+        (int)serial, BENCH_JOIN_FANOUT, (int)fanout);
+    kprintf("  lifetimes %d  bad codes %d  free slots %d -> %d\n",
+        BENCH_ROUNDS + lifetimes, bad, slots, nr_free_slots);
+}
+
+/* fpu: what a kernel_fpu section costs and what it buys
+ *  - copy: memcpy (byte loop) vs memcpy_simd inside a section, cycles per KiB
+ *  - section: an empty kernel_fpu_begin/end pair, cycles
+ *  - switch: yield ping-pong inside a section (save + lazy restore each way) vs outside
+ */
+#define BENCH_FPU_BYTES 65536
+
+static sem_t bench_fpu_ping, bench_fpu_pong;
+
+static void bench_fpu_partner(void* arg)
+{
+    uint8_t* buf = arg;
+
+    kernel_fpu_begin();
+
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        sem_wait(&bench_fpu_ping);
+        memcpy_simd(buf, buf + 64, 64); // dirty the registers every round
+        sem_post(&bench_fpu_pong);
+    }
+
+    kernel_fpu_end();
+
+    sem_post(&bench_fpu_pong);
+    kthread_exit(0);
+}
+
+static uint64_t bench_fpu_pingpong(bool simd, uint8_t* buf)
+{
+    sem_init(&bench_fpu_ping, 0);
+    sem_init(&bench_fpu_pong, 0);
+
+    if (kthread_create_prio(bench_fpu_partner, buf, "bench-fpu", KTHREAD_PRIO_HIGH + 1) == -1)
+        return 0;
+
+    if (simd)
+        kernel_fpu_begin();
+
+    uint64_t t0 = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        if (simd)
+            memcpy_simd(buf + 128, buf + 192, 64);
+
+        sem_post(&bench_fpu_ping);
+        sem_wait(&bench_fpu_pong);
+    }
+    uint64_t cyc = rdtsc() - t0;
+
+    if (simd)
+        kernel_fpu_end();
+
+    sem_wait(&bench_fpu_pong); // partner done
+    return cyc / BENCH_ROUNDS;
+}
+
+void bench_fpu(void)
+{
+    uint8_t* src = kmalloc(BENCH_FPU_BYTES);
+    uint8_t* dst = kmalloc(BENCH_FPU_BYTES);
+
+    if (!src || !dst || !kernel_fpu_begin())
+    {
+        kprintf("bench: no fpu / no memory\n");
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+
+    kernel_fpu_end();
+
+    for (int i = 0; i < BENCH_FPU_BYTES; ++i)
+        src[i] = (uint8_t)i;
+
+    uint64_t t0 = rdtsc();
+    for (int r = 0; r < 16; ++r)
+        memcpy(dst, src, BENCH_FPU_BYTES);
+    uint64_t scalar = (rdtsc() - t0) / 16 / (BENCH_FPU_BYTES / 1024);
+
+    kernel_fpu_begin();
+    t0 = rdtsc();
+    for (int r = 0; r < 16; ++r)
+        memcpy_simd(dst, src, BENCH_FPU_BYTES);
+    uint64_t simd = (rdtsc() - t0) / 16 / (BENCH_FPU_BYTES / 1024);
+    kernel_fpu_end();
+
+    bool ok = true;
+    for (int i = 0; i < BENCH_FPU_BYTES; ++i)
+        if (dst[i] != (uint8_t)i)
+            ok = false;
+
+    t0 = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        kernel_fpu_begin();
+        kernel_fpu_end();
+    }
+    uint64_t section = (rdtsc() - t0) / BENCH_ROUNDS;
+
+    uint64_t plain = bench_fpu_pingpong(false, src);
+    uint64_t dirty = bench_fpu_pingpong(true, src);
+
+    kprintf("[bench fpu] copy(cyc/KiB) scalar %d  simd %d%s\n", (int)scalar, (int)simd, ok ? "" : "  MISMATCH");
+    kprintf("  section(cyc) %d\n", (int)section);
+    kprintf("  pingpong(cyc) plain %d  simd %d\n", (int)plain, (int)dirty);
+
+    kfree(src);
+    kfree(dst);
+}
+
+/* kstack: thread stack allocation (init/stack.h)
+ *  - pair: kstack_alloc/kstack_free of the default size (a cache hit after the first)
+ *    vs kmalloc/kfree of the same size (what kthread_create used to do)
+ *  - batch: BENCH_KSTACK_BATCH stacks held at once, past the cache -> maps, unmaps and
+ *    (on the next batch) one TLB flush for the dirty slots
+ */
+#define BENCH_KSTACK_BATCH 16
+
+void bench_kstack(void)
+{
+    size_t size;
+
+    uint64_t t0 = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        uint8_t* s = kstack_alloc(0, &size);
+        if (!s)
+        {
+            kprintf("bench: kstack_alloc failed\n");
+            return;
+        }
+
+        kstack_free(s);
+    }
+    uint64_t cached = (rdtsc() - t0) / BENCH_ROUNDS;
+
+    t0 = rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+        kfree(kmalloc(KTHREAD_STACK_SIZE));
+    uint64_t heap = (rdtsc() - t0) / BENCH_ROUNDS;
+
+    kprintf("[bench kstack] pair(cyc) cached %d  kmalloc %d\n", (int)cached, (int)heap);
+
+    uint8_t* held[BENCH_KSTACK_BATCH];
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        uint64_t maps = kstack_maps, unmaps = kstack_unmaps, flushes = kstack_flushes;
+        int n = 0;
+
+        t0 = rdtsc();
+        for (; n < BENCH_KSTACK_BATCH; ++n)
+            if (!(held[n] = kstack_alloc(0, &size)))
+                break;
+        uint64_t alloc = rdtsc() - t0;
+
+        t0 = rdtsc();
+        for (int i = 0; i < n; ++i)
+            kstack_free(held[i]);
+        uint64_t release = rdtsc() - t0;
+
+        kprintf("  batch %d x%d: alloc %d  free %d cyc/stack  maps %d  unmaps %d  flushes %d\n",
+            pass, n, n ? (int)(alloc / n) : 0, n ? (int)(release / n) : 0,
+            (int)(kstack_maps - maps), (int)(kstack_unmaps - unmaps), (int)(kstack_flushes - flushes));
+    }
+}
+
+/* locks: kmutex / rwsem / sem next to spin_lock, alone and under contention
+ *  - uncontended: cycles per lock + unlock pair, one thread
+ *  - kmutex: 2 * nr_cpus threads (4 at least) bump one counter, owner spinning on and off;
+ *    the counter must come out exact
+ *  - rwsem: one writer in four; writers keep two words equal, readers count when they aren't
+ */
+#define BENCH_LOCK_OPS  20000
+#define BENCH_LOCK_WORK 64 // loop iterations inside the critical section
+
+static kmutex_t bench_mutex;
+static rwsem_t bench_rwsem;
+static volatile uint64_t bench_lock_a, bench_lock_b;
+static int bench_lock_torn;
+
+static void bench_mutex_worker(void* arg)
+{
+    (void)arg;
+
+    for (int i = 0; i < BENCH_LOCK_OPS; ++i)
+    {
+        kmutex_lock(&bench_mutex);
+
+        bench_lock_a++;
+        for (volatile int w = 0; w < BENCH_LOCK_WORK; ++w)
+            ;
+
+        kmutex_unlock(&bench_mutex);
+    }
+}
+
+static void bench_rwsem_worker(void* arg)
+{
+    bool writer = (uintptr_t)arg;
+
+    for (int i = 0; i < BENCH_LOCK_OPS; ++i)
+    {
+        if (writer)
+        {
+            down_write(&bench_rwsem);
+
+            bench_lock_a++;
+            for (volatile int w = 0; w < BENCH_LOCK_WORK; ++w)
+                ;
+            bench_lock_b++;
+
+            up_write(&bench_rwsem);
+        }
+        else
+        {
+            down_read(&bench_rwsem);
+
+            if (bench_lock_a != bench_lock_b)
+                __atomic_fetch_add(&bench_lock_torn, 1, __ATOMIC_RELAXED);
+            for (volatile int w = 0; w < BENCH_LOCK_WORK; ++w)
+                ;
+
+            up_read(&bench_rwsem);
+        }
+    }
+}
+
+// n joinable threads running fn (every fourth gets arg 1), joined; wall time in ns, 0 if short of slots
+static uint64_t bench_lock_run(void (*fn)(void*), int n)
+{
+    int tids[MAX_THREADS];
+    int started = 0;
+
+    uint64_t t0 = ktime_get();
+
+    for (; started < n; ++started)
+    {
+        tids[started] = kthread_create_ex(fn, (void*)(uintptr_t)(started % 4 == 0), "bench-lock",
+            KTHREAD_PRIO_DEFAULT, 0, KTHREAD_JOINABLE);
+        if (tids[started] == -1)
+            break;
+    }
+
+    for (int i = 0; i < started; ++i)
+        kthread_join(tids[i], NULL);
+
+    uint64_t ns = ktime_get() - t0;
+
+    if (started < n)
+    {
+        kprintf("bench: no thread slot\n");
+        return 0;
+    }
+
+    return ns;
+}
+
+void bench_locks(void)
+{
+    const int rounds = BENCH_ROUNDS * 16;
+    spinlock_t spin;
+    sem_t sem;
+
+    spinlock_init(&spin);
+    sem_init(&sem, 1);
+    kmutex_init(&bench_mutex, "bench-mutex", true);
+    rwsem_init(&bench_rwsem, "bench-rwsem");
+
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < rounds; ++i)
+    {
+        spin_lock(&spin);
+        spin_unlock(&spin);
+    }
+    uint64_t c_spin = (rdtsc() - t0) / rounds;
+
+    t0 = rdtsc();
+    for (int i = 0; i < rounds; ++i)
+    {
+        sem_wait(&sem);
+        sem_post(&sem);
+    }
+    uint64_t c_sem = (rdtsc() - t0) / rounds;
+
+    t0 = rdtsc();
+    for (int i = 0; i < rounds; ++i)
+    {
+        kmutex_lock(&bench_mutex);
+        kmutex_unlock(&bench_mutex);
+    }
+    uint64_t c_mutex = (rdtsc() - t0) / rounds;
+
+    t0 = rdtsc();
+    for (int i = 0; i < rounds; ++i)
+    {
+        down_read(&bench_rwsem);
+        up_read(&bench_rwsem);
+    }
+    uint64_t c_read = (rdtsc() - t0) / rounds;
+
+    t0 = rdtsc();
+    for (int i = 0; i < rounds; ++i)
+    {
+        down_write(&bench_rwsem);
+        up_write(&bench_rwsem);
+    }
+    uint64_t c_write = (rdtsc() - t0) / rounds;
+
+    kprintf("[bench locks] uncontended cyc/pair: spin %d  sem %d  kmutex %d  rwsem read %d  write %d\n",
+        (int)c_spin, (int)c_sem, (int)c_mutex, (int)c_read, (int)c_write);
+
+    int n = nr_cpus * 2 < 4 ? 4 : nr_cpus * 2;
+    kprintf("  %d threads x %d ops\n", n, BENCH_LOCK_OPS);
+
+    for (int spin_on = 1; spin_on >= 0; --spin_on)
+    {
+        kmutex_init(&bench_mutex, "bench-mutex", spin_on);
+        bench_lock_a = 0;
+
+        uint64_t ns = bench_lock_run(bench_mutex_worker, n);
+        if (!ns)
+            return;
+
+        lockstat_t* st = &bench_mutex.stat;
+        kprintf("  kmutex spin %s: %d ms  counter %s  contended %d  spun %d  slept %d  wait %d cyc\n",
+            spin_on ? "on " : "off", (int)(ns / NSEC_PER_MSEC),
+            bench_lock_a == (uint64_t)n * BENCH_LOCK_OPS ? "ok" : "BAD",
+            (int)st->contended, (int)st->spun, (int)st->slept,
+            st->contended ? (int)(st->wait_cycles / st->contended) : 0);
+    }
+
+    rwsem_init(&bench_rwsem, "bench-rwsem");
+    bench_lock_a = bench_lock_b = 0;
+    bench_lock_torn = 0;
+
+    uint64_t ns = bench_lock_run(bench_rwsem_worker, n);
+    if (!ns)
+        return;
+
+    lockstat_t* st = &bench_rwsem.stat;
+    kprintf("  rwsem 1:3 w:r: %d ms  torn reads %d  contended %d  slept %d  wait %d cyc\n",
+        (int)(ns / NSEC_PER_MSEC), bench_lock_torn, (int)st->contended, (int)st->slept,
+        st->contended ? (int)(st->wait_cycles / st->contended) : 0);
+}
+
+/* idle: yield round trips and cross-CPU wakeups, idle in HLT vs MWAIT
+ *  - yield alone: kthread_yield with nothing else runnable here (idle is never queued)
+ *  - yield pair: two threads pinned to one CPU, same level, yielding to each other; cycles per switch
+ *  - wake: sem ping-pong with a partner pinned to another CPU, both sides idle in between;
+ *    round trip and resched IPIs per round, for each idle mode the CPU has
+ */
+#define BENCH_YIELDS (BENCH_ROUNDS * 64)
+
+static sem_t bench_idle_ping, bench_idle_pong;
+
+static void bench_yielder(void* arg)
+{
+    (void)arg;
+
+    for (int i = 0; i < BENCH_YIELDS; ++i)
+        kthread_yield();
+}
+
+static void bench_idle_partner(void* arg)
+{
+    (void)arg;
+
+    for (int i = 0; i < BENCH_ROUNDS; ++i)
+    {
+        sem_wait(&bench_idle_ping);
+        sem_post(&bench_idle_pong);
+    }
+}
+
+void bench_idle(void)
+{
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_YIELDS; ++i)
+        kthread_yield();
+    uint64_t alone = (rdtsc() - t0) / BENCH_YIELDS;
+
+    int cpu = smp_processor_id();
+
+    t0 = rdtsc();
+    kthread_t* a = kthread_spawn(bench_yielder, NULL, "bench-yield", KTHREAD_PRIO_DEFAULT, 0, KTHREAD_PINNED | KTHREAD_JOINABLE, cpu);
+    kthread_t* b = kthread_spawn(bench_yielder, NULL, "bench-yield", KTHREAD_PRIO_DEFAULT, 0, KTHREAD_PINNED | KTHREAD_JOINABLE, cpu);
+
+    if (a)
+        kthread_join(a->id, NULL);
+    if (b)
+        kthread_join(b->id, NULL);
+
+    if (!a || !b)
+    {
+        kprintf("bench: no thread slot\n");
+        return;
+    }
+
+    uint64_t pair = (rdtsc() - t0) / (2 * BENCH_YIELDS);
+
+    kprintf("[bench idle] yield alone %d cyc  yield pair %d cyc/switch (cpu %d)\n", (int)alone, (int)pair, cpu);
+
+    if (nr_cpus < 2)
+        return;
+
+    bool mode = idle_mwait;
+
+    for (int m = 0; m <= (int)idle_mwait_ok; ++m)
+    {
+        idle_mwait = m;
+
+        sem_init(&bench_idle_ping, 0);
+        sem_init(&bench_idle_pong, 0);
+
+        int other = (smp_processor_id() + 1) % nr_cpus;
+        kthread_t* p = kthread_spawn(bench_idle_partner, NULL, "bench-idle", KTHREAD_PRIO_DEFAULT, 0,
+            KTHREAD_PINNED | KTHREAD_JOINABLE, other);
+        if (!p)
+        {
+            kprintf("bench: no thread slot\n");
+            break;
+        }
+
+        uint64_t ipis = resched_ipis, saved = resched_ipis_saved;
+
+        t0 = rdtsc();
+        for (int i = 0; i < BENCH_ROUNDS; ++i)
+        {
+            sem_post(&bench_idle_ping);
+            sem_wait(&bench_idle_pong);
+        }
+        uint64_t rt = (rdtsc() - t0) / BENCH_ROUNDS;
+
+        kthread_join(p->id, NULL);
+
+        kprintf("  wake (%s, cpu %d <-> %d): %d cyc/round trip  IPIs %d  saved %d\n", m ? "mwait" : "hlt",
+            smp_processor_id(), other, (int)rt, (int)(resched_ipis - ipis), (int)(resched_ipis_saved - saved));
+    }
+
+    idle_mwait = mode;
+}
+
+/* tls: per-thread data through the FS base vs through current, and thread arguments
+ *  - read: the magazines pointer as tls_read(mags) vs current->mags (gs:curr, then the slot)
+ *  - slot: a per-thread counter in a tls_key slot vs the same in a table indexed by tid
+ *  - args / closure: 6-argument and closure threads check what they got (exit code 1 = right)
+ */
+#define BENCH_TLS_LOOPS (BENCH_ROUNDS * 256)
+
+static int bench_tls_key = -1;
+static uint64_t bench_tls_table[MAX_THREADS];
+
+typedef struct
+{
+    uint64_t a, b;
+    char tag[16];
+} bench_closure_t;
+
+static void bench_args_worker(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f)
+{
+    kthread_exit(a == 1 && b == 2 && c == 3 && d == 4 && e == 5 && f == 0x600000000ULL);
+}
+
+static void bench_closure_worker(void* arg)
+{
+    bench_closure_t* cl = arg;
+    kthread_exit(cl->a == 7 && cl->b == 8 && !strcmp(cl->tag, "closure") && (uint8_t*)cl == tls_self()->closure);
+}
+
+void bench_tls(void)
+{
+    if (bench_tls_key < 0)
+        bench_tls_key = tls_key_create();
+
+    if (bench_tls_key < 0)
+    {
+        kprintf("bench: no tls key left\n");
+        return;
+    }
+
+    volatile uint64_t sink = 0;
+
+    uint64_t t0 = rdtsc();
+    for (int i = 0; i < BENCH_TLS_LOOPS; ++i)
+        sink += (uint64_t)tls_read(mags);
+    uint64_t c_fs = rdtsc() - t0;
+
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_TLS_LOOPS; ++i)
+        sink += (uint64_t)current->mags;
+    uint64_t c_curr = rdtsc() - t0;
+
+    tls_set(bench_tls_key, 0);
+
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_TLS_LOOPS; ++i)
+        tls_set(bench_tls_key, (void*)((uint64_t)tls_get(bench_tls_key) + 1));
+    uint64_t c_slot = rdtsc() - t0;
+
+    t0 = rdtsc();
+    for (int i = 0; i < BENCH_TLS_LOOPS; ++i)
+        bench_tls_table[current->id % MAX_THREADS]++;
+    uint64_t c_table = rdtsc() - t0;
+
+    (void)sink;
+
+    kprintf("[bench tls] %s  x%d loops, cyc x100/op\n", tls_fsgsbase ? "wrfsbase" : "wrmsr", BENCH_TLS_LOOPS);
+    kprintf("  read: %%fs %d  current %d   counter: tls slot %d  table[tid] %d  (slot %s)\n",
+        (int)(c_fs * 100 / BENCH_TLS_LOOPS), (int)(c_curr * 100 / BENCH_TLS_LOOPS),
+        (int)(c_slot * 100 / BENCH_TLS_LOOPS), (int)(c_table * 100 / BENCH_TLS_LOOPS),
+        (uint64_t)tls_get(bench_tls_key) == BENCH_TLS_LOOPS ? "ok" : "BAD");
+
+    uint64_t argv[KTHREAD_MAX_ARGS] = { 1, 2, 3, 4, 5, 0x600000000ULL };
+    int args_ok = 0, closure_ok = 0;
+
+    int tid = kthread_create_argv(bench_args_worker, "bench-args", KTHREAD_PRIO_DEFAULT, KTHREAD_JOINABLE,
+        KTHREAD_MAX_ARGS, argv);
+    if (tid != -1)
+        kthread_join(tid, &args_ok);
+
+    {
+        bench_closure_t cl = { .a = 7, .b = 8 };
+        strncpy(cl.tag, "closure", sizeof(cl.tag) - 1);
+
+        tid = kthread_create_closure(bench_closure_worker, &cl, sizeof(cl), "bench-closure",
+            KTHREAD_PRIO_DEFAULT, KTHREAD_JOINABLE);
+    }
+
+    if (tid != -1)
+        kthread_join(tid, &closure_ok);
+
+    kprintf("  6 args %s  closure %s\n", args_ok ? "ok" : "BAD", closure_ok ? "ok" : "BAD");
+}
+
+void bench_run(const char* name)
+{
+    if (strcmp(name, "slab") == 0)
+        bench_slab();
+    else if (strcmp(name, "large") == 0)
+        bench_large();
+    else if (strcmp(name, "cacheline") == 0)
+        bench_cacheline();
+    else if (strcmp(name, "preempt") == 0)
+        bench_preempt();
+    else if (strcmp(name, "runqueue") == 0)
+        bench_runqueue();
+    else if (strcmp(name, "sleep") == 0)
+        bench_sleep();
+    else if (strcmp(name, "smp") == 0)
+        bench_smp();
+    else if (strcmp(name, "fpu") == 0)
+        bench_fpu();
+    else if (strcmp(name, "kstack") == 0)
+        bench_kstack();
+    else if (strcmp(name, "join") == 0)
+        bench_join();
+    else if (strcmp(name, "locks") == 0)
+        bench_locks();
+    else if (strcmp(name, "idle") == 0)
+        bench_idle();
+    else if (strcmp(name, "tls") == 0)
+        bench_tls();
+    else
+        kprintf("bench: unknown '%s' (slab, large, cacheline, preempt, runqueue, sleep, smp, fpu, kstack, join, locks, idle, tls)\n", name);
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/*
+ * clocksource: TSC calibrated against the PIT at boot (init/pit.h)
+ *
+ * notas:
+ *  - ktime_get(): ns since boot, (tsc - base) * mult >> 32 -> no divide on the hot path
+ *  - before calibration (or if it failed) ktime falls back to cpu_ticks * TICK_NSEC
+ *  - jiffies (cpu_ticks) stay HZ-based: the timer wheel and time slices count ticks
+ *  - clock events (what moves cpu_ticks) are the LAPIC timer (init/apic.h) or the PIT
+ */
+
+#define HZ 1000 // jiffies per second
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC  1000000000ULL
+#define TICK_NSEC     (NSEC_PER_SEC / HZ)
+
+static uint64_t tsc_khz = 0;
+static uint64_t tsc_base = 0;
+static uint64_t tsc_mult = 0;    // ns per cycle, 32.32 fixed point
+static uint64_t tsc_ns_mult = 0; // cycles per ns, 32.32 fixed point
+
+// LAPIC timer took over from the PIT: cpu_ticks only moves when an event fires
+static bool clock_tickless = false;
+
+static inline uint64_t mul_shr32(uint64_t a, uint64_t mult)
+{
+    return (uint64_t)(((unsigned __int128)a * mult) >> 32);
+}
+
+uint64_t ktime_get(void)
+{
+    if (!tsc_khz)
+        return cpu_ticks * TICK_NSEC;
+
+    return mul_shr32(rdtsc() - tsc_base, tsc_mult);
+}
+
+static inline uint64_t cycles_to_ns(uint64_t cycles)
+{
+    return mul_shr32(cycles, tsc_mult);
+}
+
+static inline uint64_t ns_to_cycles(uint64_t ns)
+{
+    return mul_shr32(ns, tsc_ns_mult);
+}
+
+// current jiffy, read from the clock when no periodic tick keeps cpu_ticks fresh
+static inline uint64_t clock_ticks(void)
+{
+    return clock_tickless ? ktime_get() / TICK_NSEC : cpu_ticks;
+}
+
+/* clock_init: switches ktime to the TSC
+ *  - khz: measured TSC frequency (0 = calibration failed, stay on jiffies)
+ *  - the base keeps ktime continuous with the jiffies counted so far
+ */
+bool clock_init(uint64_t khz)
+{
+    if (!khz)
+        return false;
+
+    tsc_mult = (NSEC_PER_MSEC << 32) / khz;
+    tsc_ns_mult = (khz << 32) / NSEC_PER_MSEC;
+    tsc_base = rdtsc() - ns_to_cycles(cpu_ticks * TICK_NSEC);
+    tsc_khz = khz;
+
+    return true;
+}
+
+// busy waits with ns resolution (sub-tick delays); needs a calibrated TSC when IF=0
+void ndelay(uint64_t ns)
+{
+    uint64_t end = ktime_get() + ns;
+
+    while (ktime_get() < end)
+        cpu_relax();
+}
+
+void udelay(uint64_t us)
+{
+    ndelay(us * NSEC_PER_USEC);
+}
+
+#endif
@@ -1,10 +1,14 @@
 #ifndef INIT_H
 #define INIT_H
 
-// #include "init/map.h"
+#include "init/map.h"
+#include "init/stack.h"
 #include "init/idt.h"
 #include "init/pic.h"
 #include "init/pit.h"
+#include "init/apic.h"
+#include "init/fpu.h"
+#include "init/smp.h"
 
 inline uint8_t test_access(const void* addr)
 {
@@ -73,8 +77,9 @@ void init_stub()
     main();
 }
 
-void init(void)
+void init(boot_info_t* bi)
 { 
+    smp_bsp_init();
     init_pic();
     init_pit();
     init_idt();  
@@ -97,25 +102,54 @@ void init(void)
     tty0.vga_flush();
     kprintf("system: pic OK\nsystem: pit OK\nsystem: idt64 OK\nsystem: tty OK\n");
 
+    if (clock_init(pit_calibrate_tsc()))
+        kprintf("system: tsc OK (%d kHz)\n", (int)tsc_khz);
+    else
+        kprintf("system: tsc NOT OK, ktime follows the pit\n");
+
+    if (lapic_timer_init())
+        kprintf("system: lapic timer OK (%s, tickless idle)\n", lapic_tsc_deadline ? "tsc-deadline" : "one-shot");
+    else
+        kprintf("system: lapic timer NOT OK, pit stays periodic\n");
+
+    if (fpu_init())
+        kprintf("system: fpu OK (%s, %d bytes per thread)\n", fpu_xsave ? "xsave" : "fxsave", (int)fpu_state_size);
+    else
+        kprintf("system: fpu NOT OK, kernel_fpu_begin disabled\n");
+
     test_all_access();
 
+    // boot_info comes as a physical address (low memory, mapped at VO + PA)
+    pmm_init(phys_to_virt((uintptr_t)bi));
+    kprintf("system: pmm OK (%d KiB free)\n", (int)(pmm_free_frames * (PAGE_SIZE / 1024)));
+
     kbrk_init();
     slab_init();
     kprintf("kmalloc: kbrk OK\nkmalloc: slab OK\n");
 
+    if (kstack_init())
+        kprintf("kthread: stacks OK (%d slots, guard pages)\n", KSTACK_SLOTS);
+    else
+        kprintf("kthread: stacks NOT OK, kmalloc stacks without guard pages\n");
+
     init_fs();
     kprintf("system: ramfs OK\n");
 
     kthread_subsystem_init();
     kprintf("kthread: subsystem OK\n");
 
-    if (kthread_create(kb_driver, NULL, "kb_driver") == -1)
+    kb_queue.head = 0;
+    kb_queue.tail = 0;
+    kb_queue.count = 0;
+
+    // until ksoftirqd runs, softirqs only run on IRQ exit
+    if (!softirq_init())
     {
-        kprintf("kthread: kb_driver NOT OK\n");
+        kprintf("kthread: ksoftirqd NOT OK\n");
         panic();
     }
 
-    kprintf("kthread: kb_driver OK\n");
+    kprintf("kthread: softirq OK\n");
 
     if (kthread_create(init_stub, NULL, "main") == -1)
     {
@@ -123,10 +157,13 @@ void init(void)
         panic();
     }
 
-    waitq_init(&kb_thread);
-    kb_queue.head = 0;
-    kb_queue.tail = 0;
-    kb_queue.count = 0;
+    int n = smp_init();
+    kprintf("system: smp OK (%d cpu%s)\n", n, n > 1 ? "s" : "");
+
+    if (workqueue_subsystem_init())
+        kprintf("kthread: workqueue OK (%d workers)\n", system_wq->nr_workers);
+    else
+        kprintf("kthread: workqueue NOT OK\n");
 
     kthread_start_scheduler(); // idle() -> ... -> init_stub() -> main()
 }
@@ -0,0 +1,420 @@
+#ifndef APIC_H
+#define APIC_H
+
+/*
+ * local APIC timer as the clock event device (tickless idle)
+ *
+ * notas:
+ *  - TSC-deadline mode when CPUID.1:ECX[24] says so, else one-shot (calibrated against the TSC)
+ *  - busy: one event per jiffy (time slices, wakeups waiting for irq_exit)
+ *  - idle: only the next timer of the wheel, or nothing at all -> hlt until some IRQ
+ *  - every event sets cpu_ticks = ktime_get() / TICK_NSEC; the PIT (IRQ0) gets masked
+ *  - no APIC / TSC not calibrated -> the PIT keeps ticking at HZ (idt.h irq0)
+ *  - SMP: every CPU runs its own LAPIC timer (tick + idle state in cpu_t); only the boot CPU
+ *    moves cpu_ticks and services the timer wheel
+ *  - IPIs: resched (a wakeup queued work on another CPU), clock (an AP added an early timer)
+ *    and tlb (init/stack.h is about to reuse address space it unmapped)
+ */
+
+#define IA32_APIC_BASE    0x1B
+#define IA32_TSC_DEADLINE 0x6E0
+#define APIC_BASE_ENABLE  (1ULL << 11)
+
+#define LAPIC_ID         0x020
+#define LAPIC_TPR        0x080
+#define LAPIC_EOI        0x0B0
+#define LAPIC_SVR        0x0F0
+#define LAPIC_ICR_LOW    0x300
+#define LAPIC_ICR_HIGH   0x310
+#define LAPIC_LVT_TIMER  0x320
+#define LAPIC_LVT_LINT0  0x350
+#define LAPIC_LVT_LINT1  0x360
+#define LAPIC_TIMER_INIT 0x380
+#define LAPIC_TIMER_CUR  0x390
+#define LAPIC_TIMER_DIV  0x3E0
+
+#define LAPIC_SVR_ENABLE         (1 << 8)
+#define LAPIC_LVT_MASKED         (1 << 16)
+#define LAPIC_LVT_EXTINT         (7 << 8)  // LINT0: the 8259 keeps delivering IRQs (virtual wire)
+#define LAPIC_LVT_NMI            (4 << 8)
+#define LAPIC_TIMER_ONESHOT      (0 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_TIMER_DIV16        0x3
+
+#define LAPIC_ICR_INIT    (5 << 8)
+#define LAPIC_ICR_STARTUP (6 << 8)
+#define LAPIC_ICR_PENDING (1 << 12) // delivery status: still being sent
+#define LAPIC_ICR_ASSERT  (1 << 14)
+
+#define LAPIC_TIMER_VECTOR    0xEF
+#define IPI_RESCHED_VECTOR    0xF2
+#define IPI_CLOCK_VECTOR      0xF3
+#define IPI_TLB_VECTOR        0xF4
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+#define LAPIC_CALIBRATE_MS 10
+#define CLOCK_MIN_DELTA_NS 1000 // never arm closer than 1 us
+#define CLOCK_EVENT_NONE   UINT64_MAX
+
+static volatile uint32_t* lapic = NULL;
+static bool lapic_tsc_deadline = false;
+static uint64_t lapic_khz = 0;     // timer counts per ms (after the /16 divider)
+static uint64_t lapic_ns_mult = 0; // timer counts per ns, 32.32 fixed point
+
+static inline uint32_t lapic_read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+}
+
+static inline uint32_t lapic_id(void)
+{
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+// fixed-vector (or INIT / STARTUP) IPI to one CPU; returns once the LAPIC has sent it
+static void lapic_send_ipi(uint32_t apic_id, uint32_t icr)
+{
+    uint64_t flags = irq_save();
+
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr);
+
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+        cpu_relax();
+
+    irq_restore(flags);
+}
+
+// threads.h: a thread was queued on (or should preempt) another CPU
+void smp_send_resched(int cpu)
+{
+    lapic_send_ipi(cpus[cpu].apic_id, IPI_RESCHED_VECTOR);
+}
+
+static volatile int tlb_flush_pending = 0; // CPUs that haven't flushed yet
+static spinlock_t tlb_flush_lock;
+
+/* smp_flush_tlb_all: returns once every online CPU dropped its translations
+ *  - thread context, IF=1 and no spinlock held: the others must be able to take the IPI
+ */
+void smp_flush_tlb_all(void)
+{
+    spin_lock(&tlb_flush_lock); // preempt off: "the others" can't change under us
+
+    flush_tlb_local();
+
+    int self = smp_processor_id();
+    int others = 0;
+
+    for (int c = 0; c < nr_cpus; ++c)
+        if (c != self && cpus[c].online)
+            others++;
+
+    if (others && lapic)
+    {
+        tlb_flush_pending = others;
+
+        for (int c = 0; c < nr_cpus; ++c)
+            if (c != self && cpus[c].online)
+                lapic_send_ipi(cpus[c].apic_id, IPI_TLB_VECTOR);
+
+        while (__atomic_load_n(&tlb_flush_pending, __ATOMIC_ACQUIRE))
+            cpu_relax();
+    }
+
+    spin_unlock(&tlb_flush_lock);
+}
+
+// arms this CPU's LAPIC timer for ktime `ns` (CLOCK_EVENT_NONE = disarm), IF=0
+static void clock_set_event(uint64_t ns)
+{
+    this_cpu_write(clock_next_event, ns);
+
+    if (ns == CLOCK_EVENT_NONE)
+    {
+        if (lapic_tsc_deadline)
+            wrmsr(IA32_TSC_DEADLINE, 0);
+        else
+            lapic_write(LAPIC_TIMER_INIT, 0);
+
+        return;
+    }
+
+    uint64_t now = ktime_get();
+    uint64_t delta = ns > now + CLOCK_MIN_DELTA_NS ? ns - now : CLOCK_MIN_DELTA_NS;
+
+    if (lapic_tsc_deadline)
+    {
+        wrmsr(IA32_TSC_DEADLINE, rdtsc() + ns_to_cycles(delta));
+        return;
+    }
+
+    uint64_t count = mul_shr32(delta, lapic_ns_mult);
+    if (count == 0)
+        count = 1;
+    if (count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF; // too far: fires early and gets re-armed
+
+    lapic_write(LAPIC_TIMER_INIT, (uint32_t)count);
+}
+
+// next thing that has to happen here: the tick (unless idle) and, on the boot CPU, the wheel
+static void clock_program(void)
+{
+    uint64_t next = CLOCK_EVENT_NONE;
+
+    if (!this_cpu_read(clock_idle))
+        next = (ktime_get() / TICK_NSEC + 1) * TICK_NSEC;
+
+    if (smp_processor_id() != 0)
+    {
+        clock_set_event(next);
+        return;
+    }
+
+    // the boot CPU's event is read by APs adding timers (clock_timer_added)
+    raw_spin_lock(&timer_lock);
+
+    if (timer_pending)
+    {
+        uint64_t t = timer_next_expiry() * TICK_NSEC;
+        if (t < next)
+            next = t;
+    }
+
+    clock_set_event(next);
+
+    raw_spin_unlock(&timer_lock);
+}
+
+// schedule(): idle in or out -> stop / restart the tick
+void clock_idle_switch(bool idle)
+{
+    if (!clock_tickless)
+        return;
+
+    this_cpu_write(clock_idle, idle);
+    clock_program();
+}
+
+/* timer_add() (timer_lock held): a timer earlier than the boot CPU's armed event
+ *  - on an AP the boot CPU is asked to re-arm (IPI), it owns the wheel
+ */
+void clock_timer_added(uint64_t expires)
+{
+    if (!clock_tickless)
+        return;
+
+    uint64_t ns = expires * TICK_NSEC;
+    if (ns >= cpus[0].clock_next_event)
+        return;
+
+    if (smp_processor_id() == 0)
+        clock_set_event(ns);
+    else
+        lapic_send_ipi(cpus[0].apic_id, IPI_CLOCK_VECTOR);
+}
+
+void lapic_timer_handler(void)
+{
+    cpu_t* cpu = this_cpu();
+
+    lapic_write(LAPIC_EOI, 0);
+    cpu->clock_events++;
+
+    uint64_t now = ktime_get() / TICK_NSEC;
+    int elapsed = (int)(now - cpu->clock_last_tick);
+    cpu->clock_last_tick = now;
+
+    if (cpu->id == 0)
+    {
+        cpu_ticks = now;
+        timer_tick();
+    }
+
+    if (elapsed > 0)
+        sched_tick(elapsed);
+
+    clock_program();
+}
+IRQ_STUB(lapic_timer_isr, lapic_timer_handler);
+
+// need_resched is already set by whoever sent it: irq_exit does the switch
+void ipi_resched_handler(void)
+{
+    lapic_write(LAPIC_EOI, 0);
+}
+IRQ_STUB(ipi_resched_isr, ipi_resched_handler);
+
+// boot CPU: an AP added a timer earlier than our next event
+void ipi_clock_handler(void)
+{
+    lapic_write(LAPIC_EOI, 0);
+    clock_program();
+}
+IRQ_STUB(ipi_clock_isr, ipi_clock_handler);
+
+// smp_flush_tlb_all on another CPU
+__attribute__((interrupt)) static void ipi_tlb_isr(struct irq_frame* frame)
+{
+    (void)frame;
+
+    flush_tlb_local();
+    __atomic_fetch_sub(&tlb_flush_pending, 1, __ATOMIC_RELEASE);
+
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// spurious: no EOI
+__attribute__((interrupt)) static void lapic_spurious_isr(struct irq_frame* frame)
+{
+    (void)frame;
+}
+
+// LAPIC timer counts in LAPIC_CALIBRATE_MS, measured with the (calibrated) TSC
+static uint64_t lapic_calibrate(void)
+{
+    lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+
+    uint64_t end = rdtsc() + ns_to_cycles(LAPIC_CALIBRATE_MS * NSEC_PER_MSEC);
+    while (rdtsc() < end)
+        cpu_relax();
+
+    uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    return counted / LAPIC_CALIBRATE_MS;
+}
+
+/* lapic_timer_init: moves the clock events from the PIT to the LAPIC timer
+ *  - false (PIT stays periodic) without an APIC or a calibrated TSC
+ */
+bool lapic_timer_init(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+
+    if (!tsc_khz || !(d & (1 << 9)))
+        return false;
+
+    uint64_t flags = irq_save();
+
+    uint64_t base = rdmsr(IA32_APIC_BASE);
+    wrmsr(IA32_APIC_BASE, base | APIC_BASE_ENABLE);
+
+    lapic = ioremap(base & PTE_ADDR);
+    if (!lapic)
+    {
+        irq_restore(flags);
+        return false;
+    }
+
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uintptr_t)lapic_timer_isr, GDT64_CODE_PTR, 0x8E);
+    idt_set_gate(IPI_RESCHED_VECTOR, (uintptr_t)ipi_resched_isr, GDT64_CODE_PTR, 0x8E);
+    idt_set_gate(IPI_CLOCK_VECTOR, (uintptr_t)ipi_clock_isr, GDT64_CODE_PTR, 0x8E);
+    idt_set_gate(IPI_TLB_VECTOR, (uintptr_t)ipi_tlb_isr, GDT64_CODE_PTR, 0x8E);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uintptr_t)lapic_spurious_isr, GDT64_CODE_PTR, 0x8E);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_EXTINT);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    cpus[0].apic_id = lapic_id();
+    lapic_tsc_deadline = c & (1 << 24);
+
+    if (lapic_tsc_deadline)
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+    else
+    {
+        lapic_khz = lapic_calibrate();
+        if (!lapic_khz)
+        {
+            irq_restore(flags);
+            return false;
+        }
+
+        lapic_ns_mult = (lapic_khz << 32) / NSEC_PER_MSEC;
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    }
+
+    // from here on the LAPIC drives cpu_ticks
+    pic_mask(0);
+    cpu_ticks = ktime_get() / TICK_NSEC;
+    cpus[0].clock_last_tick = cpu_ticks;
+    clock_tickless = true;
+    clock_program();
+
+    irq_restore(flags);
+    return true;
+}
+
+/* lapic_ap_init: an AP's LAPIC, in the mode the boot CPU picked (init/smp.h, IF=0)
+ *  - LINT0 masked: the 8259 (every device IRQ) stays wired to the boot CPU
+ */
+void lapic_ap_init(void)
+{
+    wrmsr(IA32_APIC_BASE, rdmsr(IA32_APIC_BASE) | APIC_BASE_ENABLE);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+
+    if (lapic_tsc_deadline)
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_TSC_DEADLINE | LAPIC_TIMER_VECTOR);
+    else
+    {
+        lapic_write(LAPIC_TIMER_DIV, LAPIC_TIMER_DIV16);
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_ONESHOT | LAPIC_TIMER_VECTOR);
+    }
+
+    this_cpu_write(clock_last_tick, ktime_get() / TICK_NSEC);
+    clock_program();
+}
+
+void dump_clock(void)
+{
+    kprintf("[clock] tsc %d kHz  ktime %d ms  jiffies %d (HZ %d)\n",
+        (int)tsc_khz, (int)(ktime_get() / NSEC_PER_MSEC), (int)cpu_ticks, HZ);
+
+    if (!clock_tickless)
+    {
+        kprintf("  events: pit, periodic\n");
+        return;
+    }
+
+    if (lapic_tsc_deadline)
+        kprintf("  events: lapic tsc-deadline\n");
+    else
+        kprintf("  events: lapic one-shot (%d kHz)\n", (int)lapic_khz);
+
+    kprintf("  pending timers %d\n", (int)timer_pending);
+
+    for (int i = 0; i < nr_cpus; ++i)
+    {
+        cpu_t* c = &cpus[i];
+        if (!c->online)
+            continue;
+
+        uint64_t next = c->clock_next_event;
+
+        kprintf("  cpu %d: fired %d  %s  next %s", i, (int)c->clock_events,
+            c->clock_idle ? "idle" : "busy", next == CLOCK_EVENT_NONE ? "none\n" : "");
+
+        if (next != CLOCK_EVENT_NONE)
+        {
+            uint64_t now = ktime_get();
+            kprintf("+%d us\n", next > now ? (int)((next - now) / NSEC_PER_USEC) : 0);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef FPU_H
+#define FPU_H
+
+/*
+ * FPU/SSE/AVX state for kernel threads (kernel_fpu_begin / kernel_fpu_end)
+ *
+ * notas:
+ *  - the kernel is built -mgeneral-regs-only: vector code is opt-in, in FPU_SIMD functions
+ *    called only between kernel_fpu_begin() and kernel_fpu_end()
+ *  - per-thread XSAVE area (FXSAVE without XSAVE), allocated on the first kernel_fpu_begin
+ *  - save: at switch-out, only for a thread inside a section whose registers are live on
+ *    this CPU; every other switch costs no FPU work at all
+ *  - restore: lazy; switch-in sets CR0.TS and the first SIMD instruction traps (#NM) into
+ *    fpu_nm_isr. Back on the CPU that still holds its registers -> TS stays clear, no restore
+ *  - sections may be preempted or block; no SIMD in ISRs
+ */
+
+#define CR0_MP         (1 << 1)
+#define CR0_EM         (1 << 2)
+#define CR0_TS         (1 << 3)
+#define CR4_OSFXSR     (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE    (1 << 18)
+
+#define XSTATE_X87 (1ULL << 0)
+#define XSTATE_SSE (1ULL << 1)
+#define XSTATE_AVX (1ULL << 2)
+
+#define FPU_NM_VECTOR   7
+#define FPU_FXSAVE_SIZE 512
+#define FPU_MXCSR_INIT  0x1F80 // every SIMD exception masked
+
+// vector code: sse2 for this function only, never inlined into general-regs code
+#define FPU_SIMD __attribute__((target("sse2"), noinline))
+
+static bool fpu_xsave = false;
+static uint64_t fpu_xcr0 = 0;
+static size_t fpu_state_size = 0; // 0 = no FPU support, kernel_fpu_begin says no
+
+static uint64_t fpu_saves = 0;
+static uint64_t fpu_restores = 0;
+static uint64_t fpu_lazy_hits = 0; // switch-ins that found their registers still loaded
+
+static inline void xsetbv(uint32_t index, uint64_t value)
+{
+    asm volatile ("xsetbv" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void fpu_save(uint8_t* area)
+{
+    if (fpu_xsave)
+        asm volatile ("xsave64 (%0)" : : "r"(area), "a"((uint32_t)fpu_xcr0), "d"((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+}
+
+static inline void fpu_restore(const uint8_t* area)
+{
+    if (fpu_xsave)
+        asm volatile ("xrstor64 (%0)" : : "r"(area), "a"((uint32_t)fpu_xcr0), "d"((uint32_t)(fpu_xcr0 >> 32)) : "memory");
+    else
+        asm volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+}
+
+// every CPU (boot: fpu_init, APs: ap_main): SSE on, XSAVE features enabled, TS set
+void fpu_cpu_init(void)
+{
+    if (!fpu_xcr0)
+        return;
+
+    write_cr0((read_cr0() & ~(uint64_t)CR0_EM) | CR0_MP | CR0_TS);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_xsave)
+        cr4 |= CR4_OSXSAVE;
+
+    write_cr4(cr4);
+
+    if (fpu_xsave)
+        xsetbv(0, fpu_xcr0);
+}
+
+// first SIMD instruction since the switch-in: load the thread's state
+__attribute__((interrupt)) static void fpu_nm_isr(struct irq_frame* frame)
+{
+    (void)frame;
+
+    kthread_t* t = current;
+    if (!t || !t->fpu_depth)
+    {
+        kprintf("#NM: SIMD outside kernel_fpu_begin/end\n");
+        panic();
+    }
+
+    clts();
+
+    cpu_t* cpu = this_cpu();
+    if (cpu->fpu_owner != t || t->fpu_cpu != cpu->id)
+    {
+        fpu_restore(t->fpu_state);
+        fpu_restores++;
+    }
+
+    cpu->fpu_owner = t;
+    t->fpu_cpu = cpu->id;
+}
+
+/* fpu_switch: context switch hook (threads.h __schedule, sched_lock held, IF=0)
+ *  - TS clear means the registers are live and belong to fpu_owner
+ */
+void fpu_switch(kthread_t* prev, kthread_t* next)
+{
+    if (!fpu_state_size)
+        return;
+
+    cpu_t* cpu = this_cpu();
+    uint64_t cr0 = read_cr0();
+
+    if (prev && cpu->fpu_owner == prev)
+    {
+        if (prev->state == THREAD_ZOMBIE)
+            cpu->fpu_owner = NULL;
+        else if (!(cr0 & CR0_TS) && prev->fpu_depth > 0)
+        {
+            fpu_save(prev->fpu_state);
+            fpu_saves++;
+        }
+    }
+
+    // same CPU and nobody loaded anything since: its registers are still there
+    if (next->fpu_depth > 0 && cpu->fpu_owner == next && next->fpu_cpu == cpu->id)
+    {
+        fpu_lazy_hits++;
+        if (cr0 & CR0_TS)
+            clts();
+    }
+    else if (!(cr0 & CR0_TS))
+        write_cr0(cr0 | CR0_TS);
+}
+
+/* fpu_init: boot CPU, before any thread (after the IDT)
+ *  - XSAVE with x87 | SSE (| AVX when the CPU has it), else FXSAVE
+ *  - false: no SSE, kernel_fpu_begin() always fails
+ */
+bool fpu_init(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+
+    // FXSR + SSE + SSE2
+    if (!(d & (1 << 24)) || !(d & (1 << 25)) || !(d & (1 << 26)))
+        return false;
+
+    fpu_xsave = c & (1 << 26);
+
+    if (fpu_xsave)
+    {
+        uint32_t sa, sb, sc, sd;
+        cpuid(0xD, 0, &sa, &sb, &sc, &sd);
+
+        fpu_xcr0 = XSTATE_X87 | XSTATE_SSE;
+        if ((c & (1 << 28)) && (sa & XSTATE_AVX))
+            fpu_xcr0 |= XSTATE_AVX;
+    }
+    else
+        fpu_xcr0 = XSTATE_X87 | XSTATE_SSE; // what FXSAVE covers (not written to XCR0)
+
+    fpu_cpu_init();
+
+    if (fpu_xsave)
+    {
+        // EBX: area size for the features now enabled in XCR0
+        cpuid(0xD, 0, &a, &b, &c, &d);
+        fpu_state_size = b;
+    }
+    else
+        fpu_state_size = FPU_FXSAVE_SIZE;
+
+    idt_set_gate(FPU_NM_VECTOR, (uintptr_t)fpu_nm_isr, GDT64_CODE_PTR, 0x8E);
+    return true;
+}
+
+/* kernel_fpu_begin: the calling thread may use SIMD until kernel_fpu_end
+ *  - false (use the scalar path) without FPU support or memory for the save area
+ *  - nests; thread context only
+ */
+bool kernel_fpu_begin(void)
+{
+    kthread_t* t = current;
+    if (!fpu_state_size || !t)
+        return false;
+
+    if (!t->fpu_state)
+    {
+        uint8_t* raw = kzalloc(fpu_state_size + 63);
+        if (!raw)
+            return false;
+
+        uint8_t* area = (uint8_t*)(((uintptr_t)raw + 63) & ~(uintptr_t)63);
+
+        // init state: XSTATE_BV = 0 resets x87/SSE/AVX, but MXCSR is always loaded
+        *(uint16_t*)(area + 0) = 0x037F; // FCW (FXRSTOR path)
+        *(uint32_t*)(area + 24) = FPU_MXCSR_INIT;
+
+        t->fpu_alloc = raw;
+        t->fpu_state = area;
+    }
+
+    t->fpu_depth++;
+    return true;
+}
+
+void kernel_fpu_end(void)
+{
+    current->fpu_depth--;
+}
+
+// copy with 16-byte SSE loads/stores (no overlap); call inside kernel_fpu_begin/end
+FPU_SIMD void memcpy_simd(void* dest, const void* src, size_t n)
+{
+    typedef long long v2di_u __attribute__((vector_size(16), aligned(1)));
+
+    v2di_u* d = dest;
+    const v2di_u* s = src;
+
+    for (; n >= 64; n -= 64, d += 4, s += 4)
+    {
+        v2di_u x0 = s[0], x1 = s[1], x2 = s[2], x3 = s[3];
+        d[0] = x0;
+        d[1] = x1;
+        d[2] = x2;
+        d[3] = x3;
+    }
+
+    for (; n >= 16; n -= 16)
+        *d++ = *s++;
+
+    uint8_t* db = (uint8_t*)d;
+    const uint8_t* sb = (const uint8_t*)s;
+    while (n--)
+        *db++ = *sb++;
+}
+
+void dump_fpu(void)
+{
+    if (!fpu_state_size)
+    {
+        kprintf("[fpu] not available\n");
+        return;
+    }
+
+    kprintf("[fpu] %s  area %d bytes  xcr0 %x%s\n", fpu_xsave ? "xsave" : "fxsave",
+        (int)fpu_state_size, (unsigned int)fpu_xcr0, (fpu_xcr0 & XSTATE_AVX) ? " (avx)" : "");
+    kprintf("  saves %d  restores %d  lazy hits %d\n",
+        (int)fpu_saves, (int)fpu_restores, (int)fpu_lazy_hits);
+}
+
+#endif
@@ -8,16 +8,35 @@ __attribute__((noreturn)) static void gp_isr(void)
     panic();
 }
 
+// fault inside the stack area: a thread ran off its stack into the guard pages (init/stack.h)
+static void report_stack_fault(uint64_t addr)
+{
+    if (!kstack_in_area(addr))
+        return;
+
+    kthread_t* t = kstack_guard_owner(addr);
+    if (t)
+        kprintf("stack overflow: thread %d \"%s\" (stack %p..%p, fault at %p)\n",
+            t->id, t->name, t->stack, t->stack + t->stack_size, (void*)addr);
+    else
+        kprintf("fault on a free stack slot (%p)\n", (void*)addr);
+}
+
 __attribute__((noreturn)) static void pf_isr(void)
 {
-    kprintf("#PF got caught\n");
+    uint64_t addr = read_cr2();
+
+    kprintf("#PF got caught (%p)\n", (void*)addr);
+    report_stack_fault(addr);
 
     panic();
 }
 
+// an overflow that leaves no room for the #PF frame ends up here, on the IST stack
 __attribute__((noreturn)) static void df_isr(void)
 {
     kprintf("#DF got caught\n");
+    report_stack_fault(read_cr2());
 
     panic();
 }
@@ -39,29 +58,108 @@ static struct irq_frame
     uint64_t ss;
 };
 
-__attribute__((interrupt)) static void irq0_isr(struct irq_frame* instance)
+// C side of IRQ_STUB: handler counted as hard IRQ context (softirq.h in_interrupt), then irq_exit
+void irq_handle(void (*handler)(void))
+{
+    asm volatile("incl %%gs:%c0" : : "i"(offsetof(cpu_t, irq_depth)) : "memory");
+    handler();
+    asm volatile("decl %%gs:%c0" : : "i"(offsetof(cpu_t, irq_depth)) : "memory");
+
+    irq_exit();
+}
+
+/* IRQ entry stubs that may switch threads on the way out
+ *  - every GPR is pushed (15 regs + the 5 qword CPU frame keep RSP 16-aligned for the call)
+ *  - handler runs with IF=0 and sends its own EOI
+ *  - irq_exit (threads.h) runs softirqs and may schedule() here; the thread resumes later
+ *    at the pops + iretq
+ */
+#define IRQ_STUB(name, handler)             \
+    void name(void);                        \
+    asm(                                    \
+        ".text\n"                           \
+        ".globl " #name "\n"                \
+        #name ":\n\t"                       \
+        "pushq %rax\n\t"                    \
+        "pushq %rbx\n\t"                    \
+        "pushq %rcx\n\t"                    \
+        "pushq %rdx\n\t"                    \
+        "pushq %rsi\n\t"                    \
+        "pushq %rdi\n\t"                    \
+        "pushq %rbp\n\t"                    \
+        "pushq %r8\n\t"                     \
+        "pushq %r9\n\t"                     \
+        "pushq %r10\n\t"                    \
+        "pushq %r11\n\t"                    \
+        "pushq %r12\n\t"                    \
+        "pushq %r13\n\t"                    \
+        "pushq %r14\n\t"                    \
+        "pushq %r15\n\t"                    \
+        "cld\n\t"                           \
+        "movabs $" #handler ", %rdi\n\t"    \
+        "movabs $irq_handle, %rax\n\t"      \
+        "callq *%rax\n\t"                   \
+        "popq %r15\n\t"                     \
+        "popq %r14\n\t"                     \
+        "popq %r13\n\t"                     \
+        "popq %r12\n\t"                     \
+        "popq %r11\n\t"                     \
+        "popq %r10\n\t"                     \
+        "popq %r9\n\t"                      \
+        "popq %r8\n\t"                      \
+        "popq %rbp\n\t"                     \
+        "popq %rdi\n\t"                     \
+        "popq %rsi\n\t"                     \
+        "popq %rdx\n\t"                     \
+        "popq %rcx\n\t"                     \
+        "popq %rbx\n\t"                     \
+        "popq %rax\n\t"                     \
+        "iretq\n"                           \
+    )
+
+void irq0_handler(void)
 {
     cpu_ticks++;
     eoi_out();
+
+    timer_tick();
+    sched_tick(1);
 }
+IRQ_STUB(irq0_isr, irq0_handler);
 
 // pressionar a tecla -> sinal elétrico pro controlador -> aciona PIC escravo -> aciona PIC mestre e trigga IRQ1 -> executa a ISR -> le o scancode na porta 0x60 -> transformar em caractere pela ascii -> interpreta e guarda o resultado no input buffer -> read() lê do buffer -> se tty.echo == true -> aparece na tela
-__attribute__((interrupt)) static void irq1_isr(struct irq_frame* instance)
+void irq1_handler(void)
 {
     uint8_t al;
 
     asm volatile("inb $0x60, %0" : "=a"(al));
 
-    if (kb_queue.count < 256)
+    raw_spin_lock(&kb_lock);
+
+    bool queued = kb_queue.count < 256;
+    if (queued)
     {
         kb_queue.buffer[kb_queue.head] = al;
         kb_queue.head = (kb_queue.head + 1) % 256;
         kb_queue.count++;
-        thread_wake_one(&kb_thread);
     }
 
+    raw_spin_unlock(&kb_lock);
+
+    // the rest (ldisc, echo, waking the reader) runs as a tasklet on the way out
+    if (queued)
+        tasklet_schedule(&kb_tasklet);
+
     eoi_out();
 }
+IRQ_STUB(irq1_isr, irq1_handler);
+
+// software interrupt that queues work from IRQ context (bench preempt)
+void wq_kick_handler(void)
+{
+    wq_kick();
+}
+IRQ_STUB(wq_kick_isr, wq_kick_handler);
 
 __attribute__((interrupt)) static void beep_isr(struct irq_frame* instance)
 {
@@ -117,6 +215,7 @@ void init_idt(void)
 
     // faults
     idt_set_gate(8,  (uintptr_t)df_isr, GDT64_CODE_PTR, 0x8E);
+    idt[8].ist = 1; // own stack (TSS IST1, init/smp.h): a #DF from an overflowed stack still runs
     idt_set_gate(13, (uintptr_t)gp_isr, GDT64_CODE_PTR, 0x8E);
     idt_set_gate(14, (uintptr_t)pf_isr, GDT64_CODE_PTR, 0x8E);
 
@@ -126,6 +225,7 @@ void init_idt(void)
 
     // software interrupts
     idt_set_gate(0xF0 /* 240 */, (uintptr_t)beep_isr, GDT64_CODE_PTR, 0x8E);
+    idt_set_gate(WQ_KICK_VECTOR, (uintptr_t)wq_kick_isr, GDT64_CODE_PTR, 0x8E);
 
     asm volatile
     (
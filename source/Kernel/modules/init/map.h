@@ -1,4 +1,324 @@
 #ifndef MAP_H
 #define MAP_H
 
+/*
+ * physical memory manager + heap mapping
+ *
+ * notas:
+ *  - the bootloader leaves the BIOS E820 map in boot_info (source/Struct/bootinfo.asm)
+ *  - pmm: 1 bit per 4 KiB frame (1 = used), everything is used until E820 says it is usable
+ *  - the first LOW_RESERVED_PHYS bytes are never handed out (bios, prekernel tables, kernel window)
+ *  - the heap grows right after .heap: first the rest of the kernel PT (already mapped),
+ *    then 2 MiB pages written into the kernel PD (PDPT[510]) up to 1 GiB
+ *  - the top KERNEL_MMIO_SLOTS entries of that PD are ioremap() windows (uncached),
+ *    the KSTACK_AREA_PDS under them hold the thread stacks (init/stack.h)
+ */
+
+#define BOOT_INFO_MAX_E820 32
+#define E820_USABLE        1
+
+typedef struct
+{
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;
+} __attribute__((packed)) e820_entry_t;
+
+typedef struct boot_info
+{
+    uint32_t e820_count;
+    uint32_t reserved;
+    e820_entry_t e820[BOOT_INFO_MAX_E820];
+} __attribute__((packed)) boot_info_t;
+
+#define LARGE_PAGE_SIZE   0x200000ULL // 2 MiB (PD entry with PS)
+#define FRAMES_PER_LARGE  (LARGE_PAGE_SIZE / PAGE_SIZE)
+#define PMM_MAX_FRAMES    (1ULL << 20) // 4 GiB of physical memory
+#define LOW_RESERVED_PHYS 0x400000ULL  // everything below 4 MiB stays reserved
+
+#define PTE_PRESENT  (1ULL << 0)
+#define PTE_WRITABLE (1ULL << 1)
+#define PTE_PWT      (1ULL << 3)
+#define PTE_PCD      (1ULL << 4)
+#define PTE_LARGE    (1ULL << 7)
+#define PTE_ADDR     0x000FFFFFFFFFF000ULL
+
+static uint64_t pmm_bitmap[PMM_MAX_FRAMES / 64];
+static size_t pmm_frames = 0;      // highest usable frame + 1
+static size_t pmm_free_frames = 0;
+static size_t pmm_large_hint = 0;  // first 2 MiB group worth scanning
+static bool pmm_ready = false;
+static boot_info_t* boot_info = NULL;
+
+// low physical memory (and the kernel PT) is mapped at VO + PA
+static inline void* phys_to_virt(uint64_t pa)
+{
+    return (void*)((uintptr_t)_kernel_vo + pa);
+}
+
+static inline bool pmm_test(size_t frame)
+{
+    return pmm_bitmap[frame / 64] & (1ULL << (frame % 64));
+}
+
+static inline void pmm_set(size_t frame)
+{
+    pmm_bitmap[frame / 64] |= 1ULL << (frame % 64);
+}
+
+static inline void pmm_clear(size_t frame)
+{
+    pmm_bitmap[frame / 64] &= ~(1ULL << (frame % 64));
+}
+
+void pmm_init(boot_info_t* bi)
+{
+    memset(pmm_bitmap, 0xFF, sizeof(pmm_bitmap));
+
+    boot_info = bi;
+
+    for (uint32_t i = 0; i < bi->e820_count && i < BOOT_INFO_MAX_E820; ++i)
+    {
+        e820_entry_t* e = &bi->e820[i];
+        if (e->type != E820_USABLE)
+            continue;
+
+        // only whole frames inside the region
+        uint64_t first = (e->base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t last  = (e->base + e->length) / PAGE_SIZE;
+
+        if (last > PMM_MAX_FRAMES)
+            last = PMM_MAX_FRAMES;
+
+        for (uint64_t f = first; f < last; ++f)
+        {
+            if (pmm_test(f))
+            {
+                pmm_clear(f);
+                pmm_free_frames++;
+            }
+        }
+
+        if (last > pmm_frames)
+            pmm_frames = last;
+    }
+
+    for (size_t f = 0; f < LOW_RESERVED_PHYS / PAGE_SIZE; ++f)
+    {
+        if (!pmm_test(f))
+        {
+            pmm_set(f);
+            pmm_free_frames--;
+        }
+    }
+
+    pmm_large_hint = LOW_RESERVED_PHYS / LARGE_PAGE_SIZE;
+    pmm_ready = true;
+}
+
+// one 4 KiB frame, 0 when out of memory
+uint64_t pmm_alloc_frame(void)
+{
+    for (size_t w = 0; w < (pmm_frames + 63) / 64; ++w)
+    {
+        if (pmm_bitmap[w] == ~0ULL)
+            continue;
+
+        size_t f = w * 64 + (size_t)__builtin_ctzll(~pmm_bitmap[w]);
+        if (f >= pmm_frames)
+            break;
+
+        pmm_set(f);
+        pmm_free_frames--;
+
+        return (uint64_t)f * PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+void pmm_free_frame(uint64_t pa)
+{
+    size_t f = pa / PAGE_SIZE;
+
+    if (f >= pmm_frames || !pmm_test(f))
+        return;
+
+    pmm_clear(f);
+    pmm_free_frames++;
+
+    if (f / FRAMES_PER_LARGE < pmm_large_hint)
+        pmm_large_hint = f / FRAMES_PER_LARGE;
+}
+
+// whether a 2 MiB aligned group of frames is entirely free (8 bitmap words)
+static inline bool pmm_large_free(size_t group)
+{
+    uint64_t* w = &pmm_bitmap[group * (FRAMES_PER_LARGE / 64)];
+
+    for (size_t i = 0; i < FRAMES_PER_LARGE / 64; ++i)
+        if (w[i])
+            return false;
+
+    return true;
+}
+
+// 2 MiB aligned run of frames, 0 when none is left
+uint64_t pmm_alloc_large(void)
+{
+    for (size_t g = pmm_large_hint; g < pmm_frames / FRAMES_PER_LARGE; ++g)
+    {
+        if (!pmm_large_free(g))
+            continue;
+
+        memset(&pmm_bitmap[g * (FRAMES_PER_LARGE / 64)], 0xFF, FRAMES_PER_LARGE / 8);
+        pmm_free_frames -= FRAMES_PER_LARGE;
+        pmm_large_hint = g + 1;
+
+        return (uint64_t)g * LARGE_PAGE_SIZE;
+    }
+
+    return 0;
+}
+
+static size_t pmm_count_large(void)
+{
+    size_t n = 0;
+
+    for (size_t g = pmm_large_hint; g < pmm_frames / FRAMES_PER_LARGE; ++g)
+        if (pmm_large_free(g))
+            n++;
+
+    return n;
+}
+
+// PD that maps 0xffffffff80000000..0xffffffffc0000000 (PML4[511] -> PDPT[510])
+static uint64_t* kernel_pd(void)
+{
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+
+    uint64_t* pml4 = phys_to_virt(cr3 & PTE_ADDR);
+    uint64_t* pdpt = phys_to_virt(pml4[511] & PTE_ADDR);
+
+    return phys_to_virt(pdpt[510] & PTE_ADDR);
+}
+
+// end of the kernel PT (PD[0]) and of the whole PD
+#define KERNEL_PT_END  ((uint8_t*)_kernel_vo + LARGE_PAGE_SIZE)
+#define KERNEL_PD_END  ((uint8_t*)_kernel_vo + 512 * LARGE_PAGE_SIZE)
+
+// last PD entries: uncached 2 MiB windows for MMIO (ioremap), kept out of the heap
+#define KERNEL_MMIO_SLOTS 4
+#define KERNEL_MMIO_BASE  (KERNEL_PD_END - KERNEL_MMIO_SLOTS * LARGE_PAGE_SIZE)
+
+// right under them: 4 KiB mapped thread stacks with guard pages (init/stack.h)
+#define KSTACK_AREA_PDS  4
+#define KSTACK_AREA_BASE (KERNEL_MMIO_BASE - KSTACK_AREA_PDS * LARGE_PAGE_SIZE)
+
+/* highest address the heap may grow to (page_map is sized for it):
+ * the rest of the kernel PT plus one 2 MiB page per free large frame group
+ */
+static uint8_t* kheap_max_end(void)
+{
+    if (!pmm_ready)
+        return _kernel_heap_end;
+
+    uint64_t room = (uint64_t)(KSTACK_AREA_BASE - KERNEL_PT_END);
+    uint64_t ram  = (uint64_t)pmm_count_large() * LARGE_PAGE_SIZE;
+
+    return KERNEL_PT_END + (ram < room ? ram : room);
+}
+
+// maps memory after kheap_end until it reaches new_end (alloc.h kbrk)
+static bool kheap_extend(uint8_t* new_end)
+{
+    if (!pmm_ready || new_end > kheap_limit)
+        return false;
+
+    // still inside the kernel PT: already mapped
+    if (kheap_end < KERNEL_PT_END)
+        kheap_end = new_end < KERNEL_PT_END ? new_end : KERNEL_PT_END;
+
+    uint64_t* pd = kernel_pd();
+
+    while (kheap_end < new_end)
+    {
+        uint64_t pa = pmm_alloc_large();
+        if (!pa)
+            return false;
+
+        size_t idx = (size_t)((kheap_end - (uint8_t*)_kernel_vo) / LARGE_PAGE_SIZE);
+        pd[idx] = pa | PTE_PRESENT | PTE_WRITABLE | PTE_LARGE;
+
+        asm volatile("invlpg (%0)" : : "r"(kheap_end) : "memory");
+
+        kheap_end += LARGE_PAGE_SIZE;
+    }
+
+    return true;
+}
+
+// physical address behind a kernel image / heap address (kernel PT or 2 MiB page), 0 if unmapped
+uint64_t virt_to_phys(const void* va)
+{
+    uint64_t* pd = kernel_pd();
+    size_t idx = (size_t)(((const uint8_t*)va - (uint8_t*)_kernel_vo) / LARGE_PAGE_SIZE);
+    uint64_t pde = pd[idx];
+
+    if (!(pde & PTE_PRESENT))
+        return 0;
+
+    if (pde & PTE_LARGE)
+        return (pde & PTE_ADDR) + ((uintptr_t)va & (LARGE_PAGE_SIZE - 1));
+
+    uint64_t* pt = phys_to_virt(pde & PTE_ADDR);
+    uint64_t pte = pt[((uintptr_t)va >> 12) & 511];
+
+    if (!(pte & PTE_PRESENT))
+        return 0;
+
+    return (pte & PTE_ADDR) + ((uintptr_t)va & (PAGE_SIZE - 1));
+}
+
+static int mmio_used = 0;
+
+// maps device memory (LAPIC...) uncached; NULL once the windows ran out
+void* ioremap(uint64_t pa)
+{
+    uint64_t frame = pa & ~(LARGE_PAGE_SIZE - 1);
+    uint64_t* pd = kernel_pd();
+    size_t first = (size_t)((KERNEL_MMIO_BASE - (uint8_t*)_kernel_vo) / LARGE_PAGE_SIZE);
+
+    for (int i = 0; i < mmio_used; ++i)
+        if ((pd[first + i] & PTE_ADDR) == frame)
+            return KERNEL_MMIO_BASE + i * LARGE_PAGE_SIZE + (pa - frame);
+
+    if (mmio_used == KERNEL_MMIO_SLOTS)
+        return NULL;
+
+    uint8_t* va = KERNEL_MMIO_BASE + mmio_used * LARGE_PAGE_SIZE;
+    pd[first + mmio_used] = frame | PTE_PRESENT | PTE_WRITABLE | PTE_LARGE | PTE_PCD | PTE_PWT;
+    mmio_used++;
+
+    asm volatile("invlpg (%0)" : : "r"(va) : "memory");
+
+    return va + (pa - frame);
+}
+
+void dump_memmap(void)
+{
+    kprintf("[e820] %d entries\n", boot_info ? (int)boot_info->e820_count : 0);
+
+    for (uint32_t i = 0; boot_info && i < boot_info->e820_count && i < BOOT_INFO_MAX_E820; ++i)
+    {
+        e820_entry_t* e = &boot_info->e820[i];
+        kprintf("  %p  %p  type=%d\n", (void*)e->base, (void*)e->length, (int)e->type);
+    }
+
+    kprintf("[pmm] free=%d KiB  heap=%p..%p (limit %p)\n",
+        (int)(pmm_free_frames * (PAGE_SIZE / 1024)), kheap_base, kheap_end, kheap_limit);
+}
+
 #endif
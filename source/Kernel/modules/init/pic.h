@@ -18,4 +18,12 @@ void init_pic(void)
     // kprintf("[ BOOT ] initialized PIC\n");
 }
 
+// stops an IRQ line at the PIC (IMR)
+void pic_mask(uint8_t irq)
+{
+    uint16_t port = irq < 8 ? 0x21 : 0xA1;
+
+    outb(port, inb(port) | (1 << (irq & 7)));
+}
+
 #endif
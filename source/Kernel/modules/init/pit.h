@@ -1,7 +1,7 @@
 #ifndef PIT_H
 #define PIT_H
 
-#define PIT_HZ             100 // 100 Hz = 10 ms per tick
+#define PIT_HZ             HZ  // 1 ms per tick (clock.h), only until the LAPIC timer takes over
 #define PIT_BASE_FREQUENCY 1193182
 
 void init_pit(void)
@@ -15,4 +15,58 @@ void init_pit(void)
     // kprintf("[ BOOT ] initialized PIT\n");
 }
 
+#define PIT_CALIBRATE_MS     10
+#define PIT_CALIBRATE_ROUNDS 3
+#define PIT_CALIBRATE_SPINS  1000000 // ~1 s of inb: no PIT answering
+
+// TSC cycles of one channel 2 countdown (0 if OUT2 never went high)
+static uint64_t pit_measure_tsc(uint16_t latch)
+{
+    uint8_t saved = inb(0x61);
+
+    outb(0x61, (saved & ~0x02) | 0x01); // gate on, speaker off
+    outb(0x43, 0xB0);                   // mode 0, lobyte/hibyte, channel 2
+    outb(0x42, latch & 0xFF);
+    outb(0x42, latch >> 8);
+
+    uint64_t t0 = rdtsc();
+    uint32_t spins = 0;
+
+    while (!(inb(0x61) & 0x20)) // OUT2: high once the count hits 0
+    {
+        if (++spins > PIT_CALIBRATE_SPINS)
+        {
+            outb(0x61, saved);
+            return 0;
+        }
+    }
+
+    uint64_t t1 = rdtsc();
+    outb(0x61, saved);
+
+    return t1 - t0;
+}
+
+/* pit_calibrate_tsc: TSC frequency in kHz (0 on failure)
+ *  - best of PIT_CALIBRATE_ROUNDS windows: SMIs/emulator hiccups only make a window longer
+ */
+uint64_t pit_calibrate_tsc(void)
+{
+    uint16_t latch = PIT_BASE_FREQUENCY * PIT_CALIBRATE_MS / 1000;
+    uint64_t best = ~0ULL;
+
+    for (int i = 0; i < PIT_CALIBRATE_ROUNDS; ++i)
+    {
+        uint64_t cycles = pit_measure_tsc(latch);
+        if (!cycles)
+            return 0;
+
+        if (cycles < best)
+            best = cycles;
+    }
+
+    // cycles per (latch / PIT_BASE_FREQUENCY) s
+    return best * PIT_BASE_FREQUENCY / ((uint64_t)latch * 1000);
+}
+
 #endif
@@ -0,0 +1,423 @@
+#ifndef SMP_H
+#define SMP_H
+
+/*
+ * SMP bring-up: per-CPU area, GDT/TSS, ACPI MADT and the AP trampoline
+ *
+ * notas:
+ *  - cpus[] (wrapper.h) is reached through the GS base: current, preempt_count, need_resched
+ *  - CPUs come from the MADT (processor local APIC entries); no MADT -> single CPU
+ *  - APs: INIT, SIPI, SIPI into a real mode trampoline copied to AP_TRAMPOLINE, which goes
+ *    straight to long mode on the boot CPU's page tables and calls ap_main
+ *  - one AP at a time (they share the trampoline parameters)
+ *  - device IRQs (the 8259) keep going to the boot CPU only; APs get their LAPIC timer and IPIs
+ */
+
+#define AP_TRAMPOLINE      0x8000 // below 1 MiB, page aligned (SIPI vector = 0x08); free low memory
+#define AP_STACK_SIZE      16384
+#define AP_BOOT_TIMEOUT_MS 100
+#define DF_STACK_SIZE      4096
+
+#define MSR_GS_BASE 0xC0000101
+
+// 64-bit TSS: only IST1 is used (double fault)
+typedef struct
+{
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed)) tss_t;
+
+// null, code 0x08, data 0x10 (same selectors as the prekernel's GDT), TSS 0x18 (two slots)
+typedef struct
+{
+    uint64_t gdt[5];
+    tss_t tss;
+    uint8_t df_stack[DF_STACK_SIZE] __attribute__((aligned(16)));
+} cpu_desc_t;
+
+static cpu_desc_t cpu_desc[MAX_CPUS];
+
+#define GDT_CODE64 0x00AF9A000000FFFFULL
+#define GDT_DATA   0x00CF92000000FFFFULL
+#define GDT_TSS_SEL 0x18
+
+typedef struct
+{
+    char sig[8];
+    uint8_t checksum;
+    char oem[6];
+    uint8_t rev;
+    uint32_t rsdt;
+    uint32_t length;
+    uint64_t xsdt;
+    uint8_t xchecksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct
+{
+    char sig[4];
+    uint32_t length;
+    uint8_t rev;
+    uint8_t checksum;
+    char oem[6];
+    char oem_table[8];
+    uint32_t oem_rev;
+    uint32_t creator;
+    uint32_t creator_rev;
+} __attribute__((packed)) acpi_sdt_t;
+
+typedef struct
+{
+    acpi_sdt_t h;
+    uint32_t lapic_addr;
+    uint32_t flags;
+    uint8_t entries[];
+} __attribute__((packed)) acpi_madt_t;
+
+#define MADT_LAPIC         0
+#define MADT_LAPIC_ENABLED 1
+
+/* trampoline, copied to AP_TRAMPOLINE: 16 -> 32 -> 64 bits, no stack until the end
+ *  - runs at its copy: absolute addresses are AP_T(label)
+ *  - params (filled per AP): cr3, stack top, entry (ap_main), cpu_t*
+ */
+#define AP_T(label) "0x8000 + (" #label " - ap_trampoline_start)"
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_params[];
+extern uint8_t ap_trampoline_end[];
+
+asm(
+    ".text\n"
+    ".globl ap_trampoline_start\n"
+    ".globl ap_trampoline_params\n"
+    ".globl ap_trampoline_end\n"
+    ".code16\n"
+    "ap_trampoline_start:\n\t"
+    "cli\n\t"
+    "cld\n\t"
+    "xorw %ax, %ax\n\t"
+    "movw %ax, %ds\n\t"
+    "lgdtl " AP_T(ap_trampoline_gdtr) "\n\t"
+    "movl %cr0, %eax\n\t"
+    "orl $1, %eax\n\t"                    // PE
+    "movl %eax, %cr0\n\t"
+    "ljmpl $0x08, $(" AP_T(ap_trampoline_32) ")\n"
+
+    ".code32\n"
+    "ap_trampoline_32:\n\t"
+    "movw $0x10, %ax\n\t"
+    "movw %ax, %ds\n\t"
+    "movw %ax, %es\n\t"
+    "movw %ax, %ss\n\t"
+    "movl %cr4, %eax\n\t"
+    "orl $0x30, %eax\n\t"                 // PSE | PAE
+    "movl %eax, %cr4\n\t"
+    "movl " AP_T(ap_trampoline_params) ", %eax\n\t"
+    "movl %eax, %cr3\n\t"                 // boot CPU's tables (below 4 GiB)
+    "movl $0xC0000080, %ecx\n\t"
+    "rdmsr\n\t"
+    "orl $0x100, %eax\n\t"                // EFER.LME
+    "wrmsr\n\t"
+    "movl %cr0, %eax\n\t"
+    "andl $0x9FFFFFFF, %eax\n\t"          // caches on (CD, NW)
+    "orl $0x80000000, %eax\n\t"           // PG
+    "movl %eax, %cr0\n\t"
+    "ljmpl $0x18, $(" AP_T(ap_trampoline_64) ")\n"
+
+    ".code64\n"
+    "ap_trampoline_64:\n\t"
+    "movw $0x10, %ax\n\t"
+    "movw %ax, %ds\n\t"
+    "movw %ax, %es\n\t"
+    "movw %ax, %ss\n\t"
+    "movq " AP_T(ap_trampoline_params) " + 8, %rsp\n\t"
+    "movq " AP_T(ap_trampoline_params) " + 16, %rax\n\t"
+    "movq " AP_T(ap_trampoline_params) " + 24, %rdi\n\t"
+    "callq *%rax\n\t"                     // ap_main(cpu), never returns
+    "hlt\n"
+
+    ".p2align 3\n"
+    "ap_trampoline_gdt:\n\t"
+    ".quad 0\n\t"
+    ".quad 0x00CF9A000000FFFF\n\t"        // 0x08 code32
+    ".quad 0x00CF92000000FFFF\n\t"        // 0x10 data
+    ".quad 0x00AF9A000000FFFF\n"          // 0x18 code64
+    "ap_trampoline_gdtr:\n\t"
+    ".word 4 * 8 - 1\n\t"
+    ".long " AP_T(ap_trampoline_gdt) "\n"
+
+    ".p2align 3\n"
+    "ap_trampoline_params:\n\t"
+    ".quad 0, 0, 0, 0\n"
+    "ap_trampoline_end:\n"
+);
+
+// GS base -> c: from here on this CPU's current / preempt_count / need_resched are c's
+static void cpu_set_area(cpu_t* c)
+{
+    c->self = c;
+    wrmsr(MSR_GS_BASE, (uint64_t)c);
+}
+
+/* cpu_init: own GDT + TSS (IST1 = double fault stack) and the per-CPU area
+ *  - IF=0; every CPU, the boot one too (first thing in init())
+ */
+static void cpu_init(cpu_t* c)
+{
+    cpu_desc_t* d = &cpu_desc[c->id];
+
+    uint64_t base = (uint64_t)&d->tss;
+    uint64_t limit = sizeof(tss_t) - 1;
+
+    d->gdt[0] = 0;
+    d->gdt[1] = GDT_CODE64;
+    d->gdt[2] = GDT_DATA;
+    d->gdt[3] = (limit & 0xFFFF) | ((base & 0xFFFFFF) << 16) | (0x89ULL << 40)
+              | (((limit >> 16) & 0xF) << 48) | (((base >> 24) & 0xFF) << 56);
+    d->gdt[4] = base >> 32;
+
+    memset(&d->tss, 0, sizeof(d->tss));
+    d->tss.ist[0] = (uint64_t)(d->df_stack + DF_STACK_SIZE);
+    d->tss.iomap_base = sizeof(tss_t);
+
+    struct
+    {
+        uint16_t limit;
+        uint64_t base;
+    } __attribute__((packed)) gdtr = { sizeof(d->gdt) - 1, (uint64_t)d->gdt };
+
+    asm volatile
+    (
+        "lgdt %0\n\t"
+        "pushq $0x08\n\t"
+        "leaq 1f(%%rip), %%rax\n\t"
+        "pushq %%rax\n\t"
+        "lretq\n"                          // reload CS
+        "1:\n\t"
+        "movw $0x10, %%ax\n\t"
+        "movw %%ax, %%ds\n\t"
+        "movw %%ax, %%es\n\t"
+        "movw %%ax, %%ss\n\t"
+        "movw %1, %%ax\n\t"
+        "ltr %%ax\n\t"
+        :
+        : "m"(gdtr), "i"(GDT_TSS_SEL)
+        : "rax", "memory"
+    );
+
+    // the GS base is the MSR, not the selector: set it last
+    cpu_set_area(c);
+
+    // FS base: the boot TLS block until this CPU runs a thread
+    tls_cpu_init();
+}
+
+// boot CPU: per-CPU area before anything touches current / preempt_count (kprintf does)
+void smp_bsp_init(void)
+{
+    cpus[0].id = 0;
+    cpus[0].online = true;
+    cpu_init(&cpus[0]);
+}
+
+static bool acpi_checksum(const void* p, size_t n)
+{
+    const uint8_t* b = p;
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i < n; ++i)
+        sum += b[i];
+
+    return sum == 0;
+}
+
+static const acpi_rsdp_t* acpi_scan_rsdp(uint64_t pa, size_t len)
+{
+    for (uint64_t at = pa; at < pa + len; at += 16)
+    {
+        const acpi_rsdp_t* r = phys_to_virt(at);
+
+        if (!memcmp(r->sig, "RSD PTR ", 8) && acpi_checksum(r, 20))
+            return r;
+    }
+
+    return NULL;
+}
+
+// RSDP: first KiB of the EBDA, then the BIOS area (both below 1 MiB, mapped at VO + PA)
+static const acpi_rsdp_t* acpi_find_rsdp(void)
+{
+    uint64_t ebda = (uint64_t)*(uint16_t*)phys_to_virt(0x40E) << 4;
+
+    const acpi_rsdp_t* r = NULL;
+    if (ebda >= 0x80000 && ebda < 0xA0000)
+        r = acpi_scan_rsdp(ebda, 1024);
+
+    return r ? r : acpi_scan_rsdp(0xE0000, 0x20000);
+}
+
+// tables live in reserved RAM past the kernel window: read through an ioremap window
+static const acpi_sdt_t* acpi_map(uint64_t pa)
+{
+    uint64_t off = pa & (LARGE_PAGE_SIZE - 1);
+    if (off + sizeof(acpi_sdt_t) > LARGE_PAGE_SIZE)
+        return NULL;
+
+    const acpi_sdt_t* h = ioremap(pa);
+
+    // a window is 2 MiB: a table crossing into the next one isn't supported
+    if (!h || off + h->length > LARGE_PAGE_SIZE)
+        return NULL;
+
+    return acpi_checksum(h, h->length) ? h : NULL;
+}
+
+static const acpi_madt_t* acpi_find_madt(void)
+{
+    const acpi_rsdp_t* rsdp = acpi_find_rsdp();
+    if (!rsdp)
+        return NULL;
+
+    bool xsdt = rsdp->rev >= 2 && rsdp->xsdt;
+
+    const acpi_sdt_t* root = acpi_map(xsdt ? rsdp->xsdt : rsdp->rsdt);
+    if (!root)
+        return NULL;
+
+    size_t width = xsdt ? 8 : 4;
+    size_t n = (root->length - sizeof(acpi_sdt_t)) / width;
+    const uint8_t* ents = (const uint8_t*)(root + 1);
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        // XSDT entries aren't 8-byte aligned
+        uint64_t pa = 0;
+        memcpy(&pa, ents + i * width, width);
+
+        const acpi_sdt_t* t = acpi_map(pa);
+        if (t && !memcmp(t->sig, "APIC", 4))
+            return (const acpi_madt_t*)t;
+    }
+
+    return NULL;
+}
+
+static volatile bool ap_ready = false;
+
+// first C code on an AP (trampoline stack, IF=0)
+__attribute__((noreturn)) void ap_main(cpu_t* c)
+{
+    cpu_init(c);
+    asm volatile("lidt %0" : : "m"(idtp));
+    fpu_cpu_init();
+
+    lapic_ap_init();
+
+    if (!kthread_create_idle(c->id) || !ksoftirqd_create(c->id))
+        halt();
+
+    c->online = true;
+    ap_ready = true;
+
+    kthread_start_scheduler();
+}
+
+// INIT, SIPI, SIPI (MP spec); true once the AP reports in from ap_main
+static bool ap_boot(cpu_t* c)
+{
+    uint8_t* stack = kmalloc(AP_STACK_SIZE);
+    if (!stack)
+        return false;
+
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+
+    uint64_t* params = phys_to_virt(AP_TRAMPOLINE + (ap_trampoline_params - ap_trampoline_start));
+    params[0] = cr3;
+    params[1] = (uint64_t)(stack + AP_STACK_SIZE);
+    params[2] = (uint64_t)ap_main;
+    params[3] = (uint64_t)c;
+
+    ap_ready = false;
+
+    lapic_send_ipi(c->apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    udelay(10000);
+
+    for (int i = 0; i < 2 && !ap_ready; ++i)
+    {
+        lapic_send_ipi(c->apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+        udelay(200);
+    }
+
+    uint64_t deadline = ktime_get() + AP_BOOT_TIMEOUT_MS * NSEC_PER_MSEC;
+    while (!ap_ready && ktime_get() < deadline)
+        cpu_relax();
+
+    if (!ap_ready)
+    {
+        // never started: nothing runs on the stack
+        kfree(stack);
+        return false;
+    }
+
+    // the stack stays: it's the AP's boot_sp context
+    return true;
+}
+
+/* smp_init: brings up every enabled CPU of the MADT
+ *  - needs the boot CPU's LAPIC timer (lapic_timer_init) and the thread subsystem
+ *  - returns how many CPUs are online
+ */
+int smp_init(void)
+{
+    if (!clock_tickless)
+        return 1;
+
+    const acpi_madt_t* madt = acpi_find_madt();
+    if (!madt)
+        return 1;
+
+    memcpy(phys_to_virt(AP_TRAMPOLINE), ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+
+    uint32_t bsp = cpus[0].apic_id;
+    const uint8_t* p = madt->entries;
+    const uint8_t* end = (const uint8_t*)madt + madt->h.length;
+
+    while (p + 2 <= end && p[1] >= 2 && p + p[1] <= end)
+    {
+        // processor local APIC: type, length, acpi id, apic id, flags
+        if (p[0] == MADT_LAPIC && p[3] != bsp && nr_cpus < MAX_CPUS)
+        {
+            uint32_t flags;
+            memcpy(&flags, p + 4, sizeof(flags));
+
+            if (flags & MADT_LAPIC_ENABLED)
+            {
+                cpu_t* c = &cpus[nr_cpus];
+                c->id = nr_cpus;
+                c->apic_id = p[3];
+
+                // counted before it runs (select_cpu skips it until it's online)
+                nr_cpus++;
+                if (!ap_boot(c))
+                {
+                    kprintf("smp: cpu apic %d NOT OK\n", (int)c->apic_id);
+                    nr_cpus--;
+                }
+            }
+        }
+
+        p += p[1];
+    }
+
+    return nr_cpus;
+}
+
+#endif
@@ -0,0 +1,346 @@
+#ifndef STACK_H
+#define STACK_H
+
+/*
+ * thread stacks (kstack_alloc / kstack_free, used by threads.h)
+ *
+ * notas:
+ *  - stacks live in their own KSTACK_AREA_PDS entries of the kernel PD (init/map.h), mapped
+ *    with 4 KiB pages instead of the heap's 2 MiB ones
+ *  - the area is cut in KSTACK_SLOT_SIZE slots; a stack sits at the top of its slot and
+ *    everything under it stays unmapped -> running off the end hits a guard page (#PF, or
+ *    #DF on its IST stack when not even the exception frame fits) instead of the neighbour
+ *  - sizes: power-of-two pages, KSTACK_MIN_SIZE .. KSTACK_MAX_SIZE (at least half the slot is guard)
+ *  - backing pages come from the buddy (page_alloc) and get mapped a second time into the slot
+ *  - freed stacks stay mapped in a per-size cache: steady-state thread creation takes no
+ *    page, no mapping and no TLB work
+ *  - past KSTACK_CACHE_MAX the slot is unmapped (local invlpg) and parked as dirty: other CPUs
+ *    may still cache it, so dirty slots are only reused after one smp_flush_tlb_all for all of them
+ */
+
+#define KSTACK_SLOT_SIZE  0x10000ULL // 64 KiB of address space per stack
+#define KSTACK_SLOTS      ((int)(KSTACK_AREA_PDS * LARGE_PAGE_SIZE / KSTACK_SLOT_SIZE))
+#define KSTACK_MIN_SIZE   PAGE_SIZE
+#define KSTACK_MAX_SIZE   (KSTACK_SLOT_SIZE / 2)
+#define KSTACK_ORDERS     4 // 4, 8, 16, 32 KiB
+#define KSTACK_CACHE_MAX  4 // mapped stacks kept per size
+#define KSTACK_AREA_END   (KSTACK_AREA_BASE + KSTACK_AREA_PDS * LARGE_PAGE_SIZE)
+
+void smp_flush_tlb_all(void); // init/apic.h
+
+typedef enum
+{
+    KSTACK_SLOT_FREE = 0, // unmapped, no TLB may hold it
+    KSTACK_SLOT_DIRTY,    // unmapped, other CPUs may still hold translations
+    KSTACK_SLOT_CACHED,   // mapped, waiting in kstack_cache[order]
+    KSTACK_SLOT_USED,
+} kstack_slot_state_t;
+
+typedef struct
+{
+    void* pages;  // buddy block behind the stack (heap address)
+    int16_t next; // free, dirty or cache list
+    uint8_t order;
+    uint8_t state;
+} kstack_slot_t;
+
+static kstack_slot_t kstack_slots[KSTACK_SLOTS];
+static uint64_t* kstack_pt[KSTACK_AREA_PDS]; // page tables of the area (heap pages)
+static int16_t kstack_free_head = -1;
+static int16_t kstack_dirty_head = -1;
+static int16_t kstack_cache[KSTACK_ORDERS];
+static int kstack_cached[KSTACK_ORDERS];
+static spinlock_t kstack_lock; // raw, IF=0 (kstack_free runs right after a switch, threads.h sched_unlock_reap)
+static bool kstack_ready = false;
+
+static uint64_t kstack_allocs = 0;
+static uint64_t kstack_cache_hits = 0;
+static uint64_t kstack_maps = 0;
+static uint64_t kstack_unmaps = 0;
+static uint64_t kstack_flushes = 0;
+static uint64_t kstack_failed = 0;
+
+static inline uint8_t* kstack_slot_base(int slot)
+{
+    return KSTACK_AREA_BASE + (size_t)slot * KSTACK_SLOT_SIZE;
+}
+
+// lowest mapped byte of a slot's stack
+static inline uint8_t* kstack_bottom(int slot, int order)
+{
+    return kstack_slot_base(slot) + KSTACK_SLOT_SIZE - (PAGE_SIZE << order);
+}
+
+static inline bool kstack_in_area(uint64_t addr)
+{
+    return addr >= (uint64_t)KSTACK_AREA_BASE && addr < (uint64_t)KSTACK_AREA_END;
+}
+
+static inline uint64_t* kstack_pte(const uint8_t* va)
+{
+    size_t off = (size_t)(va - KSTACK_AREA_BASE);
+    return &kstack_pt[off / LARGE_PAGE_SIZE][(off / PAGE_SIZE) % 512];
+}
+
+static inline void kstack_push(int16_t* head, int slot)
+{
+    kstack_slots[slot].next = *head;
+    *head = (int16_t)slot;
+}
+
+static inline int kstack_pop(int16_t* head)
+{
+    int slot = *head;
+    if (slot >= 0)
+        *head = kstack_slots[slot].next;
+
+    return slot;
+}
+
+// order for a requested size (0 = KTHREAD_STACK_SIZE), -1 when it doesn't fit a slot
+static int kstack_order(size_t size)
+{
+    if (!size)
+        size = KTHREAD_STACK_SIZE;
+
+    if (size > KSTACK_MAX_SIZE)
+        return -1;
+
+    return (int)page_order_for((size + PAGE_SIZE - 1) / PAGE_SIZE);
+}
+
+static bool kstack_map(int slot, int order)
+{
+    uint8_t* pages = page_alloc((uint32_t)order);
+    if (!pages)
+        return false;
+
+    uint8_t* va = kstack_bottom(slot, order);
+
+    for (size_t i = 0; i < (1UL << order); ++i)
+        *kstack_pte(va + i * PAGE_SIZE) = virt_to_phys(pages + i * PAGE_SIZE) | PTE_PRESENT | PTE_WRITABLE;
+
+    kstack_slots[slot].pages = pages;
+    kstack_slots[slot].order = (uint8_t)order;
+    kstack_maps++;
+
+    return true;
+}
+
+// this CPU forgets the slot now, the others at the next smp_flush_tlb_all
+static void kstack_unmap(int slot)
+{
+    kstack_slot_t* s = &kstack_slots[slot];
+    uint8_t* va = kstack_bottom(slot, s->order);
+
+    for (size_t i = 0; i < (1UL << s->order); ++i)
+    {
+        *kstack_pte(va + i * PAGE_SIZE) = 0;
+        asm volatile("invlpg (%0)" : : "r"(va + i * PAGE_SIZE) : "memory");
+    }
+
+    page_free(s->pages, s->order);
+
+    s->pages = NULL;
+    s->state = KSTACK_SLOT_DIRTY;
+    kstack_push(&kstack_dirty_head, slot);
+    kstack_unmaps++;
+}
+
+/* kstack_init: page tables for the stack area (after the heap, before the first thread)
+ *  - false: stacks come from kmalloc, without guard pages
+ */
+bool kstack_init(void)
+{
+    uint64_t* pd = kernel_pd();
+    size_t first = (size_t)((KSTACK_AREA_BASE - (uint8_t*)_kernel_vo) / LARGE_PAGE_SIZE);
+
+    for (int i = 0; i < KSTACK_AREA_PDS; ++i)
+    {
+        uint64_t* pt = page_alloc(0);
+        if (!pt)
+            return false;
+
+        memset(pt, 0, PAGE_SIZE);
+        kstack_pt[i] = pt;
+        pd[first + i] = virt_to_phys(pt) | PTE_PRESENT | PTE_WRITABLE;
+    }
+
+    spinlock_init(&kstack_lock);
+
+    // lowest slot first
+    for (int s = KSTACK_SLOTS - 1; s >= 0; --s)
+    {
+        kstack_slots[s].state = KSTACK_SLOT_FREE;
+        kstack_push(&kstack_free_head, s);
+    }
+
+    for (int o = 0; o < KSTACK_ORDERS; ++o)
+        kstack_cache[o] = -1;
+
+    kstack_ready = true;
+    return true;
+}
+
+/* kstack_alloc: stack for a new thread, NULL when none is left
+ *  - size: bytes wanted (0 = KTHREAD_STACK_SIZE), rounded up to a power-of-two pages;
+ *    the real size goes to *out_size
+ *  - cache hit: no page and no mapping; reusing dirty slots costs one TLB shootdown (IF=1 only)
+ */
+uint8_t* kstack_alloc(size_t size, size_t* out_size)
+{
+    int order = kstack_order(size);
+    if (order < 0)
+        return NULL;
+
+    *out_size = PAGE_SIZE << order;
+
+    if (!kstack_ready)
+        return kmalloc(*out_size); // early / no area: no guard pages
+
+    uint64_t flags = irq_save();
+    raw_spin_lock(&kstack_lock);
+
+    kstack_allocs++;
+
+    int slot = kstack_pop(&kstack_cache[order]);
+    if (slot >= 0)
+    {
+        kstack_cached[order]--;
+        kstack_cache_hits++;
+    }
+    else
+    {
+        if (kstack_free_head < 0 && kstack_dirty_head >= 0 && (flags & 0x200))
+        {
+            // one flush makes every slot unmapped so far reusable
+            int16_t dirty = kstack_dirty_head;
+            kstack_dirty_head = -1;
+
+            raw_spin_unlock(&kstack_lock);
+            irq_restore(flags);
+
+            smp_flush_tlb_all();
+
+            flags = irq_save();
+            raw_spin_lock(&kstack_lock);
+
+            kstack_flushes++;
+
+            while ((slot = kstack_pop(&dirty)) >= 0)
+            {
+                kstack_slots[slot].state = KSTACK_SLOT_FREE;
+                kstack_push(&kstack_free_head, slot);
+            }
+        }
+
+        slot = kstack_pop(&kstack_free_head);
+        if (slot >= 0 && !kstack_map(slot, order))
+        {
+            kstack_push(&kstack_free_head, slot);
+            slot = -1;
+        }
+    }
+
+    if (slot < 0)
+    {
+        kstack_failed++;
+        raw_spin_unlock(&kstack_lock);
+        irq_restore(flags);
+        return NULL;
+    }
+
+    kstack_slots[slot].state = KSTACK_SLOT_USED;
+
+    raw_spin_unlock(&kstack_lock);
+    irq_restore(flags);
+
+    return kstack_bottom(slot, order);
+}
+
+// back into the cache (or unmapped past KSTACK_CACHE_MAX); any context
+void kstack_free(uint8_t* stack)
+{
+    if (!stack)
+        return;
+
+    if (!kstack_in_area((uint64_t)stack))
+    {
+        kfree(stack);
+        return;
+    }
+
+    int slot = (int)((size_t)(stack - KSTACK_AREA_BASE) / KSTACK_SLOT_SIZE);
+    kstack_slot_t* s = &kstack_slots[slot];
+
+    uint64_t flags = irq_save();
+    raw_spin_lock(&kstack_lock);
+
+    if (kstack_cached[s->order] < KSTACK_CACHE_MAX)
+    {
+        s->state = KSTACK_SLOT_CACHED;
+        kstack_push(&kstack_cache[s->order], slot);
+        kstack_cached[s->order]++;
+    }
+    else
+        kstack_unmap(slot);
+
+    raw_spin_unlock(&kstack_lock);
+    irq_restore(flags);
+}
+
+/* kstack_guard_owner: fault handlers (init/idt.h), faulting address inside the area
+ *  - the thread whose slot it falls in, NULL if no thread owns that slot
+ */
+static kthread_t* kstack_guard_owner(uint64_t addr)
+{
+    uint64_t slot_base = addr & ~(KSTACK_SLOT_SIZE - 1);
+
+    for (int i = 0; i < MAX_THREADS; ++i)
+    {
+        kthread_t* t = &thread_table[i];
+        if (t->state != THREAD_UNUSED && ((uint64_t)t->stack & ~(KSTACK_SLOT_SIZE - 1)) == slot_base)
+            return t;
+    }
+
+    return NULL;
+}
+
+void dump_kstack(void)
+{
+    if (!kstack_ready)
+    {
+        kprintf("[kstack] no stack area, kmalloc stacks\n");
+        return;
+    }
+
+    uint64_t flags = irq_save();
+    raw_spin_lock(&kstack_lock);
+
+    int used = 0, cached = 0, unmapped = 0, dirty = 0;
+    for (int s = 0; s < KSTACK_SLOTS; ++s)
+    {
+        switch (kstack_slots[s].state)
+        {
+            case KSTACK_SLOT_USED:   used++;   break;
+            case KSTACK_SLOT_CACHED: cached++; break;
+            case KSTACK_SLOT_DIRTY:  dirty++;  break;
+            default:                 unmapped++; break;
+        }
+    }
+
+    kprintf("[kstack] area %p..%p  slots %d: used %d  cached %d  free %d  dirty %d\n",
+        KSTACK_AREA_BASE, KSTACK_AREA_END, KSTACK_SLOTS, used, cached, unmapped, dirty);
+
+    for (int o = 0; o < KSTACK_ORDERS; ++o)
+        kprintf("  %d KiB: cached %d\n", (int)((PAGE_SIZE << o) / 1024), kstack_cached[o]);
+
+    kprintf("  allocs %d  cache hits %d  maps %d  unmaps %d  flushes %d  failed %d\n",
+        (int)kstack_allocs, (int)kstack_cache_hits, (int)kstack_maps,
+        (int)kstack_unmaps, (int)kstack_flushes, (int)kstack_failed);
+
+    raw_spin_unlock(&kstack_lock);
+    irq_restore(flags);
+}
+
+#endif
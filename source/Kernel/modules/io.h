@@ -25,16 +25,6 @@ void speaker_off()
     outb(0x61, val);
 }
 
-void delay()
-{
-    for (volatile unsigned long i = 0; i < 500000UL; i++);
-}
-
-void beep()
-{
-    speaker_on(1000);  // ~1 khz
-    delay();
-    speaker_off();
-}
+// beep() lives in timer.h (speaker off from a one-shot timer)
 
 #endif
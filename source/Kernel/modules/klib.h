@@ -9,6 +9,20 @@ static void print_string(const char* s)
     }
 }
 
+// field width for %d / %s: right-aligned, left-aligned with '-'
+static void print_padded(const char* s, int width, bool left)
+{
+    int pad = width - (int)strlen(s);
+
+    while (!left && pad-- > 0)
+        kputc(' ');
+
+    print_string(s);
+
+    while (left && pad-- > 0)
+        kputc(' ');
+}
+
 // kernel print formatted
 void kprintf(const unsigned char* str, ...)
 {
@@ -23,6 +37,19 @@ void kprintf(const unsigned char* str, ...)
         {
             i++;
 
+            // width: %6d, %-12s (spaces)
+            bool left = false;
+            int width = 0;
+
+            if (str[i] == '-')
+            {
+                left = true;
+                i++;
+            }
+
+            while (str[i] >= '0' && str[i] <= '9')
+                width = width * 10 + (str[i++] - '0');
+
             unsigned char format = str[i];
 
             if (format == 'p') // pointer
@@ -66,6 +93,8 @@ void kprintf(const unsigned char* str, ...)
 
                 print_string(hex_str);
             }
+            else if (format == '%')
+                kputc('%');
             else if (format == 'c') // char
             {
                 unsigned char c = (unsigned char)va_arg(args, int);
@@ -74,7 +103,7 @@ void kprintf(const unsigned char* str, ...)
             else if (format == 's') // string
             {
                 const char* s = va_arg(args, const char*);
-                print_string(s);
+                print_padded(s, width, left);
             }
             else if (format == 'd') // signed decimal
             {
@@ -89,7 +118,7 @@ void kprintf(const unsigned char* str, ...)
                 {
                     if (val < 0)
                     {
-                        kputc('-');
+                        buf[idx++] = '-';
                         val = -val;
                     }
 
@@ -107,7 +136,7 @@ void kprintf(const unsigned char* str, ...)
                 }
 
                 buf[idx] = '\0';
-                print_string(buf);
+                print_padded(buf, width, left);
             }
         }
         else
@@ -0,0 +1,346 @@
+#ifndef MUTEX_H
+#define MUTEX_H
+
+/*
+ * sleeping locks: kmutex and rwsem (thread context only: no ISRs, no softirqs)
+ *
+ * notas:
+ *  - kmutex state: 0 free, 1 locked, 2 locked and maybe waiters; while nobody waits,
+ *    lock and unlock are one atomic op each (no cli, no sched_lock)
+ *  - contended kmutex: spins while the owner is running on another CPU (it should let go
+ *    soon, a sleep + wakeup costs two switches), then sleeps as an exclusive waiter;
+ *    unlock wakes one. spinning is per lock (kmutex_init) and never happens on one CPU
+ *  - rwsem count: > 0 readers, -1 writer, 0 free. waiters queue in arrival order on one
+ *    waitq (readers shared, writers exclusive) and the release hands the lock over: a writer
+ *    at the head gets it alone, the readers at the head get it together. while anyone waits,
+ *    new comers queue too -> a writer isn't starved by a stream of readers
+ *  - lockstat: counters of every named lock, debug locks lists them
+ */
+
+#define KMUTEX_SPIN_MAX 4096 // pause rounds on a running owner before going to sleep
+
+typedef struct lockstat
+{
+    const char* name;
+    struct lockstat* next;
+    uint64_t acquired;    // kmutex / rwsem writer: written by the holder only
+    uint64_t contended;   // slow path entries
+    uint64_t spun;        // kmutex: taken while spinning on a running owner
+    uint64_t slept;       // blocked before getting it
+    uint64_t wait_cycles; // tsc spent in the slow path
+} lockstat_t;
+
+static lockstat_t* lockstat_list = NULL;
+static spinlock_t lockstat_lock; // raw, IF=0
+static lockstat_t lockstat_all;  // every kmutex / rwsem, named or not (slow paths only)
+
+static inline void lockstat_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+// named: listed by debug locks (the lock must live for good: static or never freed)
+static void lockstat_init(lockstat_t* st, const char* name)
+{
+    uint64_t flags = irq_save();
+    raw_spin_lock(&lockstat_lock);
+
+    bool listed = false;
+    for (lockstat_t* it = lockstat_list; it; it = it->next)
+        listed |= it == st;
+
+    lockstat_t* next = listed ? st->next : NULL;
+    memset(st, 0, sizeof(*st));
+    st->name = name;
+    st->next = next;
+
+    if (name && !listed)
+    {
+        st->next = lockstat_list;
+        lockstat_list = st;
+    }
+
+    raw_spin_unlock(&lockstat_lock);
+    irq_restore(flags);
+}
+
+static void lockstat_contended(lockstat_t* st, uint64_t cycles, bool spun, bool slept)
+{
+    lockstat_add(&lockstat_all.contended, 1);
+    lockstat_add(&lockstat_all.wait_cycles, cycles);
+    lockstat_add(&lockstat_all.spun, spun);
+    lockstat_add(&lockstat_all.slept, slept);
+
+    lockstat_add(&st->contended, 1);
+    lockstat_add(&st->wait_cycles, cycles);
+    lockstat_add(&st->spun, spun);
+    lockstat_add(&st->slept, slept);
+}
+
+// --- kmutex -----------------------------------------------------------------
+
+typedef struct kmutex
+{
+    volatile int state;
+    kthread_t* owner;
+    bool spin;
+    waitq_t wq; // exclusive waiters
+    lockstat_t stat;
+} kmutex_t;
+
+void kmutex_init(kmutex_t* m, const char* name, bool spin)
+{
+    m->state = 0;
+    m->owner = NULL;
+    m->spin = spin;
+    waitq_init(&m->wq);
+    lockstat_init(&m->stat, name);
+}
+
+bool kmutex_trylock(kmutex_t* m)
+{
+    int free = 0;
+    if (!__atomic_compare_exchange_n(&m->state, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return false;
+
+    m->owner = current;
+    m->stat.acquired++;
+    return true;
+}
+
+/* kmutex_spin_on_owner: true if the lock came free (and was taken) while spinning
+ *  - gives up as soon as the owner is off its CPU (blocked or preempted) or this CPU
+ *    has something better to run
+ */
+static bool kmutex_spin_on_owner(kmutex_t* m)
+{
+    if (!m->spin || nr_cpus < 2)
+        return false;
+
+    bool got = false;
+
+    preempt_disable();
+
+    for (int i = 0; i < KMUTEX_SPIN_MAX && !this_cpu_read(need_resched); ++i)
+    {
+        int c = m->state;
+        if (c == 0)
+        {
+            if (__atomic_compare_exchange_n(&m->state, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                got = true;
+                break;
+            }
+
+            continue;
+        }
+
+        // NULL: between the cmpxchg and the owner store, keep going
+        kthread_t* owner = m->owner;
+        if (owner && owner->state != THREAD_RUNNING)
+            break;
+
+        cpu_relax();
+    }
+
+    preempt_enable();
+    return got;
+}
+
+static void kmutex_lock_slow(kmutex_t* m)
+{
+    kthread_t* self = current;
+
+    if (m->owner == self)
+    {
+        kprintf("kmutex: %s locked twice by %s\n", m->stat.name ? m->stat.name : "?", self->name);
+        panic();
+    }
+
+    uint64_t t0 = rdtsc();
+    bool spun = kmutex_spin_on_owner(m);
+    bool slept = false;
+
+    if (!spun)
+    {
+        // state 2 before sleeping: the unlock that follows has to take sched_lock and wake
+        sched_lock_irq();
+        while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+        {
+            slept = true;
+            thread_sleep_exclusive_locked(&m->wq);
+            sched_lock_irq();
+        }
+        sched_unlock_irq();
+    }
+
+    m->owner = self;
+    m->stat.acquired++;
+
+    lockstat_contended(&m->stat, rdtsc() - t0, spun, slept);
+}
+
+void kmutex_lock(kmutex_t* m)
+{
+    if (!kmutex_trylock(m))
+        kmutex_lock_slow(m);
+}
+
+void kmutex_unlock(kmutex_t* m)
+{
+    if (m->owner != current)
+    {
+        kprintf("kmutex: %s unlocked by a thread that doesn't hold it\n", m->stat.name ? m->stat.name : "?");
+        panic();
+    }
+
+    m->owner = NULL;
+
+    if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2)
+    {
+        uint64_t flags = sched_lock_irqsave();
+        waitq_wake_locked(&m->wq, 1);
+        sched_unlock_irqrestore(flags);
+    }
+}
+
+// --- rwsem ------------------------------------------------------------------
+
+typedef struct rwsem
+{
+    volatile int count;
+    volatile int waiters; // threads in the slow path, queued or about to
+    waitq_t wq;           // readers shared, writers exclusive
+    lockstat_t stat;
+} rwsem_t;
+
+void rwsem_init(rwsem_t* s, const char* name)
+{
+    s->count = 0;
+    s->waiters = 0;
+    waitq_init(&s->wq);
+    lockstat_init(&s->stat, name);
+}
+
+static inline bool rwsem_try_read(rwsem_t* s)
+{
+    int c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+
+    while (c >= 0)
+        if (__atomic_compare_exchange_n(&s->count, &c, c + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+
+    return false;
+}
+
+static inline bool rwsem_try_write(rwsem_t* s)
+{
+    int free = 0;
+    return __atomic_compare_exchange_n(&s->count, &free, -1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* rwsem_wake: hands the lock to the head of the queue
+ *  - a writer if the lock is free, else every reader up to the first writer while no writer holds it
+ *  - the thread woken already holds the lock
+ */
+static void rwsem_wake(rwsem_t* s)
+{
+    uint64_t flags = sched_lock_irqsave();
+
+    kthread_t* t;
+    while ((t = s->wq.head))
+    {
+        bool write = t->wait_exclusive;
+        if (write ? !rwsem_try_write(s) : !rwsem_try_read(s))
+            break;
+
+        waitq_del_locked(&s->wq, t);
+        wake_up_locked(t);
+        __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (write)
+            break;
+    }
+
+    sched_unlock_irqrestore(flags);
+}
+
+static void rwsem_down_slow(rwsem_t* s, bool write)
+{
+    uint64_t t0 = rdtsc();
+    bool slept = false;
+
+    sched_lock_irq();
+
+    // seen by every release from now on (both sides are locked RMWs)
+    __atomic_fetch_add(&s->waiters, 1, __ATOMIC_SEQ_CST);
+
+    // nobody queued: the lock may have come free since the fast path
+    if (!s->wq.head && (write ? rwsem_try_write(s) : rwsem_try_read(s)))
+    {
+        __atomic_fetch_sub(&s->waiters, 1, __ATOMIC_SEQ_CST);
+        sched_unlock_irq();
+    }
+    else
+    {
+        // only rwsem_wake wakes it, and it takes the lock on our behalf first
+        slept = true;
+        __thread_sleep_locked(&s->wq, write);
+    }
+
+    lockstat_contended(&s->stat, rdtsc() - t0, false, slept);
+}
+
+void down_read(rwsem_t* s)
+{
+    if (__atomic_load_n(&s->waiters, __ATOMIC_RELAXED) || !rwsem_try_read(s))
+        rwsem_down_slow(s, false);
+
+    lockstat_add(&s->stat.acquired, 1); // readers hold it together
+}
+
+void down_write(rwsem_t* s)
+{
+    if (__atomic_load_n(&s->waiters, __ATOMIC_RELAXED) || !rwsem_try_write(s))
+        rwsem_down_slow(s, true);
+
+    s->stat.acquired++;
+}
+
+void up_read(rwsem_t* s)
+{
+    if (__atomic_sub_fetch(&s->count, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST))
+        rwsem_wake(s);
+}
+
+void up_write(rwsem_t* s)
+{
+    __atomic_exchange_n(&s->count, 0, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&s->waiters, __ATOMIC_SEQ_CST))
+        rwsem_wake(s);
+}
+
+void dump_locks(void)
+{
+    kprintf("[locks] waitq wakeups %d  exclusive left asleep %d  sem sleeps %d\n",
+        (int)waitq_wakeups, (int)waitq_skipped, (int)sem_sleeps);
+
+    lockstat_t* all = &lockstat_all;
+    kprintf("  kmutex+rwsem: contended %d  spun %d  slept %d  wait %d cyc/contention\n",
+        (int)all->contended, (int)all->spun, (int)all->slept,
+        all->contended ? (int)(all->wait_cycles / all->contended) : 0);
+
+    uint64_t flags = irq_save();
+    raw_spin_lock(&lockstat_lock);
+
+    for (lockstat_t* st = lockstat_list; st; st = st->next)
+        kprintf("  %s: acquired %d  contended %d  spun %d  slept %d  wait %d cyc/contention\n",
+            st->name, (int)st->acquired, (int)st->contended, (int)st->spun, (int)st->slept,
+            st->contended ? (int)(st->wait_cycles / st->contended) : 0);
+
+    raw_spin_unlock(&lockstat_lock);
+    irq_restore(flags);
+}
+
+#endif
@@ -2,7 +2,8 @@
 #define PROTOTYPE_H
 
 // init.h
-TEXT  ALIGNED void init(void);
+struct boot_info;
+TEXT  ALIGNED void init(struct boot_info* boot_info);
 TEXT  ALIGNED void init_idt(void);
 TEXT  ALIGNED void init_pic(void);
 TEXT  ALIGNED void init_pit(void);
@@ -0,0 +1,526 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+/*
+ * deferred work: softirqs, tasklets and workqueues (interrupt bottom halves)
+ *
+ * notas:
+ *  - an ISR does the minimum and raises a softirq (a bit in its CPU's cpu_t); pending
+ *    softirqs run at irq_exit with IF=1, one batch for everything raised meanwhile
+ *  - not at irq_exit when the interrupted code holds preemption off (spinlocks: a handler
+ *    could want the same lock) or after SOFTIRQ_MAX_RESTART rounds: the per-CPU ksoftirqd
+ *    thread runs them instead
+ *  - softirqs never nest and never migrate: preempt_count is held while they run
+ *  - tasklets: per-CPU lists run by SOFTIRQ_HI / SOFTIRQ_TASKLET; scheduling an already
+ *    scheduled tasklet is a no-op (bursts coalesce) and one tasklet never runs on two CPUs at once
+ *  - workqueues: work items run by worker threads (thread context, may sleep)
+ */
+
+typedef enum
+{
+    SOFTIRQ_HI = 0,  // tasklet_hi_schedule
+    SOFTIRQ_TASKLET, // tasklet_schedule
+    NR_SOFTIRQS,
+} softirq_t;
+
+#define SOFTIRQ_MAX_RESTART 10
+
+static void tasklet_hi_action(void);
+static void tasklet_action(void);
+
+// wired statically: IRQs (the keyboard) may raise them before softirq_init
+static void (*softirq_vec[NR_SOFTIRQS])(void) = { tasklet_hi_action, tasklet_action };
+static const char* softirq_names[NR_SOFTIRQS] = { "hi", "tasklet" };
+
+static uint64_t softirq_count[NR_SOFTIRQS]; // handler runs
+static uint64_t softirq_raised = 0;
+static uint64_t softirq_deferred = 0;       // handed to ksoftirqd
+
+static waitq_t ksoftirqd_wq[MAX_CPUS];
+
+static inline bool in_softirq(void)
+{
+    return this_cpu_read(in_softirq);
+}
+
+static inline bool in_interrupt(void)
+{
+    return this_cpu_read(irq_depth) > 0 || this_cpu_read(in_softirq);
+}
+
+void open_softirq(softirq_t nr, void (*fn)(void))
+{
+    softirq_vec[nr] = fn;
+}
+
+// IF=0: this CPU's pending mask is only touched by this CPU
+static inline void raise_softirq_irqoff(softirq_t nr)
+{
+    asm volatile("orl %0, %%gs:%c1" : : "r"(1U << nr), "i"(offsetof(cpu_t, softirq_pending)) : "memory");
+    __atomic_fetch_add(&softirq_raised, 1, __ATOMIC_RELAXED);
+}
+
+static void wakeup_ksoftirqd(void)
+{
+    thread_wake_one(&ksoftirqd_wq[smp_processor_id()]);
+}
+
+/* raise_softirq: any context
+ *  - from an IRQ handler it runs at that IRQ's exit; from a thread ksoftirqd is woken
+ */
+void raise_softirq(softirq_t nr)
+{
+    uint64_t flags = irq_save();
+
+    raise_softirq_irqoff(nr);
+    if (!in_interrupt())
+        wakeup_ksoftirqd();
+
+    irq_restore(flags);
+}
+
+static inline uint32_t softirq_take_pending(void)
+{
+    uint32_t pending = 0;
+    asm volatile("xchgl %0, %%gs:%c1" : "+r"(pending) : "i"(offsetof(cpu_t, softirq_pending)) : "memory");
+    return pending;
+}
+
+/* __do_softirq: IF=0 and preempt_count held by the caller, returns the same way
+ *  - handlers run with IF=1; whatever they (or new IRQs) raise is picked up by the next round
+ */
+static void __do_softirq(void)
+{
+    this_cpu_write(in_softirq, true);
+
+    for (int round = 0; round < SOFTIRQ_MAX_RESTART; ++round)
+    {
+        uint32_t pending = softirq_take_pending();
+        if (!pending)
+            break;
+
+        sti();
+
+        for (; pending; pending &= pending - 1)
+        {
+            int nr = __builtin_ctz(pending);
+            softirq_vec[nr]();
+            __atomic_fetch_add(&softirq_count[nr], 1, __ATOMIC_RELAXED);
+        }
+
+        cli();
+    }
+
+    this_cpu_write(in_softirq, false);
+}
+
+// irq_exit (threads.h), IF=0
+void softirq_irq_exit(void)
+{
+    // nested in another IRQ's softirqs: that loop picks it up
+    if (this_cpu_read(in_softirq))
+        return;
+
+    // the interrupted code holds a lock (or said no preemption): not here
+    if (this_cpu_read(preempt_count) > 0)
+    {
+        __atomic_fetch_add(&softirq_deferred, 1, __ATOMIC_RELAXED);
+        wakeup_ksoftirqd();
+        return;
+    }
+
+    preempt_disable();
+    __do_softirq();
+    this_cpu_write(preempt_count, this_cpu_read(preempt_count) - 1); // irq_exit decides about need_resched
+
+    // still raising after SOFTIRQ_MAX_RESTART rounds: the rest goes to thread context
+    if (this_cpu_read(softirq_pending))
+    {
+        __atomic_fetch_add(&softirq_deferred, 1, __ATOMIC_RELAXED);
+        wakeup_ksoftirqd();
+    }
+}
+
+// one per CPU, pinned, at the highest level
+static void ksoftirqd_fn(void* arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        sched_lock_irq();
+
+        if (!this_cpu_read(softirq_pending))
+        {
+            thread_sleep_locked(&ksoftirqd_wq[smp_processor_id()]);
+            continue;
+        }
+
+        // pinned: preempt_disable isn't needed to stay here, only to keep IRQ exits out
+        preempt_disable();
+        raw_spin_unlock(&sched_lock);
+
+        __do_softirq();
+
+        sti();
+        preempt_enable();
+    }
+}
+
+// ksoftirqd of a CPU (boot: softirq_init, APs: ap_main)
+bool ksoftirqd_create(int cpu)
+{
+    waitq_init(&ksoftirqd_wq[cpu]);
+
+    kthread_t* t = kthread_spawn(ksoftirqd_fn, NULL, "ksoftirqd", KTHREAD_PRIO_HIGH, 0, KTHREAD_PINNED, cpu);
+    cpus[cpu].ksoftirqd = t;
+
+    return t != NULL;
+}
+
+/* tasklets
+ *  - TASKLET_SCHED: queued on some CPU's list; cleared right before fn runs, so fn may
+ *    reschedule itself
+ *  - TASKLET_RUN: fn running; another CPU finding it set puts the tasklet back for later
+ */
+#define TASKLET_SCHED 0x1
+#define TASKLET_RUN   0x2
+
+typedef struct tasklet
+{
+    struct tasklet* next;
+    void (*fn)(void*);
+    void* arg;
+    volatile int state;
+    uint64_t runs;
+    uint64_t coalesced; // schedules that found it already queued
+} tasklet_t;
+
+typedef struct
+{
+    tasklet_t* head;
+    tasklet_t** tail;
+} tasklet_list_t;
+
+// [cpu][0] = SOFTIRQ_HI, [cpu][1] = SOFTIRQ_TASKLET; only touched by their CPU with IF=0
+// (tail NULL = empty list never used yet)
+static tasklet_list_t tasklet_vec[MAX_CPUS][2];
+
+void tasklet_init(tasklet_t* t, void (*fn)(void*), void* arg)
+{
+    t->next = NULL;
+    t->fn = fn;
+    t->arg = arg;
+    t->state = 0;
+    t->runs = 0;
+    t->coalesced = 0;
+}
+
+// IF=0
+static void tasklet_enqueue(tasklet_t* t, int list)
+{
+    tasklet_list_t* l = &tasklet_vec[smp_processor_id()][list];
+    if (!l->tail)
+        l->tail = &l->head;
+
+    t->next = NULL;
+    *l->tail = t;
+    l->tail = &t->next;
+}
+
+static void __tasklet_schedule(tasklet_t* t, softirq_t nr)
+{
+    if (__atomic_fetch_or(&t->state, TASKLET_SCHED, __ATOMIC_ACQ_REL) & TASKLET_SCHED)
+    {
+        __atomic_fetch_add(&t->coalesced, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    uint64_t flags = irq_save();
+
+    tasklet_enqueue(t, nr == SOFTIRQ_HI ? 0 : 1);
+    raise_softirq_irqoff(nr);
+
+    if (!in_interrupt())
+        wakeup_ksoftirqd();
+
+    irq_restore(flags);
+}
+
+// any context: fn(arg) runs once soon on this CPU, in softirq context (IF=1, must not sleep)
+void tasklet_schedule(tasklet_t* t)
+{
+    __tasklet_schedule(t, SOFTIRQ_TASKLET);
+}
+
+// ahead of every SOFTIRQ_TASKLET one
+void tasklet_hi_schedule(tasklet_t* t)
+{
+    __tasklet_schedule(t, SOFTIRQ_HI);
+}
+
+static void tasklet_action_list(int list, softirq_t nr)
+{
+    cli();
+    tasklet_list_t* l = &tasklet_vec[smp_processor_id()][list];
+    tasklet_t* t = l->head;
+    l->head = NULL;
+    l->tail = &l->head;
+    sti();
+
+    while (t)
+    {
+        tasklet_t* next = t->next;
+
+        if (__atomic_fetch_or(&t->state, TASKLET_RUN, __ATOMIC_ACQUIRE) & TASKLET_RUN)
+        {
+            // running on another CPU: back on our list, it gets another go
+            cli();
+            tasklet_enqueue(t, list);
+            raise_softirq_irqoff(nr);
+            sti();
+        }
+        else
+        {
+            __atomic_fetch_and(&t->state, ~TASKLET_SCHED, __ATOMIC_ACQ_REL);
+
+            t->fn(t->arg);
+            t->runs++;
+
+            __atomic_fetch_and(&t->state, ~TASKLET_RUN, __ATOMIC_RELEASE);
+        }
+
+        t = next;
+    }
+}
+
+static void tasklet_hi_action(void)
+{
+    tasklet_action_list(0, SOFTIRQ_HI);
+}
+
+static void tasklet_action(void)
+{
+    tasklet_action_list(1, SOFTIRQ_TASKLET);
+}
+
+/* workqueues
+ *  - FIFO of work items served by nr_workers threads (thread context: they may block)
+ *  - queue_work from any context; an item already queued (not yet started) isn't queued
+ *    twice, and may be queued again as soon as its fn starts
+ *  - lock order: sched_lock -> wq->lock (the workers check for work under both before sleeping)
+ */
+#define WQ_MAX_WORKERS MAX_CPUS
+
+typedef struct work
+{
+    struct work* next;
+    void (*fn)(struct work* w);
+    volatile bool pending;
+} work_t;
+
+typedef struct workqueue
+{
+    const char* name;
+    spinlock_t lock; // raw, IF=0
+    work_t* head;
+    work_t* tail;
+    waitq_t idle;    // workers with nothing to do (exclusive: queue_work wakes one)
+    int nr_workers;
+    uint64_t queued;
+    uint64_t coalesced;
+    uint64_t done;
+} workqueue_t;
+
+static workqueue_t system_wq_storage;
+static workqueue_t* system_wq = NULL; // shared workers, one per CPU (init)
+
+void work_init(work_t* w, void (*fn)(work_t*))
+{
+    w->next = NULL;
+    w->fn = fn;
+    w->pending = false;
+}
+
+// false: it was already queued
+bool queue_work(workqueue_t* wq, work_t* w)
+{
+    if (__atomic_test_and_set(&w->pending, __ATOMIC_ACQ_REL))
+    {
+        __atomic_fetch_add(&wq->coalesced, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    uint64_t flags = irq_save();
+    raw_spin_lock(&wq->lock);
+
+    w->next = NULL;
+    if (wq->tail)
+        wq->tail->next = w;
+    else
+        wq->head = w;
+    wq->tail = w;
+    wq->queued++;
+
+    raw_spin_unlock(&wq->lock);
+    irq_restore(flags);
+
+    thread_wake_one(&wq->idle);
+    return true;
+}
+
+// next item, NULL if none (wq->lock held)
+static work_t* wq_pop_locked(workqueue_t* wq)
+{
+    work_t* w = wq->head;
+    if (w)
+    {
+        wq->head = w->next;
+        if (!wq->head)
+            wq->tail = NULL;
+    }
+
+    return w;
+}
+
+static void worker_thread(void* arg)
+{
+    workqueue_t* wq = arg;
+
+    for (;;)
+    {
+        uint64_t flags = irq_save();
+        raw_spin_lock(&wq->lock);
+        work_t* w = wq_pop_locked(wq);
+        raw_spin_unlock(&wq->lock);
+        irq_restore(flags);
+
+        if (!w)
+        {
+            // checked again under sched_lock: queue_work's wakeup can't fall in between
+            sched_lock_irq();
+            raw_spin_lock(&wq->lock);
+
+            if (!wq->head)
+            {
+                raw_spin_unlock(&wq->lock);
+                thread_sleep_exclusive_locked(&wq->idle);
+            }
+            else
+            {
+                raw_spin_unlock(&wq->lock);
+                sched_unlock_irq();
+            }
+
+            continue;
+        }
+
+        __atomic_clear(&w->pending, __ATOMIC_RELEASE);
+        w->fn(w);
+
+        __atomic_fetch_add(&wq->done, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* workqueue_init: wq with nr_workers threads at prio
+ *  - returns how many workers started (0: none, the queue only fills up)
+ */
+int workqueue_init(workqueue_t* wq, const char* name, int nr_workers, int prio)
+{
+    memset(wq, 0, sizeof(*wq));
+    wq->name = name;
+    spinlock_init(&wq->lock);
+    waitq_init(&wq->idle);
+
+    if (nr_workers > WQ_MAX_WORKERS)
+        nr_workers = WQ_MAX_WORKERS;
+
+    while (wq->nr_workers < nr_workers && kthread_create_prio(worker_thread, wq, name, prio) != -1)
+        wq->nr_workers++;
+
+    return wq->nr_workers;
+}
+
+/* work kicked from IRQ context (WQ_KICK_VECTOR, idt.h): IRQ -> worker latency in TSC cycles
+ *  - bench preempt raises it under a CPU-bound thread
+ */
+#define WQ_KICK_VECTOR 0xF1
+
+static work_t wq_kick_work;
+static uint64_t wq_kick_tsc = 0; // pending kick, 0 = none
+static uint64_t wq_kick_max = 0;
+static uint64_t wq_kick_sum = 0;
+static uint64_t wq_kick_count = 0;
+
+static void wq_kick_fn(work_t* w)
+{
+    (void)w;
+
+    uint64_t flags = irq_save();
+
+    if (wq_kick_tsc)
+    {
+        uint64_t lat = rdtsc() - wq_kick_tsc;
+        wq_kick_tsc = 0;
+
+        wq_kick_sum += lat;
+        wq_kick_count++;
+        if (lat > wq_kick_max)
+            wq_kick_max = lat;
+    }
+
+    irq_restore(flags);
+}
+
+// from IRQ context
+void wq_kick(void)
+{
+    if (!system_wq)
+        return;
+
+    if (!wq_kick_tsc)
+        wq_kick_tsc = rdtsc();
+
+    queue_work(system_wq, &wq_kick_work);
+}
+
+// boot CPU, after kthread_subsystem_init: the boot CPU's ksoftirqd
+bool softirq_init(void)
+{
+    work_init(&wq_kick_work, wq_kick_fn);
+
+    return ksoftirqd_create(0);
+}
+
+// after smp_init: one shared worker per CPU, just under ksoftirqd
+int workqueue_subsystem_init(void)
+{
+    int n = workqueue_init(&system_wq_storage, "events", nr_cpus, KTHREAD_PRIO_HIGH + 1);
+    if (n)
+        system_wq = &system_wq_storage;
+
+    return n;
+}
+
+void dump_softirq(void)
+{
+    kprintf("[softirq] raised %d  deferred to ksoftirqd %d\n", (int)softirq_raised, (int)softirq_deferred);
+
+    for (int nr = 0; nr < NR_SOFTIRQS; ++nr)
+        kprintf("  %s: runs %d\n", softirq_names[nr], (int)softirq_count[nr]);
+
+    for (int c = 0; c < nr_cpus; ++c)
+    {
+        if (!cpus[c].online)
+            continue;
+
+        kprintf("  cpu %d: pending %x  ksoftirqd %d\n", c, (unsigned int)cpus[c].softirq_pending,
+            cpus[c].ksoftirqd ? cpus[c].ksoftirqd->id : -1);
+    }
+
+    if (system_wq)
+        kprintf("[workqueue %s] workers %d  queued %d  coalesced %d  done %d\n", system_wq->name,
+            system_wq->nr_workers, (int)system_wq->queued, (int)system_wq->coalesced, (int)system_wq->done);
+}
+
+#endif
@@ -39,6 +39,23 @@ void* memset(void* s, int32_t c, size_t n)
     return s;
 }
 
+int32_t memcmp(const void* a, const void* b, size_t n)
+{
+    const unsigned char* x = (const unsigned char*)a;
+    const unsigned char* y = (const unsigned char*)b;
+
+    while (n--)
+    {
+        if (*x != *y)
+            return *x - *y;
+
+        x++;
+        y++;
+    }
+
+    return 0;
+}
+
 int32_t strcmp(const unsigned char* str1, const unsigned char* str2)
 {
     while (*str1 && (*str1 == *str2))
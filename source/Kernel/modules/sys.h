@@ -5,14 +5,24 @@
 
 static struct file* fd_table[MAX_FDS];
 
+// exact-size caches (40 bytes for struct file instead of the 64 class)
+static kmem_cache_t* file_cache;
+static kmem_cache_t* fops_cache;
+
 static ssize_t tty_read(struct file* f, void* buf, size_t size)
 {
     struct tty* t = f->private_data;
 
+    // line_ready is set before the wakeup (under sched_lock): checking under it loses nothing
+    sched_lock_irq();
     while (!t->line_ready)
     {
-        thread_sleep(&t->read_wq);
+        thread_sleep_exclusive_locked(&t->read_wq); // one line, one reader
+        sched_lock_irq();
     }
+    sched_unlock_irq();
+
+    spin_lock(&t->lock);
 
     ssize_t n = strlen(t->input);
 
@@ -24,6 +34,8 @@ static ssize_t tty_read(struct file* f, void* buf, size_t size)
     t->line_ready = false;
     memset(t->input, 0, n);
 
+    spin_unlock(&t->lock);
+
     return n;
 }
 
@@ -43,9 +55,14 @@ void init_fs(void)
 {
     memset(fd_table, 0, sizeof(fd_table));
 
+    file_cache = kmem_cache_create("file", sizeof(struct file), 0, NULL);
+    fops_cache = kmem_cache_create("fops", sizeof(struct fops_t), 0, NULL);
+
     // stdin, stdout -> (points to) tty (console)
-    struct file* stdin_file = kmalloc(sizeof(struct file));
-    struct fops_t* stdin_fops = kmalloc(sizeof(struct fops_t));
+    struct file* stdin_file = kmem_cache_alloc(file_cache);
+    struct fops_t* stdin_fops = kmem_cache_alloc(fops_cache);
+
+    memset(stdin_file, 0, sizeof(*stdin_file));
 
     stdin_file->fd = 0;
     stdin_file->offset = 0;
@@ -58,8 +75,10 @@ void init_fs(void)
 
     fd_table[0] = stdin_file;
 
-    struct file* stdout_file = kmalloc(sizeof(struct file));
-    struct fops_t* stdout_fops = kmalloc(sizeof(struct fops_t));
+    struct file* stdout_file = kmem_cache_alloc(file_cache);
+    struct fops_t* stdout_fops = kmem_cache_alloc(fops_cache);
+
+    memset(stdout_file, 0, sizeof(*stdout_file));
 
     stdout_file->fd = 1;
     stdout_file->offset = 0;
@@ -4,14 +4,34 @@
 /*
  * thread subsystem for homemade kernel
  * - thread creation
- * - cooperative yield scheduler (round-robin)
- * - waitqueue and semaphore primitive
+ * - round-robin scheduler: cooperative yield + optional preemption (time slice, wakeups)
+ * - one run queue per CPU (init/smp.h), balanced on wakeup and by stealing when idle
+ * - FIFO wait queues (shared / exclusive waiters) and semaphores; sleeping locks in mutex.h
+ * - exited threads are reaped right after their last switch: detached slots go back to
+ *   the free list, joinable ones wait for kthread_join
+ * - stacks with guard pages, recycled through a cache (init/stack.h)
+ * - per-thread TLS block at the FS base (swapped on every switch), fn gets up to 6 arguments
  *
  * this is minimal and i think this is not fully ABI-compliant (stack alignment caveats)
  */
 
 #define MAX_THREADS 64
-#define KTHREAD_STACK_SIZE 8192 // TODO portar pra 16384
+#define KTHREAD_STACK_SIZE 16384 // default; kthread_create_ex picks others (init/stack.h)
+#define KTHREAD_TIMESLICE 50    // ticks (50 ms at HZ 1000)
+
+#define KTHREAD_MAX_ARGS     6  // System V register arguments (kthread_create_argv)
+#define KTHREAD_TLS_SLOTS    8  // tls_key_create keys
+#define KTHREAD_CLOSURE_SIZE 64 // bytes of kthread_create_closure's block
+
+// kthread_create_ex flags
+#define KTHREAD_JOINABLE 0x1 // zombie keeps its slot and exit code until kthread_join
+#define KTHREAD_PINNED   0x2 // stays on the CPU it was created on (idle, ksoftirqd)
+
+// priority levels: 0 is the highest, the last one is the idle thread's (never queued)
+#define KTHREAD_PRIO_LEVELS  8
+#define KTHREAD_PRIO_HIGH    0
+#define KTHREAD_PRIO_DEFAULT 4
+#define KTHREAD_PRIO_IDLE    (KTHREAD_PRIO_LEVELS - 1)
 
 typedef enum
 {
@@ -24,28 +44,233 @@ typedef enum
 
 struct kthread;
 
+/* per-thread block at the FS base
+ *  - self at %fs:0; every field is one %fs-relative load away (tls_read), no current ->
+ *    thread_table detour
+ *  - boot contexts (before a CPU's first thread) share tls_boot: read only
+ */
+typedef struct kthread_tls
+{
+    struct kthread_tls* self;
+    struct kthread* thread;
+    int id;
+    kmem_magazine_t* mags;           // kmalloc/kfree fast path (alloc.h)
+    uint64_t args[KTHREAD_MAX_ARGS]; // what fn is called with (kthread_start)
+    void* slot[KTHREAD_TLS_SLOTS];   // tls_get / tls_set, NULL at creation
+    uint8_t closure[KTHREAD_CLOSURE_SIZE] __attribute__((aligned(16))); // kthread_create_closure's copy
+} kthread_tls_t;
+
+/* waitq: blocked threads in arrival order, linked through next/prev
+ *  - shared waiters are all woken by every wakeup, exclusive ones one at a time
+ */
 typedef struct waitq
 {
-    struct kthread *head;
+    struct kthread* head;
+    struct kthread* tail;
 } waitq_t;
 
 typedef struct kthread
 {
-    struct kthread* next;
+    struct kthread* next; // run queue level, wait queue or free slot list
+    struct kthread* prev; // run queue level or wait queue
     int id;
     thread_state_t state;
-    uint8_t* stack;     // base pointer allocated
+    uint8_t* stack;     // lowest byte of the stack (kstack_alloc), guard pages under it
+    size_t stack_size;
     uint64_t* sp;
-    void (*fn)(void*);
-    void* arg;
+    void (*fn)(void*);  // called with tls.args (kthread_start)
     int exit_code;
+    int slice;          // ticks left before the tick asks for a switch
+    int prio;           // run queue level (0 = highest)
+    struct waitq* wq;   // wait queue the thread is blocked on (NULL: none, or a plain timer sleep)
+    bool wait_exclusive; // on wq as an exclusive waiter
+    bool timed_out;     // thread_sleep_timeout (timer.h) gave up waiting
+    int cpu;            // run queue it is on / last ran on
+    uint8_t* fpu_state; // XSAVE area, 64-byte aligned (init/fpu.h), NULL until kernel_fpu_begin
+    void* fpu_alloc;    // what kmalloc returned for it
+    int fpu_depth;      // kernel_fpu_begin nesting
+    int fpu_cpu;        // CPU whose registers last held its state
+    bool pinned;        // KTHREAD_PINNED: never balanced or stolen
+    bool joinable;      // KTHREAD_JOINABLE and not detached yet
+    bool joining;       // a kthread_join claimed it
+    bool gone;          // zombie that left its CPU for good (finish_switch)
+    waitq_t join_wq;    // kthread_join waits here
+
+    // accounting, tsc cycles (sched_lock; debug sched)
+    uint64_t stamp;        // last switch-in, switch-out or enqueue
+    uint64_t run_cycles;   // on a CPU
+    uint64_t wait_cycles;  // runnable, queued behind others
+    uint64_t nvcsw;        // switched out blocked or exiting
+    uint64_t nivcsw;       // switched out still runnable (preempted, yield)
+    uint64_t nr_wakeups;
+    uint64_t wake_lat_sum; // wakeup -> running
+    uint64_t wake_lat_max;
+    bool woken;            // queued by a wakeup, latency not taken yet
     char name[32];
+    kthread_tls_t tls;                      // FS base while it runs
+    kmem_magazine_t mags[KMEM_MAX_CACHES]; // per-thread kmalloc/kfree magazines (alloc.h)
 } kthread_t;
 
 static kthread_t thread_table[MAX_THREADS];
-static kthread_t *runqueue_head = NULL; // circular singly-linked list
-static kthread_t *current = NULL;
+typedef struct
+{
+    kthread_t* head;
+    kthread_t* tail;
+} runlist_t;
+
+typedef struct
+{
+    uint64_t bitmap;    // bit n set -> level[n] not empty
+    runlist_t level[KTHREAD_PRIO_LEVELS];
+    int nr_running;     // queued threads (current not included)
+} runqueue_t;
+
+static runqueue_t runqueues[MAX_CPUS];
+
+#define cpu_rq(c) (&runqueues[c])
+#define this_rq() cpu_rq(smp_processor_id())
+
+/* sched_lock: every run queue, thread state and wait queue
+ *  - always taken with IF=0: IRQs on the same CPU wake threads too
+ *  - held across context_switch; the thread switched to releases it (finish_switch / schedule_tail)
+ *  - lock order: sched_lock -> timer_lock (timer.h)
+ */
+static spinlock_t sched_lock;
+
+// UNUSED slots of thread_table, linked through next (O(1) kthread_create)
+static kthread_t* free_slots = NULL;
 static int next_tid = 1;
+static int nr_free_slots = 0;
+
+// preemption on/off at runtime (debug preempt); off = purely cooperative
+static bool sched_preempt = true;
+
+// idle waits in MWAIT when the CPU has it (debug idle hlt|mwait)
+static bool idle_mwait_ok = false;
+static bool idle_mwait = false;
+static uint64_t resched_ipis = 0;       // resched IPIs sent
+static uint64_t resched_ipis_saved = 0; // target idle in MWAIT: the store woke it
+
+void clock_idle_switch(bool idle); // init/apic.h
+void smp_send_resched(int cpu);    // init/apic.h
+void fpu_switch(struct kthread* prev, struct kthread* next); // init/fpu.h
+uint8_t* kstack_alloc(size_t size, size_t* out_size);       // init/stack.h
+void kstack_free(uint8_t* stack);
+void waitq_wake_locked(waitq_t* wq, int nr_exclusive);
+void softirq_irq_exit(void);                                  // softirq.h
+
+static inline void sched_lock_irq(void)
+{
+    cli();
+    raw_spin_lock(&sched_lock);
+}
+
+static inline void sched_unlock_irq(void)
+{
+    raw_spin_unlock(&sched_lock);
+    sti();
+}
+
+static inline uint64_t sched_lock_irqsave(void)
+{
+    uint64_t flags = irq_save();
+    raw_spin_lock(&sched_lock);
+    return flags;
+}
+
+static inline void sched_unlock_irqrestore(uint64_t flags)
+{
+    raw_spin_unlock(&sched_lock);
+    irq_restore(flags);
+}
+
+// --- TLS -------------------------------------------------------------------
+
+#define MSR_FS_BASE  0xC0000100
+#define CR4_FSGSBASE (1 << 16)
+
+static kthread_tls_t tls_boot = { .self = &tls_boot };
+static bool tls_fsgsbase = false; // wrfsbase instead of wrmsr on switch
+static int tls_nr_keys = 0;
+
+#define tls_read(field)                                                     \
+    ({                                                                      \
+        typeof(((kthread_tls_t*)0)->field) v__;                             \
+        asm volatile("mov %%fs:%c1, %0" : "=r"(v__) : "i"(offsetof(kthread_tls_t, field))); \
+        v__;                                                                \
+    })
+
+static inline kthread_tls_t* tls_self(void)
+{
+    return tls_read(self);
+}
+
+static inline void tls_set_base(kthread_tls_t* tls)
+{
+    if (tls_fsgsbase)
+        asm volatile("wrfsbase %0" : : "r"((uint64_t)tls) : "memory");
+    else
+        wrmsr(MSR_FS_BASE, (uint64_t)tls);
+}
+
+/* tls_cpu_init: every CPU (init/smp.h cpu_init), before anything reads %fs
+ *  - FSGSBASE on when CPUID.7:EBX has it: wrfsbase is far cheaper than wrmsr on every switch
+ */
+void tls_cpu_init(void)
+{
+    uint32_t a, b, c, d;
+    cpuid(0, 0, &a, &b, &c, &d);
+
+    if (a >= 7)
+    {
+        cpuid(7, 0, &a, &b, &c, &d);
+        tls_fsgsbase = b & 1;
+    }
+
+    if (tls_fsgsbase)
+        write_cr4(read_cr4() | CR4_FSGSBASE);
+
+    tls_set_base(&tls_boot);
+}
+
+// context switch hook (__schedule / kthread_start_scheduler, IF=0)
+static inline void tls_switch(kthread_t* next)
+{
+    tls_set_base(&next->tls);
+}
+
+// new key for tls_get / tls_set, the same in every thread; -1 once KTHREAD_TLS_SLOTS are taken
+int tls_key_create(void)
+{
+    int key = __atomic_fetch_add(&tls_nr_keys, 1, __ATOMIC_RELAXED);
+    return key < KTHREAD_TLS_SLOTS ? key : -1;
+}
+
+// calling thread's value for key (NULL until it sets one, or for a key tls_key_create didn't give)
+static inline void* tls_get(int key)
+{
+    if (key < 0 || key >= KTHREAD_TLS_SLOTS)
+        return NULL;
+
+    void* v;
+    asm volatile("mov %%fs:%c1(,%2,8), %0" : "=r"(v) : "i"(offsetof(kthread_tls_t, slot)), "r"((uint64_t)key));
+    return v;
+}
+
+// thread context only: in an ISR it would land in the interrupted thread's slot; false for a bad key
+static inline bool tls_set(int key, void* v)
+{
+    if (key < 0 || key >= KTHREAD_TLS_SLOTS)
+        return false;
+
+    asm volatile("mov %0, %%fs:%c1(,%2,8)" : : "r"(v), "i"(offsetof(kthread_tls_t, slot)), "r"((uint64_t)key) : "memory");
+    return true;
+}
+
+static kmem_magazine_t* kmem_local_magazines(void)
+{
+    return tls_read(mags); // NULL in boot contexts
+}
 
 /* ABI system V AMD64:
  *   old_sp in RDI
@@ -75,35 +300,33 @@ asm(
     "retq\n\t"               // return to kthread_entry
 );
 
-// TODO -> mais de um argumento
+// first instructions of every thread (prepare_stack's return address), RSP 16-aligned
 asm(
     ".globl kthread_entry\n"
     "kthread_entry:\n\t"
-    "popq %rdi\n\t"        // arg -> RDI (first arg x86_64)
-    "popq %rax\n\t"        // fn -> RAX
-    "callq *%rax\n\t"      // do fn(arg)
-    // placeholder -> thread doesnt return
-    "hlt\n\t"              // TODO panic logic
+    "callq schedule_tail\n\t" // switches happen with sched_lock held and IF=0
+    "callq kthread_start\n\t" // fn(args...) from the TLS block, never returns
 );
 
 extern void kthread_exit(int code);
 
-/* trampoline: when we RET into here, RSP points to 'arg'
- * we pop arg into RDI, pop fn into RSI, then call *RSI (fn) with arg in RDI -> fn(arg);
- * after fn returns we call kthread_exit(0)
+typedef void (*kthread_argfn_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+/* kthread_start: fn with the 6 argument registers loaded from tls.args
+ *  - a function taking fewer just ignores the rest (System V), so fn(void*) and fn(a, b, c)
+ *    go through the same call
+ *  - returning from fn = kthread_exit(0)
  */
-void thread_trampoline(void);
-asm (
-    ".text\n"
-    ".global thread_trampoline\n"
-    "thread_trampoline:\n"
-    "    pop %rdi\n"             // arg is in sp -> RDI
-    "    pop %rsi\n"             // fn is the next qword -> RSI
-    "    call *%rsi\n"           // do fn(arg)
-    "    mov $0, %rdi\n"         // exit code 0 (exit code fits into RDI)
-    "    call kthread_exit\n"    // do kthread_exit(0)
-    "    hlt\n"                  // TODO panic logic
-);
+__attribute__((noreturn, used)) void kthread_start(void)
+{
+    kthread_tls_t* tls = tls_self();
+    const uint64_t* a = tls->args;
+
+    ((kthread_argfn_t)tls->thread->fn)(a[0], a[1], a[2], a[3], a[4], a[5]);
+
+    kthread_exit(0);
+    __builtin_unreachable();
+}
 
 /*
 static void dump_thread_sp(kthread_t* t)
@@ -114,14 +337,14 @@ static void dump_thread_sp(kthread_t* t)
         return;
     }
     
-    kprintf("context switch counter = %d\n", cs_count);
+    kprintf("context switches = %d\n", (int)this_cpu()->nr_switches);
     kprintf("thread %d name=%s stack=%p sp=%p\n", t->id, t->name, t->stack, (void*)t->sp);
     
     if (t->stack)
     {
-        kprintf(" stack range: %p - %p\n", t->stack, (void*)(t->stack + KTHREAD_STACK_SIZE));
+        kprintf(" stack range: %p - %p\n", t->stack, (void*)(t->stack + t->stack_size));
         
-        if ((uint8_t*)t->sp < t->stack || (uint8_t*)t->sp > t->stack + KTHREAD_STACK_SIZE)
+        if ((uint8_t*)t->sp < t->stack || (uint8_t*)t->sp > t->stack + t->stack_size)
             kprintf(" WARNING: sp outside allocated stack!\n");
 
         // peek all 8 qwords
@@ -134,20 +357,16 @@ static void dump_thread_sp(kthread_t* t)
 }
 */
 
-static inline uint64_t* prepare_stack(
-    void (*fn)(void*), void* arg, 
-    void* stack_base, size_t stack_size
-)
+// fn and its arguments are in the TLS block: the stack only holds context_switch's frame
+static inline uint64_t* prepare_stack(void* stack_base, size_t stack_size)
 {
     uint64_t* sp = (uint64_t*)((char*)stack_base + stack_size);
    
-    // align to 16
+    // align to 16 (kthread_entry starts with RSP here)
     sp = (uint64_t*)((uintptr_t)sp & ~0xFUL);
     
     extern void kthread_entry(void); 
     
-    --sp; *sp = (uint64_t)fn;
-    --sp; *sp = (uint64_t)arg;
     --sp; *sp = (uint64_t)kthread_entry;
 
     // callee-saved
@@ -161,323 +380,1070 @@ static inline uint64_t* prepare_stack(
     return sp; // tá retornando o addr que aponta pra essa stack/esse layout definido acima
 }
 
-// runqueue helpers (circular singly-linked list)
+/* run queue: one FIFO per priority level + a bitmap of non-empty levels
+ *  - level 0 is the highest; __builtin_ctzll(bitmap) finds the best runnable level in O(1)
+ *  - levels are intrusive doubly-linked lists (next/prev in kthread_t): enqueue, pick and
+ *    remove are all O(1)
+ *  - the running thread is NOT queued: it goes back to the tail of its level when it
+ *    yields or is preempted, and simply isn't re-queued when it blocks or exits
+ *  - one per CPU; a thread is queued on rq t->cpu (sched_lock held)
+ */
 static void enqueue_runnable(kthread_t* t)
 {
-    if (!runqueue_head)
-        runqueue_head = t->next = t;
+    runqueue_t* rq = cpu_rq(t->cpu);
+    runlist_t* l = &rq->level[t->prio];
+
+    t->next = NULL;
+    t->prev = l->tail;
+    if (l->tail)
+        l->tail->next = t;
     else
-    {
-        t->next = runqueue_head->next;
-        runqueue_head->next = t;
-    }
+        l->head = t;
+
+    l->tail = t;
+    rq->bitmap |= 1ULL << t->prio;
+    rq->nr_running++;
 }
 
-static void remove_from_runqueue(kthread_t* t)
+// highest priority queued thread, removed from the queue (NULL if none: the CPU's idle runs)
+static kthread_t* pick_next(runqueue_t* rq)
 {
-    if (!runqueue_head) return;
-    kthread_t* prev = runqueue_head;
-    kthread_t* it = runqueue_head->next;
+    if (!rq->bitmap)
+        return NULL;
 
-    if (it == t)
-    {
-        if (it == runqueue_head)
-        {
-            runqueue_head = NULL;
-            return;
-        }
-        else
-        {
-            prev->next = it->next;
-            runqueue_head = prev;
-            return;
-        }
-    }
+    int prio = __builtin_ctzll(rq->bitmap);
+    runlist_t* l = &rq->level[prio];
 
-    while (it != runqueue_head)
+    kthread_t* t = l->head;
+    l->head = t->next;
+    if (l->head)
+        l->head->prev = NULL;
+    else
     {
-        if (it == t)
-        {
-            prev->next = it->next;
-            return;
-        }
-        prev = it; it = it->next;
+        l->tail = NULL;
+        rq->bitmap &= ~(1ULL << prio);
     }
 
-    if (runqueue_head == t)
-    {
-        if (runqueue_head->next == runqueue_head)
-            runqueue_head = NULL;
-        else
-        {
-            kthread_t* tail = runqueue_head;
-            while (tail->next != runqueue_head) tail = tail->next;
-            tail->next = runqueue_head->next;
-            runqueue_head = runqueue_head->next;
-        }
-    }
+    t->next = NULL;
+    rq->nr_running--;
+
+    return t;
 }
 
-// round-robin scheduler
-void schedule(void)
+// takes a queued (RUNNABLE) thread out of its level
+static void remove_from_runqueue(kthread_t* t)
 {
-    cli();
-
-    kthread_t *prev = current;
-    
-    if (!runqueue_head)
-    {
-        sti();
-        return; 
-    }
-
-    kthread_t *next = NULL;
-
-    // thread bloqueou ou morreu
-    if (prev->state == THREAD_BLOCKED || prev->state == THREAD_ZOMBIE)
-    {
-        next = runqueue_head;
-    }
-    
-    else // thread atual só cedeu a CPU pra próxima thread 
-    {
-        next = prev->next;
-
-        runqueue_head = next;
-    }
+    runqueue_t* rq = cpu_rq(t->cpu);
+    runlist_t* l = &rq->level[t->prio];
 
-    if (next == prev && prev->state == THREAD_RUNNING)
-    {
-        sti();
-        return;
-    }
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        l->head = t->next;
 
-    current = next;
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        l->tail = t->prev;
 
-    if (prev->state == THREAD_RUNNING)
-        prev->state = THREAD_RUNNABLE;
-        
-    next->state = THREAD_RUNNING;
+    if (!l->head)
+        rq->bitmap &= ~(1ULL << t->prio);
 
-    // dump_runqueue();
+    t->next = NULL;
+    t->prev = NULL;
+    rq->nr_running--;
+}
 
-    sti();
-    context_switch(&prev->sp, next->sp);
+// true if a queued thread should run instead of one at `prio` (same level -> round-robin)
+static inline bool rq_has_better(runqueue_t* rq, int prio)
+{
+    return rq->bitmap && __builtin_ctzll(rq->bitmap) <= prio;
+}
 
-    // thread returns to here ?
+// queued threads (idle is never queued)
+static inline int rq_load(runqueue_t* rq)
+{
+    return rq->nr_running;
 }
 
-// gives the CPU to the next thread runnable in queue
-void kthread_yield(void)
+// queued + running work of a CPU
+static inline int cpu_load(int c)
 {
-    schedule();
+    return rq_load(cpu_rq(c)) + (cpus[c].curr && cpus[c].curr != cpus[c].idle);
 }
 
-int kthread_create(void (*fn)(void*), void* arg, const char* name)
+/* select_cpu: run queue for a thread becoming runnable
+ *  - stays where it last ran (warm cache) unless another online CPU has less work
+ */
+static int select_cpu(kthread_t* t)
 {
-    for (int i = 0; i < MAX_THREADS; ++i)
+    if (t->pinned)
+        return t->cpu;
+
+    int best = cpus[t->cpu].online ? t->cpu : smp_processor_id();
+    int load = cpu_load(best);
+
+    for (int c = 0; c < nr_cpus && load > 0; ++c)
     {
-        if (thread_table[i].state == THREAD_UNUSED)
+        if (!cpus[c].online || c == best)
+            continue;
+
+        int l = cpu_load(c);
+        if (l < load)
         {
-            kthread_t* t = &thread_table[i];
-            memset(t, 0, sizeof(*t));
-            t->id = next_tid++;
-            t->state = THREAD_RUNNABLE;
-            
-            if (name)
-              strncpy(t->name, name, sizeof(t->name)-1);
-
-            t->stack = kmalloc(KTHREAD_STACK_SIZE);
-            if (!t->stack)
-                return -1;
-
-            t->fn  = fn;
-            t->arg = arg;
-            t->sp  = prepare_stack(fn, arg, t->stack, KTHREAD_STACK_SIZE);
-
-            cli();
-            enqueue_runnable(t);
-            sti();
-            
-            return t->id;
+            best = c;
+            load = l;
         }
     }
 
-    return -1;
+    return best;
 }
 
-void kthread_exit(int code)
+/* steal_task: an idle CPU pulls the best queued thread of the busiest run queue
+ *  - false if nobody has anything queued
+ */
+static bool steal_task(int self)
 {
-    cli();
-    if (!current)
-        // should not happen
-        panic();
-
-    current->exit_code = code;
-    current->state = THREAD_ZOMBIE;
-
-    remove_from_runqueue(current);
+    int busiest = -1;
+    int load = 0;
 
-    if (current->stack)
+    for (int c = 0; c < nr_cpus; ++c)
     {
-        kfree(current->stack);
-        current->stack = NULL;
-    }
+        if (c == self || !cpus[c].online)
+            continue;
 
-    if (!runqueue_head)
-    {
-        sti();
-        panic();
+        int l = rq_load(cpu_rq(c));
+        if (l > load)
+        {
+            busiest = c;
+            load = l;
+        }
     }
 
-    kthread_t* next = runqueue_head->next;
-    next->state = THREAD_RUNNING;
-    
-    kthread_t* old = current;
-    current = next;
+    if (busiest < 0)
+        return false;
 
-    uint64_t** old_sp_storage = &old->sp;
-    context_switch(old_sp_storage, next->sp);
-    
-    for(;;)
-        asm volatile("hlt");
-}
+    runqueue_t* rq = cpu_rq(busiest);
+    kthread_t* t = NULL;
 
-void waitq_init(waitq_t* wq)
-{
-    wq->head = NULL;
-}
+    // best level first, skipping what is pinned there
+    for (uint64_t levels = rq->bitmap; levels && !t; levels &= levels - 1)
+        for (kthread_t* it = rq->level[__builtin_ctzll(levels)].head; it && !t; it = it->next)
+            if (!it->pinned)
+                t = it;
 
-void thread_sleep(waitq_t* wq)
-{
-    cli();
+    if (!t)
+        return false;
 
-    current->state = THREAD_BLOCKED;
+    remove_from_runqueue(t);
+    t->cpu = self;
+    enqueue_runnable(t);
 
-    remove_from_runqueue(current);
+    return true;
+}
 
-    current->next = wq->head;
-    wq->head = current;
+// asks CPU c for a switch: its own flag when local, plus an IPI when remote (sched_lock held)
+static void resched_cpu(int c)
+{
+    if (c == smp_processor_id())
+    {
+        this_cpu_write(need_resched, true);
+        return;
+    }
 
-    // dump_runqueue();
+    if (!cpus[c].need_resched)
+    {
+        // seq_cst on both sides (cpu_idle_wait): either it sees the flag or we see it polling
+        __atomic_store_n(&cpus[c].need_resched, true, __ATOMIC_SEQ_CST);
 
-    schedule();
-    
-    sti();
+        if (__atomic_load_n(&cpus[c].idle_polling, __ATOMIC_SEQ_CST))
+            resched_ipis_saved++; // MWAIT on that line: the store was the wakeup
+        else
+        {
+            resched_ipis++;
+            smp_send_resched(c);
+        }
+    }
 }
 
-/*
-void thread_sleep(waitq_t* wq)
+// a thread just became runnable: preempt its CPU's thread if it isn't more important
+static inline void check_preempt_wakeup(kthread_t* t)
 {
-    cli();
-
-    current->state = THREAD_BLOCKED;
-    current->next = wq->head;
-    wq->head = current;
-    remove_from_runqueue(current);
+    kthread_t* curr = cpus[t->cpu].curr;
 
-    dump_runqueue();
-    halt();
-    schedule();
-    
-    sti();
+    if (!curr || t->prio <= curr->prio)
+        resched_cpu(t->cpu);
 }
-*/
 
-void thread_wake_one(waitq_t* wq)
+// back on the run queue of the CPU select_cpu picks (sched_lock held)
+static void wake_up_locked(kthread_t* t)
 {
-    cli();
- 
-    if (!wq->head)
-    {
-        sti();
-        return;
-    }
-    
-    kthread_t* t = wq->head;
-    wq->head = t->next;
+    t->stamp = rdtsc();
+    t->woken = true;
+    t->nr_wakeups++;
+
     t->next = NULL;
+    t->wq = NULL;
     t->state = THREAD_RUNNABLE;
+    t->cpu = select_cpu(t);
     enqueue_runnable(t);
-  
-    sti();
+    check_preempt_wakeup(t);
 }
 
-void thread_wake_all(waitq_t* wq)
+// slot back on the free list (sched_lock held)
+static void release_slot_locked(kthread_t* t)
 {
-    cli();
-    
-    kthread_t* it = wq->head;
-    while (it)
-    {
-        kthread_t* n = it->next;
-        it->next = NULL;
-        it->state = THREAD_RUNNABLE;
-        enqueue_runnable(it);
-        it = n;
-    }
-    wq->head = NULL;
-
-    sti();
+    t->state = THREAD_UNUSED;
+    t->next = free_slots;
+    free_slots = t;
+    nr_free_slots++;
 }
 
-// semaphore 
-typedef struct
+// thread by tid, NULL if no slot holds it (sched_lock held)
+static kthread_t* find_thread_locked(int tid)
 {
-    int count;
-    waitq_t wq;
-} sem_t;
+    for (int i = 0; i < MAX_THREADS; ++i)
+        if (thread_table[i].state != THREAD_UNUSED && thread_table[i].id == tid)
+            return &thread_table[i];
 
-void sem_init(sem_t* s, int initial)
-{
-    s->count = initial;
-    waitq_init(&s->wq);
+    return NULL;
 }
 
-void sem_wait(sem_t* s)
+/* finish_switch: runs on the thread switched to, lock still held
+ *  - reaper of whatever exited on this CPU: nothing runs on its stack or writes its slot
+ *    anymore, so both can go
+ *  - only unlinks here: stack and FPU area wait on this CPU's reap list until sched_lock is
+ *    dropped (sched_unlock_reap). freeing them takes kstack_lock, page_lock and cache locks,
+ *    which other CPUs hold with IF=1 while their timer IRQ spins on sched_lock
+ */
+static void finish_switch(void)
 {
-    cli();
+    cpu_t* cpu = this_cpu();
+    kthread_t* dead = cpu->dead;
 
-    s->count--;
-    if (s->count < 0)
-        thread_sleep(&s->wq);
-  
-    sti();
+    if (!dead)
+        return;
+
+    cpu->dead = NULL;
+    cpu->reap_stack = dead->stack;
+    cpu->reap_fpu = dead->fpu_alloc;
+    dead->stack = NULL;
+    dead->fpu_alloc = NULL;
+    dead->fpu_state = NULL;
+
+    dead->gone = true;
+    if (dead->joinable)
+        waitq_wake_locked(&dead->join_wq, 1);
+    else
+        release_slot_locked(dead);
 }
 
-void sem_post(sem_t* s)
+/* sched_unlock_reap: drops sched_lock after a switch, IF stays 0 (the caller turns it back on)
+ *  - frees what finish_switch left on this CPU; taken before IF=1, so a switch right
+ *    after the sti can't overwrite the reap list
+ */
+static void sched_unlock_reap(void)
 {
-    cli();
-    s->count++;
+    raw_spin_unlock(&sched_lock);
 
-    if (s->count <= 0)
-        thread_wake_one(&s->wq);
+    cpu_t* cpu = this_cpu();
+    uint8_t* stack = cpu->reap_stack;
+    void* fpu = cpu->reap_fpu;
 
-    sti();
+    if (!stack && !fpu)
+        return;
+
+    cpu->reap_stack = NULL;
+    cpu->reap_fpu = NULL;
+
+    kstack_free(stack); // cached: the next kthread_create takes it as is
+    kfree(fpu);
 }
 
-// idle thread
-static void idle_thread_fn(void* arg)
+// cycles since t's last stamp (TSCs of different CPUs can be a little apart)
+static inline uint64_t sched_delta(kthread_t* t, uint64_t now)
 {
-    (void)arg; // isnt needed at this point
-
-    for(;;)
-    {
-        safe_halt();
-        kthread_yield();
-    }
+    return now > t->stamp ? now - t->stamp : 0;
 }
 
-void kthread_subsystem_init(void)
+// prev leaves the CPU: still RUNNABLE -> involuntary, blocked or exiting -> voluntary
+static inline void sched_account_out(kthread_t* prev, uint64_t now)
 {
-    memset(thread_table, 0, sizeof(thread_table));
-    
-    for (int i = 0; i < MAX_THREADS; ++i)
+    prev->run_cycles += sched_delta(prev, now);
+    prev->stamp = now;
+
+    if (prev->state == THREAD_RUNNABLE)
+        prev->nivcsw++;
+    else
+        prev->nvcsw++;
+}
+
+// next gets the CPU after waiting in a run queue since its stamp
+static inline void sched_account_in(cpu_t* cpu, kthread_t* next, uint64_t now)
+{
+    uint64_t waited = sched_delta(next, now);
+
+    next->wait_cycles += waited;
+    next->stamp = now;
+
+    if (next->woken)
+    {
+        next->woken = false;
+        next->wake_lat_sum += waited;
+        if (waited > next->wake_lat_max)
+            next->wake_lat_max = waited;
+    }
+
+    cpu->nr_switches++;
+}
+
+/* priority round-robin scheduler
+ *  - called by yield/sleep, by preempt_enable() and on IRQ exit (irq_exit)
+ *  - highest runnable level wins; threads of the same level take turns
+ *  - sched_lock held and IF=0; returns (when this thread runs again) with the lock held
+ *  - nothing left here when the thread blocks or idle runs -> try to steal from another CPU
+ */
+static void __schedule(void)
+{
+    cpu_t* cpu = this_cpu();
+    runqueue_t* rq = cpu_rq(cpu->id);
+    kthread_t *prev = cpu->curr;
+
+    cpu->need_resched = false;
+
+    if (!prev)
+        return;
+
+    if (rq_load(rq) == 0 && (prev->state != THREAD_RUNNING || prev == cpu->idle))
+        steal_task(cpu->id);
+
+    if (prev->state == THREAD_RUNNING)
+    {
+        // thread atual só cedeu a CPU: segue rodando se ninguém de prioridade >= está pronto
+        if (!rq_has_better(rq, prev->prio))
+        {
+            prev->slice = KTHREAD_TIMESLICE;
+            return;
+        }
+
+        // idle just steps aside, it's picked again once the queue is empty
+        prev->state = THREAD_RUNNABLE;
+        if (prev != cpu->idle)
+            enqueue_runnable(prev);
+    }
+
+    uint64_t now = rdtsc();
+    sched_account_out(prev, now);
+
+    // thread bloqueou, morreu ou cedeu: próxima da fila, ou idle se a fila está vazia
+    kthread_t *next = pick_next(rq);
+    if (!next)
+        next = cpu->idle;
+
+    cpu->curr = next;
+
+    next->state = THREAD_RUNNING;
+    next->slice = KTHREAD_TIMESLICE;
+    sched_account_in(cpu, next, now);
+
+    // tickless idle: the periodic tick stops while idle runs
+    if ((prev->prio == KTHREAD_PRIO_IDLE) != (next->prio == KTHREAD_PRIO_IDLE))
+        clock_idle_switch(next->prio == KTHREAD_PRIO_IDLE);
+
+    // dump_runqueue();
+
+    fpu_switch(prev, next);
+    tls_switch(next);
+
+    context_switch(&prev->sp, next->sp);
+
+    // back on prev's stack (maybe on another CPU)
+    finish_switch();
+}
+
+void schedule(void)
+{
+    uint64_t flags = sched_lock_irqsave();
+
+    __schedule();
+
+    // each thread gets its own IF back when it resumes
+    sched_unlock_reap();
+    irq_restore(flags);
+}
+
+// first run of a new thread (kthread_entry): finishes the switch that got it here
+void schedule_tail(void)
+{
+    finish_switch();
+    sched_unlock_reap();
+    sti();
+}
+
+// preempt_enable() dropped to 0 with need_resched set
+void preempt_schedule(void)
+{
+    // IF=0 -> inside an ISR or a cli section; irq_exit / the next point will handle it
+    if (!sched_preempt || !current || !irqs_enabled())
+        return;
+
+    schedule();
+}
+
+// work queued here while another CPU idles: wake that one up so it steals it
+static void kick_idle_cpu(void)
+{
+    int self = smp_processor_id();
+
+    for (int c = 0; c < nr_cpus; ++c)
+    {
+        if (c == self || !cpus[c].online || cpus[c].curr != cpus[c].idle || cpus[c].need_resched)
+            continue;
+
+        resched_cpu(c);
+        return;
+    }
+}
+
+// clock event: charges the running thread's slice with the ticks since the last one
+void sched_tick(int ticks)
+{
+    kthread_t* curr = current;
+    if (!curr)
+        return;
+
+    curr->slice -= ticks;
+    if (curr->slice <= 0)
+        this_cpu_write(need_resched, true);
+
+    if (nr_cpus > 1 && rq_load(this_rq()) > 0)
+        kick_idle_cpu();
+}
+
+/* IRQ exit (idt.h stubs, registers already saved, IF=0):
+ *  - raised softirqs run first (softirq.h), with IF=1
+ *  - switches out the interrupted thread when asked and nothing holds preemption off
+ */
+void irq_exit(void)
+{
+    if (this_cpu_read(softirq_pending))
+        softirq_irq_exit();
+
+    if (!this_cpu_read(need_resched) || !sched_preempt || this_cpu_read(preempt_count) > 0)
+        return;
+
+    kthread_t* curr = current;
+    if (!curr || curr->state != THREAD_RUNNING)
+        return;
+
+    schedule();
+}
+
+// gives the CPU to the next thread runnable in queue
+void kthread_yield(void)
+{
+    schedule();
+}
+
+// what a new thread starts with: fn(args[0], .., args[5]), or fn(copy of closure) when closure is set
+typedef struct
+{
+    uint64_t args[KTHREAD_MAX_ARGS];
+    const void* closure;
+    size_t closure_size; // <= KTHREAD_CLOSURE_SIZE
+} kthread_start_t;
+
+/* __kthread_spawn: new RUNNABLE thread
+ *  - stack_size: 0 = KTHREAD_STACK_SIZE (kstack_alloc rounds it up)
+ *  - flags: KTHREAD_JOINABLE, KTHREAD_PINNED (needs cpu)
+ *  - cpu: run queue to start on, -1 = select_cpu
+ */
+static kthread_t* __kthread_spawn(void (*fn)(void*), const kthread_start_t* start, const char* name, int prio, size_t stack_size, int flags, int cpu)
+{
+    // no zeroing: prepare_stack writes the only frame that is ever read
+    uint8_t* stack = kstack_alloc(stack_size, &stack_size);
+    if (!stack)
+        return NULL;
+
+    uint64_t irqf = sched_lock_irqsave();
+
+    kthread_t* t = free_slots;
+    if (!t)
+    {
+        sched_unlock_irqrestore(irqf);
+        kstack_free(stack);
+        return NULL;
+    }
+
+    free_slots = t->next;
+    nr_free_slots--;
+
+    // what other CPUs may look at (find_thread_locked, join_wq, owner->state) is reset
+    // before the new tid and state appear; tls and mags are the owner's only
+    memset(t, 0, offsetof(kthread_t, tls));
+    int id = next_tid++;
+    t->id = id;                 // the previous tid stops matching now
+    t->state = THREAD_RUNNABLE; // slot taken before the lock goes
+    t->prio = prio;
+    t->joinable = flags & KTHREAD_JOINABLE;
+    t->pinned = cpu >= 0 && (flags & KTHREAD_PINNED);
+    t->stamp = rdtsc();
+    sched_unlock_irqrestore(irqf);
+
+    memset(&t->tls, 0, sizeof(*t) - offsetof(kthread_t, tls));
+
+    if (name)
+      strncpy(t->name, name, sizeof(t->name)-1);
+
+    t->stack = stack;
+    t->stack_size = stack_size;
+    t->fn  = fn;
+    t->sp  = prepare_stack(t->stack, t->stack_size);
+
+    // all of it written before the thread can run anywhere (enqueue below)
+    t->tls.self = &t->tls;
+    t->tls.thread = t;
+    t->tls.id = id;
+    t->tls.mags = t->mags;
+    memcpy(t->tls.args, start->args, sizeof(t->tls.args));
+
+    if (start->closure)
+    {
+        memcpy(t->tls.closure, start->closure, start->closure_size);
+        t->tls.args[0] = (uint64_t)t->tls.closure;
+    }
+
+    irqf = sched_lock_irqsave();
+
+    t->cpu = cpu >= 0 ? cpu : smp_processor_id();
+    if (cpu < 0)
+        t->cpu = select_cpu(t);
+
+    // idle stays off the run queue (kthread_create_idle)
+    if (prio != KTHREAD_PRIO_IDLE)
     {
-        thread_table[i].state = THREAD_UNUSED;
-    }  
+        enqueue_runnable(t);
+        check_preempt_wakeup(t);
+    }
+
+    sched_unlock_irqrestore(irqf);
+
+    return t;
+}
+
+// fn(arg)
+static kthread_t* kthread_spawn(void (*fn)(void*), void* arg, const char* name, int prio, size_t stack_size, int flags, int cpu)
+{
+    kthread_start_t start = { .args = { (uint64_t)arg } };
+    return __kthread_spawn(fn, &start, name, prio, stack_size, flags, cpu);
+}
 
-    kthread_create(idle_thread_fn, NULL, "idle");
+/* kthread_create_ex: new thread with its own stack size
+ *  - prio: 0 (highest) .. KTHREAD_PRIO_IDLE - 1, the idle level is reserved for idle
+ *  - stack_size: 0 = KTHREAD_STACK_SIZE, else KSTACK_MIN_SIZE .. KSTACK_MAX_SIZE (init/stack.h);
+ *    IRQs nest on the thread's stack, so small stacks are for shallow helpers only
+ *  - flags: KTHREAD_JOINABLE -> someone must kthread_join (or kthread_detach) it,
+ *    else the slot is recycled as soon as the thread is off its CPU
+ */
+int kthread_create_ex(void (*fn)(void*), void* arg, const char* name, int prio, size_t stack_size, int flags)
+{
+    if (prio < 0 || prio >= KTHREAD_PRIO_IDLE)
+        return -1;
+
+    kthread_t* t = kthread_spawn(fn, arg, name, prio, stack_size, flags, -1);
+    return t ? t->id : -1;
+}
+
+// kthread_create_ex with the default stack, detached
+int kthread_create_prio(void (*fn)(void*), void* arg, const char* name, int prio)
+{
+    return kthread_create_ex(fn, arg, name, prio, 0, 0);
+}
+
+int kthread_create(void (*fn)(void*), void* arg, const char* name)
+{
+    return kthread_create_prio(fn, arg, name, KTHREAD_PRIO_DEFAULT);
+}
+
+/* kthread_create_argv: fn(argv[0], .., argv[nargs - 1]), up to KTHREAD_MAX_ARGS
+ *  - passed in the System V registers: fn's parameters must be 64-bit integers or pointers
+ *  - prio / flags as kthread_create_ex; -1 for nargs out of range
+ */
+int kthread_create_argv(void* fn, const char* name, int prio, int flags, int nargs, const uint64_t* argv)
+{
+    if (nargs < 0 || nargs > KTHREAD_MAX_ARGS || prio < 0 || prio >= KTHREAD_PRIO_IDLE)
+        return -1;
+
+    kthread_start_t start = { 0 };
+    memcpy(start.args, argv, nargs * sizeof(uint64_t));
+
+    kthread_t* t = __kthread_spawn((void (*)(void*))fn, &start, name, prio, 0, flags, -1);
+    return t ? t->id : -1;
+}
+
+// kthread_create_args(fn, name, a, b, ...): default level, detached (pointers need a (uintptr_t) cast)
+#define kthread_create_args(fn, name, ...)                                          \
+    kthread_create_argv((void*)(fn), name, KTHREAD_PRIO_DEFAULT, 0,                 \
+        sizeof((uint64_t[]){ __VA_ARGS__ }) / sizeof(uint64_t), (uint64_t[]){ __VA_ARGS__ })
+
+/* kthread_create_closure: fn(block'), block' being a copy of block in the new thread's TLS
+ *  - the caller's block may go out of scope right away; size <= KTHREAD_CLOSURE_SIZE
+ *  - prio / flags as kthread_create_ex
+ */
+int kthread_create_closure(void (*fn)(void*), const void* block, size_t size, const char* name, int prio, int flags)
+{
+    if (!block || size > KTHREAD_CLOSURE_SIZE || prio < 0 || prio >= KTHREAD_PRIO_IDLE)
+        return -1;
+
+    kthread_start_t start = { .closure = block, .closure_size = size };
+
+    kthread_t* t = __kthread_spawn(fn, &start, name, prio, 0, flags, -1);
+    return t ? t->id : -1;
+}
+
+/* kthread_set_priority: moves a thread to another level
+ *  - queued threads are re-queued at the tail of the new level
+ *  - -1 for an unknown tid or a level outside 0 .. KTHREAD_PRIO_IDLE - 1
+ */
+int kthread_set_priority(int tid, int prio)
+{
+    if (prio < 0 || prio >= KTHREAD_PRIO_IDLE)
+        return -1;
+
+    uint64_t flags = sched_lock_irqsave();
+
+    kthread_t* t = find_thread_locked(tid);
+    if (!t || t->prio == KTHREAD_PRIO_IDLE)
+    {
+        sched_unlock_irqrestore(flags);
+        return -1;
+    }
+
+    if (t->state == THREAD_RUNNABLE)
+    {
+        remove_from_runqueue(t);
+        t->prio = prio;
+        enqueue_runnable(t);
+        check_preempt_wakeup(t);
+    }
+    else
+    {
+        t->prio = prio;
+
+        // a running thread lowered below someone waiting on its CPU
+        if (t->state == THREAD_RUNNING && rq_has_better(cpu_rq(t->cpu), prio - 1))
+            resched_cpu(t->cpu);
+    }
+
+    bool switch_now = t == current && this_cpu_read(need_resched);
+
+    sched_unlock_irqrestore(flags);
+
+    if (switch_now)
+        schedule();
+
+    return 0;
+}
+
+void kthread_exit(int code)
+{
+    kthread_t* self = current;
+    if (!self)
+        // should not happen
+        panic();
+
+    // IF=0 before the flush: a softirq at irq_exit could refill the magazines afterwards,
+    // and the slot's next owner wipes them
+    cli();
+
+    // objects cached by this thread go back to the shared slabs
+    kmem_magazines_flush(self->mags);
+
+    sched_lock_irq();
+
+    self->exit_code = code;
+    self->state = THREAD_ZOMBIE;
+
+    // still running on the stack: the next thread frees it (finish_switch, sched_unlock_reap)
+    this_cpu()->dead = self;
+
+    // the queue may be empty, idle is always there
+    __schedule();
+
+    for(;;)
+        asm volatile("hlt");
+}
+
+void waitq_init(waitq_t* wq)
+{
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+// O(1) tail insert (sched_lock held)
+static inline void waitq_add_locked(waitq_t* wq, kthread_t* t, bool exclusive)
+{
+    t->next = NULL;
+    t->prev = wq->tail;
+    t->wq = wq;
+    t->wait_exclusive = exclusive;
+
+    if (wq->tail)
+        wq->tail->next = t;
+    else
+        wq->head = t;
+
+    wq->tail = t;
+}
+
+static inline void waitq_del_locked(waitq_t* wq, kthread_t* t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        wq->head = t->next;
+
+    if (t->next)
+        t->next->prev = t->prev;
+    else
+        wq->tail = t->prev;
+
+    t->prev = NULL;
+}
+
+/* __thread_sleep_locked: blocks on wq (thread_sleep_locked / thread_sleep_exclusive_locked)
+ *  - caller holds sched_lock (checked its condition under it, so no wakeup gets lost)
+ *  - returns with the lock dropped and IF=1
+ */
+void __thread_sleep_locked(waitq_t* wq, bool exclusive)
+{
+    kthread_t* self = current;
+
+    self->state = THREAD_BLOCKED;
+
+    // current is not queued: blocking is just not coming back to the run queue
+    waitq_add_locked(wq, self, exclusive);
+
+    // dump_runqueue();
+
+    __schedule();
+
+    sched_unlock_reap();
+    sti();
+}
+
+// shared waiter: every wakeup of wq takes it
+void thread_sleep_locked(waitq_t* wq)
+{
+    __thread_sleep_locked(wq, false);
+}
+
+// exclusive waiter: a wakeup takes only the first one (no thundering herd)
+void thread_sleep_exclusive_locked(waitq_t* wq)
+{
+    __thread_sleep_locked(wq, true);
+}
+
+void thread_sleep(waitq_t* wq)
+{
+    sched_lock_irq();
+    thread_sleep_locked(wq);
+}
+
+void thread_sleep_exclusive(waitq_t* wq)
+{
+    sched_lock_irq();
+    thread_sleep_exclusive_locked(wq);
+}
+
+/*
+void thread_sleep(waitq_t* wq)
+{
+    cli();
+
+    current->state = THREAD_BLOCKED;
+    current->next = wq->head;
+    wq->head = current;
+    remove_from_runqueue(current);
+
+    dump_runqueue();
+    halt();
+    schedule();
+
+    sti();
+}
+*/
+
+static uint64_t waitq_wakeups = 0;  // threads woken through a wait queue
+static uint64_t waitq_skipped = 0;  // exclusive waiters a wakeup left asleep (herd avoided)
+
+/* waitq_wake_locked: wakes, in arrival order, every shared waiter and the first
+ * nr_exclusive exclusive ones (0 = all of them)
+ */
+void waitq_wake_locked(waitq_t* wq, int nr_exclusive)
+{
+    bool all = nr_exclusive <= 0;
+
+    kthread_t* it = wq->head;
+    while (it)
+    {
+        kthread_t* n = it->next;
+
+        if (it->wait_exclusive && !all && nr_exclusive-- <= 0)
+            waitq_skipped++;
+        else
+        {
+            waitq_del_locked(wq, it);
+            wake_up_locked(it);
+            waitq_wakeups++;
+        }
+
+        it = n;
+    }
+}
+
+void thread_wake_one_locked(waitq_t* wq)
+{
+    waitq_wake_locked(wq, 1);
+}
+
+// wakeups may come from ISRs: irq_save keeps IF=0 there; the woken thread preempts at the next point
+void thread_wake_one(waitq_t* wq)
+{
+    uint64_t flags = sched_lock_irqsave();
+    waitq_wake_locked(wq, 1);
+    sched_unlock_irqrestore(flags);
+}
+
+// wakes one specific BLOCKED thread, taking it off its wait queue (sched_lock held)
+void thread_wake_locked(kthread_t* t)
+{
+    if (t->state != THREAD_BLOCKED)
+        return;
+
+    if (t->wq)
+        waitq_del_locked(t->wq, t);
+
+    wake_up_locked(t);
+}
+
+void thread_wake(kthread_t* t)
+{
+    uint64_t flags = sched_lock_irqsave();
+    thread_wake_locked(t);
+    sched_unlock_irqrestore(flags);
+}
+
+// shared and exclusive waiters alike
+void thread_wake_all(waitq_t* wq)
+{
+    uint64_t flags = sched_lock_irqsave();
+    waitq_wake_locked(wq, 0);
+    sched_unlock_irqrestore(flags);
+}
+
+/* semaphore
+ *  - count: free units, or minus the number of queued waiters
+ *  - uncontended wait (count > 0) and post (count >= 0) are one cmpxchg: no cli, no sched_lock
+ *  - going below zero and posting to a queued waiter happen under sched_lock, together
+ *    with the enqueue / wakeup, so no wakeup gets lost
+ */
+typedef struct
+{
+    volatile int count;
+    int wakeups; // posts whose waiter timed out before taking them (timer.h sem_wait_timeout)
+    waitq_t wq;  // exclusive waiters, FIFO
+} sem_t;
+
+static uint64_t sem_sleeps = 0;
+
+void sem_init(sem_t* s, int initial)
+{
+    s->count = initial;
+    s->wakeups = 0;
+    waitq_init(&s->wq);
+}
+
+// takes a unit if one is free without blocking
+static inline bool sem_trywait(sem_t* s)
+{
+    int c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+
+    while (c > 0)
+        if (__atomic_compare_exchange_n(&s->count, &c, c - 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+
+    return false;
+}
+
+void sem_wait(sem_t* s)
+{
+    if (sem_trywait(s))
+        return;
+
+    sched_lock_irq();
+
+    if (__atomic_fetch_sub(&s->count, 1, __ATOMIC_ACQUIRE) > 0)
+    {
+        sched_unlock_irq();
+        return;
+    }
+
+    sem_sleeps++;
+    thread_sleep_exclusive_locked(&s->wq);
+}
+
+// any context
+void sem_post(sem_t* s)
+{
+    int c = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+
+    while (c >= 0)
+        if (__atomic_compare_exchange_n(&s->count, &c, c + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+
+    uint64_t flags = sched_lock_irqsave();
+
+    if (__atomic_fetch_add(&s->count, 1, __ATOMIC_RELEASE) < 0)
+    {
+        if (s->wq.head)
+            waitq_wake_locked(&s->wq, 1);
+        else
+            s->wakeups++;
+    }
+
+    sched_unlock_irqrestore(flags);
+}
+
+/* kthread_join: waits for a KTHREAD_JOINABLE thread to exit, then frees its slot
+ *  - *code (if not NULL) gets what it passed to kthread_exit (0 when fn returned)
+ *  - -1: unknown tid, not joinable (detached / plain kthread_create), already being
+ *    joined, or the caller itself
+ */
+int kthread_join(int tid, int* code)
+{
+    sched_lock_irq();
+
+    kthread_t* t = find_thread_locked(tid);
+    if (!t || !t->joinable || t->joining || t == current)
+    {
+        sched_unlock_irq();
+        return -1;
+    }
+
+    t->joining = true;
+
+    // gone, not just ZOMBIE: its CPU may still be switching away from it
+    while (!t->gone)
+    {
+        thread_sleep_locked(&t->join_wq);
+        sched_lock_irq();
+    }
+
+    if (code)
+        *code = t->exit_code;
+
+    release_slot_locked(t);
+
+    sched_unlock_irq();
+    return 0;
+}
+
+// nobody will join it: the slot goes back as soon as it's gone (or now, if it already is)
+int kthread_detach(int tid)
+{
+    uint64_t flags = sched_lock_irqsave();
+
+    kthread_t* t = find_thread_locked(tid);
+    if (!t || !t->joinable || t->joining)
+    {
+        sched_unlock_irqrestore(flags);
+        return -1;
+    }
+
+    t->joinable = false;
+    if (t->gone)
+        release_slot_locked(t);
+
+    sched_unlock_irqrestore(flags);
+    return 0;
+}
+
+/* cpu_idle_wait: sleeps until an IRQ or a resched request
+ *  - MWAIT on need_resched's line: a remote wakeup is just the store (resched_cpu skips the IPI)
+ *  - HLT otherwise, woken by the resched IPI
+ *  - a wakeup between the last check and the sleep is never slept through: IF=0 until the
+ *    sti shadow (HLT), or the monitor is armed before the check (MWAIT)
+ */
+static void cpu_idle_wait(void)
+{
+    cpu_t* cpu = this_cpu(); // idle is pinned
+
+    cli();
+
+    if (!idle_mwait)
+    {
+        if (cpu->need_resched)
+            sti();
+        else
+            safe_halt();
+
+        return;
+    }
+
+    __atomic_store_n(&cpu->idle_polling, true, __ATOMIC_SEQ_CST);
+    cpu_monitor(&cpu->need_resched);
+
+    if (__atomic_load_n(&cpu->need_resched, __ATOMIC_SEQ_CST))
+        sti();
+    else
+        safe_mwait();
+
+    __atomic_store_n(&cpu->idle_polling, false, __ATOMIC_RELAXED);
+}
+
+// idle thread (one per CPU, pinned: it never blocks, so it never goes through select_cpu)
+static void idle_thread_fn(void* arg)
+{
+    (void)arg; // isnt needed at this point
+
+    for(;;)
+    {
+        kthread_yield(); // local work, or some stolen from a busier CPU
+        cpu_idle_wait();
+    }
+}
+
+// idle thread of a CPU (init/smp.h for the APs), outside its run queue: cpus[cpu].idle
+kthread_t* kthread_create_idle(int cpu)
+{
+    kthread_t* t = kthread_spawn(idle_thread_fn, NULL, "idle", KTHREAD_PRIO_IDLE, 0, KTHREAD_PINNED, cpu);
+    cpus[cpu].idle = t;
+
+    return t;
+}
+
+void kthread_subsystem_init(void)
+{
+    memset(thread_table, 0, sizeof(thread_table));
+
+    // every slot starts on the free list, lowest index first
+    free_slots = NULL;
+    nr_free_slots = 0;
+    for (int i = MAX_THREADS - 1; i >= 0; --i)
+        release_slot_locked(&thread_table[i]);
+
+    memset(runqueues, 0, sizeof(runqueues));
+    spinlock_init(&sched_lock);
+
+    // CPUID.1:ECX.MONITOR (same on every CPU)
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    idle_mwait_ok = c & (1 << 3);
+    idle_mwait = idle_mwait_ok;
+
+    // runs only when the run queue is empty
+    kthread_create_idle(0);
 }
 
 static const char* state_str(thread_state_t st)
@@ -493,63 +1459,174 @@ static const char* state_str(thread_state_t st)
     }
 }
 
+static void dump_thread(kthread_t* it)
+{
+    kprintf(
+        "  t=%p  id=%d  cpu=%d  prio=%d  state=%s  sp=%p  stack=%p..%p  name=\"%s\"\n",
+        it,
+        it->id,
+        it->cpu,
+        it->prio,
+        state_str(it->state),
+        (void*)it->sp,
+        it->stack,
+        it->stack ? it->stack + it->stack_size : NULL,
+        it->name
+    );
+}
+
 void dump_runqueue(void)
 {
-    cli();
+    uint64_t flags = sched_lock_irqsave();
 
-    if (!runqueue_head)
+    for (int c = 0; c < nr_cpus; ++c)
     {
-        kprintf("[runqueue] <empty>\n");
+        if (!cpus[c].online)
+            continue;
 
-        sti();
-        return;
+        runqueue_t* rq = cpu_rq(c);
+
+        kprintf("[runqueue cpu %d] bitmap=%x queued=%d\n", c, (unsigned int)rq->bitmap, rq->nr_running);
+
+        if (cpus[c].curr)
+        {
+            kprintf(" current:\n");
+            dump_thread(cpus[c].curr);
+        }
+
+        for (int prio = 0; prio < KTHREAD_PRIO_LEVELS; ++prio)
+        {
+            if (!rq->level[prio].head)
+                continue;
+
+            kprintf(" level %d:\n", prio);
+
+            for (kthread_t* it = rq->level[prio].head; it; it = it->next)
+                dump_thread(it);
+        }
     }
 
-    kprintf("[runqueue] head=%p (thread %d)\n", runqueue_head, runqueue_head->id);
+    sched_unlock_irqrestore(flags);
+}
 
-    kthread_t* it = runqueue_head;
-    int i = 0;
+/* dump_sched: top-style accounting (debug sched)
+ *  - times in ms since boot, %CPU of one CPU's uptime, wakeup latency in us
+ *  - sorted by time on CPU; the running / queued stretch in progress is included
+ */
+void dump_sched(void)
+{
+    kthread_t* list[MAX_THREADS];
+    uint64_t run[MAX_THREADS], wait[MAX_THREADS];
+    int n = 0;
+
+    uint64_t flags = sched_lock_irqsave();
+    uint64_t now = rdtsc();
+    uint64_t up = now - tsc_base;
 
-    do
+    uint64_t switches = 0, idle = 0;
+    for (int c = 0; c < nr_cpus; ++c)
     {
-        kprintf(
-            "  #%d  t=%p  id=%d  state=%s  sp=%p  stack=%p..%p  name=\"%s\" next=\"%s\" (%p)\n",
-            i,
-            it,
-            it->id,
-            state_str(it->state),
-            (void*)it->sp,
-            it->stack,
-            it->stack ? it->stack + KTHREAD_STACK_SIZE : NULL,
-            it->name,
-            it->next->name,
-            it->next
-        );
-        it = it->next;
-        i++;
+        if (!cpus[c].online || !cpus[c].idle)
+            continue;
+
+        kthread_t* it = cpus[c].idle;
+        uint64_t ic = it->run_cycles + (cpus[c].curr == it ? sched_delta(it, now) : 0);
+
+        switches += cpus[c].nr_switches;
+        idle += ic;
     }
-    while (it && it != runqueue_head);
 
-    sti();
+    kprintf("[sched] up %d ms  cpus %d  switches %d  idle %d%% (%s)\n", (int)(cycles_to_ns(up) / NSEC_PER_MSEC),
+        nr_cpus, (int)switches, up ? (int)(idle * 100 / (up * nr_cpus)) : 0, idle_mwait ? "mwait" : "hlt");
+    kprintf("  resched IPIs %d  saved by mwait %d\n", (int)resched_ipis, (int)resched_ipis_saved);
+
+    for (int c = 0; c < nr_cpus; ++c)
+    {
+        if (!cpus[c].online || !cpus[c].idle)
+            continue;
+
+        kthread_t* it = cpus[c].idle;
+        uint64_t ic = it->run_cycles + (cpus[c].curr == it ? sched_delta(it, now) : 0);
+
+        kprintf("  cpu %d: switches %d  idle %d ms (%d%%)  queued %d\n", c, (int)cpus[c].nr_switches,
+            (int)(cycles_to_ns(ic) / NSEC_PER_MSEC), up ? (int)(ic * 100 / up) : 0, cpu_rq(c)->nr_running);
+    }
+
+    for (int i = 0; i < MAX_THREADS; ++i)
+    {
+        kthread_t* t = &thread_table[i];
+        if (t->state == THREAD_UNUSED)
+            continue;
+
+        uint64_t r = t->run_cycles + (t->state == THREAD_RUNNING ? sched_delta(t, now) : 0);
+        uint64_t w = t->wait_cycles + (t->state == THREAD_RUNNABLE ? sched_delta(t, now) : 0);
+
+        // insertion by time on CPU, most first
+        int j = n++;
+        for (; j > 0 && run[j - 1] < r; --j)
+        {
+            list[j] = list[j - 1];
+            run[j] = run[j - 1];
+            wait[j] = wait[j - 1];
+        }
+
+        list[j] = t;
+        run[j] = r;
+        wait[j] = w;
+    }
+
+    kprintf("  %4s %3s %3s %-8s %4s %8s %8s %6s %6s %6s %7s %7s  %s\n", "TID", "CPU", "PRI", "STATE",
+        "%CPU", "RUN ms", "WAIT ms", "VCSW", "IVCSW", "WAKES", "LAT us", "MAX us", "NAME");
+
+    for (int i = 0; i < n; ++i)
+    {
+        kthread_t* t = list[i];
+        uint64_t lat = t->nr_wakeups ? t->wake_lat_sum / t->nr_wakeups : 0;
+
+        kprintf("  %4d %3d %3d %-8s %4d %8d %8d %6d %6d %6d %7d %7d  %s\n", t->id, t->cpu, t->prio,
+            state_str(t->state), up ? (int)(run[i] * 100 / up) : 0,
+            (int)(cycles_to_ns(run[i]) / NSEC_PER_MSEC), (int)(cycles_to_ns(wait[i]) / NSEC_PER_MSEC),
+            (int)t->nvcsw, (int)t->nivcsw, (int)t->nr_wakeups,
+            (int)(cycles_to_ns(lat) / NSEC_PER_USEC), (int)(cycles_to_ns(t->wake_lat_max) / NSEC_PER_USEC),
+            t->name);
+    }
+
+    sched_unlock_irqrestore(flags);
 }
 
+/* kthread_start_scheduler: this CPU stops being a boot context and runs threads
+ *  - the boot CPU after init, each AP at the end of its bring-up (init/smp.h)
+ */
 __attribute__((noreturn))
 void kthread_start_scheduler(void)
 {
-    if (!runqueue_head)
-        panic();
+    // no tick may preempt before the first switch (schedule_tail drops the lock and does the sti)
+    sched_lock_irq();
 
-    static uint64_t* saved_sp = NULL;
+    cpu_t* cpu = this_cpu();
 
     // chooses the next thread to be run in queue
-    kthread_t* next = runqueue_head;
+    kthread_t* next = pick_next(cpu_rq(cpu->id));
+    if (!next)
+        next = cpu->idle;
 
-    current = next;
+    if (!next)
+        panic();
+
+    cpu->curr = next;
     next->state = THREAD_RUNNING;
+    next->slice = KTHREAD_TIMESLICE;
+    sched_account_in(cpu, next, rdtsc());
+
+    if (next->prio == KTHREAD_PRIO_IDLE)
+        clock_idle_switch(true);
+
+    fpu_switch(NULL, next);
+    tls_switch(next);
 
     // dump_thread_sp(next);
-    
-    context_switch(&saved_sp, next->sp);
+
+    context_switch(&cpu->boot_sp, next->sp);
 
     __builtin_unreachable();
 }
@@ -0,0 +1,396 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+/*
+ * kernel timers (hierarchical timer wheel, serviced from irq0)
+ *
+ * notas:
+ *  - 4 níveis de 64 slots: nível n guarda timers que vencem em < 64^(n+1) ticks
+ *  - insert/cancel O(1); um slot do nível n só é redistribuído (cascade) quando o nível
+ *    de baixo dá a volta, então cada timer é movido no máximo 3 vezes -> O(1) amortizado
+ *  - callbacks rodam no clock event (IF=0): curtos, sem dormir (acordar thread, desligar speaker...)
+ *  - timers mais longos que 64^4 ticks (~4.6 h at HZ 1000) são truncados
+ *  - tickless: nothing pending -> the wheel just follows the clock instead of walking each tick
+ *  - SMP: one wheel under timer_lock, serviced by the boot CPU; callbacks run with the lock dropped
+ */
+
+#define TIMER_LEVELS    4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS     (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_DELTA ((1ULL << (TIMER_LEVELS * TIMER_SLOT_BITS)) - 1)
+
+typedef struct ktimer
+{
+    struct ktimer* next;  // slot list (doubly-linked for O(1) cancel)
+    struct ktimer* prev;
+    struct ktimer** slot; // wheel slot it sits in
+    uint64_t expires;     // absolute tick
+    void (*fn)(void*);
+    void* arg;
+    bool pending;
+} ktimer_t;
+
+static ktimer_t* timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t timer_jiffies = 0; // next tick the wheel has to process
+static uint64_t timer_pending = 0;
+static spinlock_t timer_lock;               // IF=0; taken after sched_lock, never before
+static ktimer_t* volatile timer_running = NULL; // callback in progress (timer_cancel waits for it)
+
+static inline uint64_t ms_to_ticks(uint64_t ms)
+{
+    return (ms * HZ + 999) / 1000;
+}
+
+void clock_timer_added(uint64_t expires); // init/apic.h: re-arms the event if this one is earlier
+
+void timer_init(ktimer_t* t, void (*fn)(void*), void* arg)
+{
+    t->next = NULL;
+    t->prev = NULL;
+    t->slot = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+    t->pending = false;
+}
+
+// puts a timer in the slot for its expiry (timer_lock held)
+static void timer_enqueue(ktimer_t* t)
+{
+    uint64_t delta = t->expires - timer_jiffies;
+    ktimer_t** slot;
+
+    if ((int64_t)delta < 0)
+        // already due: next tick processed
+        slot = &timer_wheel[0][timer_jiffies & TIMER_SLOT_MASK];
+    else
+    {
+        if (delta > TIMER_MAX_DELTA)
+        {
+            delta = TIMER_MAX_DELTA;
+            t->expires = timer_jiffies + delta;
+        }
+
+        int level = 0;
+        while (delta >= (1ULL << ((level + 1) * TIMER_SLOT_BITS)))
+            level++;
+
+        slot = &timer_wheel[level][(t->expires >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK];
+    }
+
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot)
+        (*slot)->prev = t;
+
+    *slot = t;
+    t->slot = slot;
+}
+
+static void timer_unlink(ktimer_t* t)
+{
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *t->slot = t->next;
+
+    if (t->next)
+        t->next->prev = t->prev;
+
+    t->next = NULL;
+    t->prev = NULL;
+    t->slot = NULL;
+}
+
+/* timer_cancel: stops a pending timer
+ *  - returns true if it was pending (the callback will not run)
+ *  - a callback already running on the boot CPU is waited for: the timer can go away after this
+ *    (so never call it with sched_lock held, the callback may need it)
+ */
+bool timer_cancel(ktimer_t* t)
+{
+    uint64_t flags = irq_save();
+    raw_spin_lock(&timer_lock);
+
+    bool was = t->pending;
+    if (was)
+    {
+        timer_unlink(t);
+        t->pending = false;
+        timer_pending--;
+    }
+
+    raw_spin_unlock(&timer_lock);
+
+    while (timer_running == t && smp_processor_id() != 0)
+        cpu_relax();
+
+    irq_restore(flags);
+    return was;
+}
+
+/* timer_add: one-shot, fn(arg) runs from irq0 `ticks` ticks from now (at least 1)
+ *  - re-arms the timer if it was already pending
+ */
+void timer_add(ktimer_t* t, uint64_t ticks)
+{
+    uint64_t flags = irq_save();
+    raw_spin_lock(&timer_lock);
+
+    if (t->pending)
+    {
+        timer_unlink(t);
+        timer_pending--;
+    }
+
+    if (ticks == 0)
+        ticks = 1;
+
+    uint64_t now = clock_ticks();
+
+    // idle wheel: skip the ticks nobody had to process
+    if (!timer_pending && timer_jiffies <= now)
+        timer_jiffies = now + 1;
+
+    t->expires = now + ticks;
+    t->pending = true;
+    timer_enqueue(t);
+    timer_pending++;
+
+    clock_timer_added(t->expires);
+
+    raw_spin_unlock(&timer_lock);
+    irq_restore(flags);
+}
+
+// moves every timer of a slot of an upper level down to where it belongs now
+static int timer_cascade(int level)
+{
+    int idx = (timer_jiffies >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK;
+
+    ktimer_t* t = timer_wheel[level][idx];
+    timer_wheel[level][idx] = NULL;
+
+    while (t)
+    {
+        ktimer_t* n = t->next;
+        timer_enqueue(t);
+        t = n;
+    }
+
+    return idx;
+}
+
+/* timer_next_expiry: first jiffy the wheel needs to run at (timer_pending != 0, timer_lock held)
+ *  - level 0 holds the next 64 ticks exactly; anything further is in an upper level and
+ *    only moves down on a cascade, so the next wrap of level 0 is a safe upper bound
+ */
+uint64_t timer_next_expiry(void)
+{
+    uint64_t wrap = (timer_jiffies + TIMER_SLOT_MASK) & ~(uint64_t)TIMER_SLOT_MASK;
+
+    for (uint64_t j = timer_jiffies; j < wrap || j == timer_jiffies; ++j)
+        if (timer_wheel[0][j & TIMER_SLOT_MASK])
+            return j;
+
+    return wrap;
+}
+
+// clock event (boot CPU): runs every timer due up to cpu_ticks
+void timer_tick(void)
+{
+    raw_spin_lock(&timer_lock);
+
+    if (!timer_pending)
+    {
+        if (timer_jiffies <= cpu_ticks)
+            timer_jiffies = cpu_ticks + 1;
+
+        raw_spin_unlock(&timer_lock);
+        return;
+    }
+
+    while (timer_jiffies <= cpu_ticks)
+    {
+        int idx = timer_jiffies & TIMER_SLOT_MASK;
+
+        // level 0 wrapped: pull the next slot of level 1 down (and so on upwards)
+        if (!idx)
+        {
+            for (int level = 1; level < TIMER_LEVELS; ++level)
+                if (timer_cascade(level) != 0)
+                    break;
+        }
+
+        // one at a time with the lock dropped around fn: other CPUs may add or cancel meanwhile
+        // (re-added timers expire at least a tick later -> never back in this slot)
+        ktimer_t* t;
+        while ((t = timer_wheel[0][idx]))
+        {
+            timer_unlink(t);
+            t->pending = false;
+            timer_pending--;
+
+            timer_running = t;
+            raw_spin_unlock(&timer_lock);
+
+            t->fn(t->arg);
+
+            raw_spin_lock(&timer_lock);
+            timer_running = NULL;
+        }
+
+        timer_jiffies++;
+    }
+
+    raw_spin_unlock(&timer_lock);
+}
+
+// --- blocking sleeps --------------------------------------------------------
+
+static void sleep_timeout_fn(void* arg)
+{
+    kthread_t* t = arg;
+
+    // checked under the lock: a thread woken on another CPU meanwhile must not see timed_out
+    uint64_t flags = sched_lock_irqsave();
+
+    if (t->state == THREAD_BLOCKED)
+    {
+        t->timed_out = true;
+        thread_wake_locked(t);
+    }
+
+    sched_unlock_irqrestore(flags);
+}
+
+// blocks the calling thread until `ticks` jiffy boundaries went by (off the run queue)
+static void kthread_sleep_ticks(uint64_t ticks)
+{
+    kthread_t* self = current;
+
+    ktimer_t tm;
+    timer_init(&tm, sleep_timeout_fn, self);
+
+    sched_lock_irq();
+
+    self->state = THREAD_BLOCKED;
+    self->wq = NULL;
+    timer_add(&tm, ticks);
+
+    __schedule();
+
+    sched_unlock_reap();
+    sti();
+    timer_cancel(&tm); // woken some other way (never leave it armed on a dead stack)
+}
+
+// blocks the calling thread for at least `ms` (+1: the current tick is already partly gone)
+void kthread_sleep_ms(uint64_t ms)
+{
+    kthread_sleep_ticks(ms_to_ticks(ms) + 1);
+}
+
+/* kthread_sleep_us: sub-tick sleep
+ *  - blocks on the wheel up to the last jiffy boundary before the deadline,
+ *    then spins the rest on ktime (< 1 tick of busy wait)
+ */
+void kthread_sleep_us(uint64_t us)
+{
+    uint64_t deadline = ktime_get() + us * NSEC_PER_USEC;
+    uint64_t now = clock_ticks();
+
+    if (deadline / TICK_NSEC > now)
+        kthread_sleep_ticks(deadline / TICK_NSEC - now);
+
+    while (ktime_get() < deadline)
+        cpu_relax();
+}
+
+/* thread_sleep_timeout_locked: thread_sleep_locked with a limit
+ *  - false if `ms` passed before a wake (the thread is taken off wq)
+ *  - same locking as thread_sleep_locked: sched_lock held in, dropped (IF=1) on the way out
+ */
+static bool __thread_sleep_timeout_locked(waitq_t* wq, uint64_t ms, bool exclusive)
+{
+    kthread_t* self = current;
+
+    ktimer_t tm;
+    timer_init(&tm, sleep_timeout_fn, self);
+
+    self->timed_out = false;
+    timer_add(&tm, ms_to_ticks(ms));
+
+    __thread_sleep_locked(wq, exclusive);
+
+    timer_cancel(&tm);
+    return !self->timed_out;
+}
+
+bool thread_sleep_timeout_locked(waitq_t* wq, uint64_t ms)
+{
+    return __thread_sleep_timeout_locked(wq, ms, false);
+}
+
+bool thread_sleep_timeout(waitq_t* wq, uint64_t ms)
+{
+    sched_lock_irq();
+    return thread_sleep_timeout_locked(wq, ms);
+}
+
+// sem_wait with a limit: false on timeout (the count is given back)
+bool sem_wait_timeout(sem_t* s, uint64_t ms)
+{
+    if (sem_trywait(s))
+        return true;
+
+    sched_lock_irq();
+
+    if (__atomic_fetch_sub(&s->count, 1, __ATOMIC_ACQUIRE) > 0)
+    {
+        sched_unlock_irq();
+        return true;
+    }
+
+    sem_sleeps++;
+    if (__thread_sleep_timeout_locked(&s->wq, ms, true))
+        return true;
+
+    sched_lock_irq();
+
+    // a post between the timeout and here found nobody queued and left its unit as a token
+    bool got = s->wakeups > 0;
+    if (got)
+        s->wakeups--;
+    else
+        __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+
+    sched_unlock_irq();
+
+    return got;
+}
+
+// --- speaker ----------------------------------------------------------------
+
+#define BEEP_MS 50
+
+static ktimer_t beep_timer;
+
+static void beep_off_fn(void* arg)
+{
+    (void)arg;
+    speaker_off();
+}
+
+// speaker on now, off from a timer (no busy wait, safe from ISRs)
+void beep(void)
+{
+    if (!beep_timer.fn)
+        timer_init(&beep_timer, beep_off_fn, NULL);
+
+    speaker_on(1000); // ~1 khz
+    timer_add(&beep_timer, ms_to_ticks(BEEP_MS));
+}
+
+#endif
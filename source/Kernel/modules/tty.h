@@ -40,7 +40,7 @@ struct tty
     // struct task *reader_waiting;
     // struct task *writer_waiting;
 
-    // spinlock_t lock;
+    spinlock_t lock;       // input buffer: kb_tasklet (ldisc) vs readers on other CPUs
 
     // void *driver_data; // opcional
 };
@@ -127,19 +127,33 @@ void vga_clear(void)
 }
 
 struct file* fd_lookup(int fd);
+
+// the cursor is shared by every thread and CPU (IF=0: ISRs print too)
+static spinlock_t console_lock;
+
 void kputc(char c)
 {
+    uint64_t flags = irq_save();
+    spin_lock(&console_lock);
+
     struct file* f = fd_lookup(1);
 
     if (f && f->fops->write)
         write(1, &c, 1);
     else
         vga_pushc(c, 0); // fallback antes do FS existir
+
+    spin_unlock(&console_lock);
+    irq_restore(flags);
 }
 
 void kpopc(void)
 {
+    uint64_t flags = irq_save();
+    spin_lock(&console_lock);
     vga_popc();
+    spin_unlock(&console_lock);
+    irq_restore(flags);
 }
 
 // keyboard 
@@ -151,9 +165,12 @@ struct keyboard_queue_t
     volatile int count;
 };
 struct keyboard_queue_t kb_queue;
-waitq_t kb_thread;
+static spinlock_t kb_lock; // kb_queue: the ISR vs kb_tasklet, IF=0
 
-static void ldisc_input(uint8_t al)
+static void kb_bottom_half(void* arg);
+static tasklet_t kb_tasklet = { .fn = kb_bottom_half };
+
+static void ldisc_input_locked(uint8_t al)
 {
     if (al & 0x80)   // ignora key release
         return;
@@ -188,7 +205,7 @@ static void ldisc_input(uint8_t al)
         tty0.input[len] = '\n';
         tty0.input[len + 1] = 0;
         tty0.line_ready = true;
-        thread_wake_one(&tty0.read_wq);
+        thread_wake_one(&tty0.read_wq); // tty0.lock -> sched_lock
 
         if (tty0.echo)
             kputc('\n');
@@ -215,32 +232,41 @@ static void ldisc_input(uint8_t al)
         kputc(c);
 }
 
-void kb_driver(void* arg)
+static void ldisc_input(uint8_t al)
+{
+    spin_lock(&tty0.lock);
+    ldisc_input_locked(al);
+    spin_unlock(&tty0.lock);
+}
+
+/* kb_bottom_half: keyboard tasklet (softirq context, IF=1, boot CPU)
+ *  - every scancode queued since the last run in one go: a burst costs one pass and no
+ *    thread switch; the reader is only woken when a line is complete (ldisc)
+ */
+static void kb_bottom_half(void* arg)
 {
     (void)arg;
+
     for (;;)
     {
         cli();
+        raw_spin_lock(&kb_lock);
 
         if (kb_queue.count == 0)
         {
+            raw_spin_unlock(&kb_lock);
             sti();
-            thread_sleep(&kb_thread);
-            
-            continue;
+            return;
         }
-        
-        while (kb_queue.count > 0)
-        {
-            cli();
 
-            uint8_t scancode = kb_queue.buffer[kb_queue.tail];
-            kb_queue.tail = (kb_queue.tail + 1) % 256;
-            kb_queue.count--;
-            ldisc_input(scancode);
-      
-            sti();
-        }
+        uint8_t scancode = kb_queue.buffer[kb_queue.tail];
+        kb_queue.tail = (kb_queue.tail + 1) % 256;
+        kb_queue.count--;
+
+        raw_spin_unlock(&kb_lock);
+        sti();
+
+        ldisc_input(scancode);
     }
 }
 
@@ -15,6 +15,115 @@ TEXT  ALIGNED void halt(void) __attribute__((noreturn));
 inline void cli(void) { asm volatile("cli" ::: "memory"); }
 inline void sti(void) { asm volatile("sti" ::: "memory"); }
 
+// cli that remembers if interrupts were on (safe inside ISRs, which run with IF=0)
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+    asm volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline bool irqs_enabled(void)
+{
+    uint64_t flags;
+    asm volatile("pushfq\n\tpopq %0" : "=r"(flags) : : "memory");
+    return flags & 0x200;
+}
+
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & 0x200) // IF
+        sti();
+}
+
+/* per-CPU area (init/smp.h), reached through the GS base
+ *  - self at %gs:0; single-field reads/writes are one gs-relative instruction,
+ *    so they can't be torn by a migration halfway
+ *  - this_cpu() is only stable while the thread can't migrate (IF=0 or preempt_count > 0)
+ */
+#define MAX_CPUS 8
+
+struct kthread;
+
+typedef struct cpu
+{
+    struct cpu* self;
+    struct kthread* curr;     // running thread (current)
+    int preempt_count;        // an IRQ only switches the running thread out at 0
+    int need_resched;         // the tick (time slice over) or a wakeup asked for a switch
+    int id;                   // index in cpus[]
+    uint32_t apic_id;
+    bool online;
+    struct kthread* idle;     // not on the run queue: runs when it is empty
+    bool idle_polling;        // idle in MWAIT on need_resched: storing to it is the wakeup
+    uint64_t* boot_sp;        // stack the scheduler was started from (never resumed)
+    struct kthread* dead;     // exited here, stack freed once off it (threads.h finish_switch)
+    uint8_t* reap_stack;      // left by finish_switch, freed once sched_lock is dropped (sched_unlock_reap)
+    void* reap_fpu;
+    uint64_t nr_switches;     // context switches on this CPU (idle time: idle->run_cycles)
+
+    // clock events (init/apic.h)
+    uint64_t clock_next_event;
+    uint64_t clock_last_tick;
+    uint64_t clock_events;
+    bool clock_idle;
+
+    struct kthread* fpu_owner; // whose FPU registers this CPU holds (init/fpu.h)
+
+    // deferred work (softirq.h)
+    uint32_t softirq_pending;  // raised softirqs, bit n = softirq n
+    int irq_depth;             // inside an IRQ handler (idt.h irq_handle)
+    bool in_softirq;           // running softirq handlers (irq exit or ksoftirqd)
+    struct kthread* ksoftirqd;
+} cpu_t;
+
+static cpu_t cpus[MAX_CPUS];
+static int nr_cpus = 1;
+
+#define this_cpu_read(field)                                                \
+    ({                                                                      \
+        typeof(((cpu_t*)0)->field) v__;                                     \
+        asm volatile("mov %%gs:%c1, %0" : "=r"(v__) : "i"(offsetof(cpu_t, field))); \
+        v__;                                                                \
+    })
+
+#define this_cpu_write(field, value)                                        \
+    asm volatile("mov %1, %%gs:%c0" : : "i"(offsetof(cpu_t, field)),        \
+        "r"((typeof(((cpu_t*)0)->field))(value)) : "memory")
+
+static inline cpu_t* this_cpu(void)
+{
+    return this_cpu_read(self);
+}
+
+static inline int smp_processor_id(void)
+{
+    return this_cpu_read(id);
+}
+
+static inline struct kthread* get_current(void)
+{
+    return this_cpu_read(curr);
+}
+
+#define current get_current()
+
+void preempt_schedule(void);
+
+static inline void preempt_disable(void)
+{
+    asm volatile("incl %%gs:%c0" : : "i"(offsetof(cpu_t, preempt_count)) : "memory");
+}
+
+static inline void preempt_enable(void)
+{
+    bool zero;
+    asm volatile("decl %%gs:%c1" : "=@ccz"(zero) : "i"(offsetof(cpu_t, preempt_count)) : "memory");
+
+    if (zero && this_cpu_read(need_resched))
+        preempt_schedule();
+}
+
 inline void halt(void)
 {
     asm volatile
@@ -34,6 +143,107 @@ inline void safe_halt(void)
     );
 }
 
+// arms the monitor on addr's cache line (a store there ends the next MWAIT)
+static inline void cpu_monitor(const volatile void* addr)
+{
+    asm volatile("monitor" : : "a"(addr), "c"(0), "d"(0));
+}
+
+// sti + mwait (C1): the sti shadow covers the mwait, so an IRQ that was pending still ends it
+static inline void safe_mwait(void)
+{
+    asm volatile(
+        "sti\n\t"
+        "mwait\n\t"
+        : : "a"(0), "c"(0) : "memory"
+    );
+}
+
+inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t sub, uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d)
+{
+    asm volatile ("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(sub));
+}
+
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)) : "memory");
+}
+
+static inline void cpu_relax(void)
+{
+    asm volatile ("pause" ::: "memory");
+}
+
+static inline uint64_t read_cr0(void)
+{
+    uint64_t v;
+    asm volatile ("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v)
+{
+    asm volatile ("mov %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void)
+{
+    uint64_t v;
+    asm volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v)
+{
+    asm volatile ("mov %0, %%cr4" : : "r"(v) : "memory");
+}
+
+// faulting address of the last #PF
+static inline uint64_t read_cr2(void)
+{
+    uint64_t v;
+    asm volatile ("mov %%cr2, %0" : "=r"(v));
+    return v;
+}
+
+static inline uint64_t read_cr3(void)
+{
+    uint64_t v;
+    asm volatile ("mov %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr3(uint64_t v)
+{
+    asm volatile ("mov %0, %%cr3" : : "r"(v) : "memory");
+}
+
+// drops every translation of this CPU (no global pages in this kernel)
+static inline void flush_tlb_local(void)
+{
+    write_cr3(read_cr3());
+}
+
+// CR0.TS off: FPU/SIMD instructions stop trapping (#NM)
+static inline void clts(void)
+{
+    asm volatile ("clts" ::: "memory");
+}
+
 inline void outb(uint16_t port, uint8_t value)
 {
     asm volatile ("outb %0, %1" : : "a"(value), "Nd"(port));
@@ -44,6 +44,7 @@ pstart:
     jmp GDT64.code_ptr:end
 
 %include "source/Struct/gdt64.asm"
+%include "source/Struct/bootinfo.asm"
 
 setup_paging:
     ; VA == VO + PA; 0xffffffff80100000 -> 0x0000000000100000
@@ -103,7 +104,7 @@ KERNEL_PHYSICAL_ENTRY equ 0x100000
 KERNEL_VIRTUAL_ENTRY  equ 0xFFFFFFFF80100000
 
 KERNEL_BLOCK_START equ 8
-KERNEL_BLOCK_COUNT equ 32 ; kernel size -> round up to ~0x1000/512
+KERNEL_BLOCK_COUNT equ 256 ; sectors loaded (128 KiB); the Makefile reads it and fails when kernel.bin is bigger
 
 [BITS 64]
 end:
@@ -124,6 +125,7 @@ end:
     cmp rdi, rsi
     jne .me_handler
 
+    mov rdi, BOOT_INFO                 ; kstart(boot_info) -> physical address
     jmp KERNEL_VIRTUAL_ENTRY
 .me_handler:
     ; if not equal -> mapping failed
@@ -0,0 +1,9 @@
+; boot_info handed to the kernel (kstart(rdi = BOOT_INFO))
+; layout mirrors boot_info_t in source/Kernel/modules/init/map.h
+;   +0  dd e820_count
+;   +4  dd reserved
+;   +8  e820 entries, 24 bytes each (base dq, length dq, type dd, acpi dd)
+BOOT_INFO           equ 0x500
+BOOT_INFO_E820      equ BOOT_INFO + 8
+BOOT_INFO_MAX_E820  equ 32
+E820_ENTRY_SIZE     equ 24